@@ -0,0 +1,27 @@
+#ifndef __BENCH_H__
+#define __BENCH_H__ 1
+
+/**
+ * @file bench.h
+ * @brief stubs.c header file
+ */
+
+#include <glib.h>
+#include <loudmouth/loudmouth.h>
+
+/* The two peers, both living in this process */
+#define BENCH_ALICE    "alice@bench"
+#define BENCH_BOB      "bob@bench"
+#define BENCH_RESOURCE "harness"
+
+/* Called with each stanza on its way, before the handlers of the peer
+ * it is sent to */
+typedef void (*BenchObserver)(LmMessage *m, gpointer user_data);
+
+void bench_init(void);
+void bench_set_option(const gchar *key, const gchar *value);
+void bench_set_verbose(gboolean verbose);
+void bench_set_observer(BenchObserver observer, gpointer user_data);
+gboolean bench_command(const gchar *name, const gchar *arg);
+
+#endif
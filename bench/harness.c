@@ -0,0 +1,566 @@
+/*
+ * harness.c
+ *
+ * Copyright (C) 2026 mcabber-jingle contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+/*
+ * Loads the modules built in this tree, like mcabber would, and has
+ * alice@bench send files to bob@bench with /jft send; bob accepts
+ * everything (see stubs.c). Each transport is measured in a process of
+ * its own, with only that transport loaded:
+ *  - many small files, one session each, a few sessions at a time:
+ *    sessions per second, from the first session-initiate to the last
+ *    session-terminate;
+ *  - one large file: MB/s;
+ *  - then the peak resident set size of the process.
+ * The received files are compared in size with those sent. A phase in
+ * which no stanza went through for a while is reported as stalled, and
+ * the program fails.
+ *
+ * With --micro, it runs microbenchmarks of the jingle core instead (see
+ * micro.c), each in a process of its own as well.
+ */
+
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <gmodule.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include <mcabber/modules.h>
+
+#include "bench.h"
+#include "harness.h"
+#include "micro.h"
+
+#define BENCH_TRANSPORTS "ibb,s5b"
+
+/* Sessions of the first phase, and how many run at once */
+#define BENCH_SESSIONS 200
+#define BENCH_PARALLEL 8
+
+/* Bytes of the files of the first phase, and of the second */
+#define BENCH_SMALL 1024
+#define BENCH_LARGE 16777216
+
+/* Seconds without a stanza before a phase is stalled */
+#define BENCH_IDLE 10
+
+/* Milliseconds between two looks at the clock and at the files */
+#define BENCH_TICK 10
+
+/* A batch of files sent and received */
+typedef struct {
+  const gchar *what;
+  guint files;
+  guint64 size;
+  guint parallel;
+  gchar *srcdir;
+  gchar *dstdir;
+  /* /jft send run, sessions which ended */
+  guint sent;
+  GHashTable *ended;
+  guint failed;
+  guint stanzas;
+  gint64 start;
+  gint64 end;
+  gint64 last_stanza;
+  gboolean stalled;
+  guint next_source;
+  GMainLoop *loop;
+} BenchPhase;
+
+static gchar *opt_transports = NULL;
+static gint opt_sessions = BENCH_SESSIONS;
+static gint opt_parallel = BENCH_PARALLEL;
+static gint opt_small = BENCH_SMALL;
+static gint64 opt_large = BENCH_LARGE;
+static gint opt_idle = BENCH_IDLE;
+static gchar **opt_options = NULL;
+static gchar *opt_modules = NULL;
+static gchar *opt_micro = NULL;
+static gint opt_count = 0;
+static gboolean opt_verbose = FALSE;
+
+static GOptionEntry entries[] = {
+  { "transport", 't', 0, G_OPTION_ARG_STRING, &opt_transports,
+    "Transports to measure, " BENCH_TRANSPORTS " by default", "T1,T2" },
+  { "sessions", 'n', 0, G_OPTION_ARG_INT, &opt_sessions,
+    "Sessions of the first phase", "N" },
+  { "parallel", 'p', 0, G_OPTION_ARG_INT, &opt_parallel,
+    "Sessions running at once in the first phase", "N" },
+  { "small", 'k', 0, G_OPTION_ARG_INT, &opt_small,
+    "Bytes of each file of the first phase", "BYTES" },
+  { "large", 's', 0, G_OPTION_ARG_INT64, &opt_large,
+    "Bytes of the file of the second phase, 0 to skip it", "BYTES" },
+  { "idle", 'i', 0, G_OPTION_ARG_INT, &opt_idle,
+    "Seconds without a stanza before a phase is stalled", "S" },
+  { "option", 'o', 0, G_OPTION_ARG_STRING_ARRAY, &opt_options,
+    "Set an mcabber option, like jingle_ft_compress=0", "KEY=VALUE" },
+  { "modules", 'M', 0, G_OPTION_ARG_FILENAME, &opt_modules,
+    "Directory the modules were built in", "DIR" },
+  { "micro", 'm', 0, G_OPTION_ARG_STRING, &opt_micro,
+    "Run these microbenchmarks instead, or all of them", "M1,M2|all" },
+  { "count", 'c', 0, G_OPTION_ARG_INT, &opt_count,
+    "Size of the microbenchmarks, their own by default", "N" },
+  { "verbose", 'v', 0, G_OPTION_ARG_NONE, &opt_verbose,
+    "Print what the modules log", NULL },
+  { NULL }
+};
+
+/* A module loaded and initialized */
+typedef struct {
+  gchar *name;
+  module_info_t *info;
+} BenchModule;
+
+/* The loaded modules, last loaded first */
+static GSList *loaded = NULL;
+
+/**
+ * @brief Load a module built in the tree and initialize it
+ * @param name The name of the module, like jingle-ft
+ */
+gboolean bench_load(const gchar *name)
+{
+  gchar *dir = g_build_filename(opt_modules, name, NULL);
+  gchar *path = g_module_build_path(dir, name);
+  gchar *symbol = g_strdelimit(g_strconcat("info_", name, NULL), "-", '_');
+  GModule *module = g_module_open(path, G_MODULE_BIND_LAZY);
+  module_info_t *info = NULL;
+
+  if (module == NULL || !g_module_symbol(module, symbol, (gpointer *)&info)) {
+    fprintf(stderr, "%s: %s\n", path, g_module_error());
+    if (module != NULL)
+      g_module_close(module);
+  } else {
+    // Never closed: the main loop may still hold its callbacks
+    g_module_make_resident(module);
+    BenchModule *bm = g_new(BenchModule, 1);
+    bm->name = g_strdup(name);
+    bm->info = info;
+    if (info->init != NULL)
+      info->init();
+    loaded = g_slist_prepend(loaded, bm);
+  }
+  g_free(symbol);
+  g_free(path);
+  g_free(dir);
+  return info != NULL;
+}
+
+static void bench_uninit(BenchModule *bm)
+{
+  if (bm->info->uninit != NULL)
+    bm->info->uninit();
+  g_free(bm->name);
+  g_free(bm);
+}
+
+/**
+ * @brief Unload one module, as /module unload would, the others stay
+ * @return FALSE if it was not loaded
+ */
+gboolean bench_unload(const gchar *name)
+{
+  GSList *el;
+
+  for (el = loaded; el; el = el->next) {
+    BenchModule *bm = (BenchModule *)el->data;
+    if (!g_strcmp0(bm->name, name)) {
+      loaded = g_slist_delete_link(loaded, el);
+      bench_uninit(bm);
+      return TRUE;
+    }
+  }
+  return FALSE;
+}
+
+void bench_unload_all(void)
+{
+  GSList *el;
+
+  for (el = loaded; el; el = el->next)
+    bench_uninit((BenchModule *)el->data);
+  g_slist_free(loaded);
+  loaded = NULL;
+}
+
+static gchar *bench_file(const gchar *dir, guint i)
+{
+  gchar *name = g_strdup_printf("file-%05u", i);
+  gchar *path = g_build_filename(dir, name, NULL);
+
+  g_free(name);
+  return path;
+}
+
+/**
+ * @brief Write the files to send, of random data
+ */
+static gboolean bench_write_files(BenchPhase *ph)
+{
+  GRand *rand = g_rand_new_with_seed(ph->files);
+  guint32 *data = g_new(guint32, ph->size / 4 + 1);
+  gboolean ok = TRUE;
+  guint64 j;
+  guint i;
+
+  for (i = 0; ok && i < ph->files; i++) {
+    gchar *path = bench_file(ph->srcdir, i);
+    for (j = 0; j < ph->size / 4 + 1; j++)
+      data[j] = g_rand_int(rand);
+    ok = g_file_set_contents(path, (const gchar *)data, ph->size, NULL);
+    g_free(path);
+  }
+  g_free(data);
+  g_rand_free(rand);
+  return ok;
+}
+
+void bench_remove_dir(const gchar *path)
+{
+  GDir *dir = g_dir_open(path, 0, NULL);
+  const gchar *name;
+
+  if (dir == NULL)
+    return;
+  while ((name = g_dir_read_name(dir)) != NULL) {
+    gchar *file = g_build_filename(path, name, NULL);
+    g_unlink(file);
+    g_free(file);
+  }
+  g_dir_close(dir);
+  g_rmdir(path);
+}
+
+/**
+ * @brief Start sessions while there is room, stop once all ended
+ */
+static gboolean bench_next(gpointer data)
+{
+  BenchPhase *ph = (BenchPhase *)data;
+  guint ended = g_hash_table_size(ph->ended);
+
+  ph->next_source = 0;
+  while (ph->sent < ph->files && ph->sent - ended < ph->parallel) {
+    gchar *path = bench_file(ph->srcdir, ph->sent++);
+    gchar *arg = g_strdup_printf("send %s", path);
+    bench_command("jft", arg);
+    g_free(arg);
+    g_free(path);
+  }
+  if (ended >= ph->files) {
+    ph->end = g_get_monotonic_time();
+    g_main_loop_quit(ph->loop);
+  }
+  return FALSE;
+}
+
+/**
+ * @brief Count the stanzas and the sessions which ended
+ */
+static void bench_observe(LmMessage *m, gpointer user_data)
+{
+  BenchPhase *ph = (BenchPhase *)user_data;
+  LmMessageNode *jingle = lm_message_node_get_child(m->node, "jingle");
+  LmMessageNode *reason;
+  const gchar *sid;
+
+  ph->last_stanza = g_get_monotonic_time();
+  ph->stanzas++;
+
+  if (jingle == NULL || lm_message_get_sub_type(m) != LM_MESSAGE_SUB_TYPE_SET ||
+      g_strcmp0(lm_message_node_get_attribute(jingle, "action"),
+                "session-terminate"))
+    return;
+
+  // Either peer may end it, the session counts once
+  sid = lm_message_node_get_attribute(jingle, "sid");
+  if (sid == NULL || g_hash_table_lookup_extended(ph->ended, sid, NULL, NULL))
+    return;
+  g_hash_table_insert(ph->ended, g_strdup(sid), NULL);
+
+  reason = lm_message_node_get_child(jingle, "reason");
+  if (reason == NULL || lm_message_node_get_child(reason, "success") == NULL)
+    ph->failed++;
+
+  if (ph->next_source == 0)
+    ph->next_source = g_idle_add(bench_next, ph);
+}
+
+static gboolean bench_watchdog(gpointer data)
+{
+  BenchPhase *ph = (BenchPhase *)data;
+
+  if (g_get_monotonic_time() - ph->last_stanza < opt_idle * G_USEC_PER_SEC)
+    return TRUE;
+  ph->stalled = TRUE;
+  g_main_loop_quit(ph->loop);
+  return FALSE;
+}
+
+/**
+ * @brief The files received complete and published, so far
+ */
+static guint bench_received(BenchPhase *ph)
+{
+  GStatBuf st;
+  guint i, count = 0;
+
+  for (i = 0; i < ph->files; i++) {
+    gchar *path = bench_file(ph->dstdir, i);
+    if (g_stat(path, &st) == 0 && st.st_size == (goffset)ph->size)
+      count++;
+    g_free(path);
+  }
+  return count;
+}
+
+/**
+ * @brief Wait for bob to publish the files, he may still be hashing them
+ *        when the sessions end
+ */
+static guint bench_wait_received(BenchPhase *ph)
+{
+  gint64 deadline = g_get_monotonic_time() + opt_idle * G_USEC_PER_SEC;
+  guint count;
+
+  while ((count = bench_received(ph)) < ph->files &&
+         g_get_monotonic_time() < deadline) {
+    while (g_main_context_iteration(NULL, FALSE))
+      ;
+    g_usleep(BENCH_TICK * 1000);
+  }
+  return count;
+}
+
+/**
+ * @brief Send the files of a phase, and report
+ * @return FALSE if the phase stalled or a file was not received
+ */
+static gboolean bench_phase(const gchar *transport, BenchPhase *ph)
+{
+  gdouble elapsed;
+  guint watchdog, received = 0;
+  gchar *index;
+  gboolean ok;
+
+  ph->srcdir = g_dir_make_tmp("jingle-bench-src-XXXXXX", NULL);
+  ph->dstdir = g_dir_make_tmp("jingle-bench-dst-XXXXXX", NULL);
+  ph->ended = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+  ph->loop = g_main_loop_new(NULL, FALSE);
+
+  if (ph->srcdir == NULL || ph->dstdir == NULL || !bench_write_files(ph)) {
+    fprintf(stderr, "%s: cannot write the files to send\n", transport);
+    ok = FALSE;
+    goto out;
+  }
+  bench_set_option("jingle_ft_dir", ph->dstdir);
+  // Not the index of the user, the stand-ins do not expand ~
+  index = g_build_filename(ph->dstdir, "jft-index", NULL);
+  bench_set_option("jingle_ft_dedup_index", index);
+  g_free(index);
+  bench_set_observer(bench_observe, ph);
+
+  ph->start = ph->last_stanza = g_get_monotonic_time();
+  ph->next_source = g_idle_add(bench_next, ph);
+  watchdog = g_timeout_add(BENCH_TICK, bench_watchdog, ph);
+  g_main_loop_run(ph->loop);
+  if (!ph->stalled)
+    g_source_remove(watchdog);
+  if (ph->next_source != 0)
+    g_source_remove(ph->next_source);
+
+  if (ph->stalled) {
+    printf("%s: %s: stalled, no stanza for %d s, %u of %u sessions ended\n",
+           transport, ph->what, opt_idle, g_hash_table_size(ph->ended),
+           ph->files);
+    ok = FALSE;
+    goto out;
+  }
+
+  received = bench_wait_received(ph);
+  elapsed = (gdouble)(ph->end - ph->start) / G_USEC_PER_SEC;
+  printf("%s: %s: %u sessions in %.3f s, %.1f sessions/s, %.2f MB/s,"
+         " %u stanzas\n", transport, ph->what, ph->files, elapsed,
+         ph->files / elapsed, ph->files * ph->size / elapsed / 1e6,
+         ph->stanzas);
+  ok = ph->failed == 0 && received == ph->files;
+  if (!ok)
+    printf("%s: %s: %u sessions failed, %u of %u files received\n",
+           transport, ph->what, ph->failed, received, ph->files);
+
+out:
+  bench_set_observer(NULL, NULL);
+  if (ph->srcdir != NULL)
+    bench_remove_dir(ph->srcdir);
+  if (ph->dstdir != NULL)
+    bench_remove_dir(ph->dstdir);
+  g_free(ph->srcdir);
+  g_free(ph->dstdir);
+  g_hash_table_destroy(ph->ended);
+  g_main_loop_unref(ph->loop);
+  return ok;
+}
+
+/**
+ * @brief Set up the stand-ins, in the process measuring
+ */
+static void bench_setup(void)
+{
+  guint i;
+
+  bench_init();
+  bench_set_verbose(opt_verbose);
+  for (i = 0; opt_options != NULL && opt_options[i] != NULL; i++) {
+    gchar **kv = g_strsplit(opt_options[i], "=", 2);
+    if (kv[0] != NULL && kv[1] != NULL)
+      bench_set_option(kv[0], kv[1]);
+    g_strfreev(kv);
+  }
+}
+
+/**
+ * @brief Measure a transport, in a process of its own
+ * @return The exit status of that process
+ */
+static int bench_transport(const gchar *transport)
+{
+  BenchPhase sessions = { "sessions" }, large = { "large file" };
+  gchar *module = g_strconcat("jingle-", transport, NULL);
+  struct rusage usage;
+  gboolean ok;
+
+  bench_setup();
+  ok = bench_load("jingle") && bench_load(module) && bench_load("jingle-ft");
+  g_free(module);
+  if (!ok)
+    return 1;
+
+  sessions.files = opt_sessions;
+  sessions.size = opt_small;
+  sessions.parallel = MAX(opt_parallel, 1);
+  ok = bench_phase(transport, &sessions);
+
+  // It would stall the same way
+  if (ok && opt_large > 0) {
+    large.files = 1;
+    large.size = opt_large;
+    large.parallel = 1;
+    ok = bench_phase(transport, &large);
+  }
+
+  bench_unload_all();
+  if (getrusage(RUSAGE_SELF, &usage) == 0)
+    printf("%s: peak RSS %ld KiB\n", transport, usage.ru_maxrss);
+  return ok ? 0 : 1;
+}
+
+/**
+ * @brief Run a microbenchmark, in a process of its own
+ * @return The exit status of that process
+ */
+static int bench_micro_process(const gchar *name)
+{
+  const BenchMicro *micro = bench_micro_find(name);
+  gboolean ok = TRUE;
+  guint i;
+
+  if (micro == NULL) {
+    fprintf(stderr, "%s: no such microbenchmark\n", name);
+    return 2;
+  }
+  bench_setup();
+  for (i = 0; ok && micro->modules[i] != NULL; i++)
+    ok = bench_load(micro->modules[i]);
+  if (ok)
+    ok = micro->run(opt_count);
+  bench_unload_all();
+  return ok ? 0 : 1;
+}
+
+/**
+ * @brief Run each of names in a child process, one after the other
+ * @return FALSE if one of them failed
+ */
+static gboolean bench_fork_each(gchar **names, int (*run)(const gchar *))
+{
+  gboolean ok = TRUE;
+  guint i;
+
+  for (i = 0; names[i] != NULL; i++) {
+    int status = 0;
+    pid_t pid;
+
+    fflush(stdout);
+    pid = fork();
+    if (pid == 0) {
+#if !GLIB_CHECK_VERSION(2, 32, 0)
+      g_thread_init(NULL);
+#endif
+      status = run(names[i]);
+      fflush(stdout);
+      _exit(status);
+    }
+    if (pid < 0 || waitpid(pid, &status, 0) != pid ||
+        !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+      if (pid > 0 && !WIFEXITED(status))
+        printf("%s: crashed\n", names[i]);
+      ok = FALSE;
+    }
+  }
+  return ok;
+}
+
+int main(int argc, char **argv)
+{
+  GOptionContext *context;
+  GError *err = NULL;
+  gchar **names;
+  gboolean ok;
+
+  context = g_option_context_new("- measure the jingle modules without"
+                                 " a network");
+  g_option_context_add_main_entries(context, entries, NULL);
+  if (!g_option_context_parse(context, &argc, &argv, &err)) {
+    fprintf(stderr, "%s\n", err->message);
+    g_error_free(err);
+    return 2;
+  }
+  g_option_context_free(context);
+  if (opt_modules == NULL)
+    opt_modules = g_strdup(BENCH_MODULE_DIR);
+
+  if (opt_micro != NULL) {
+    names = !g_strcmp0(opt_micro, "all") ? bench_micro_names()
+                                         : g_strsplit(opt_micro, ",", 0);
+    ok = bench_fork_each(names, bench_micro_process);
+  } else {
+    names = g_strsplit(opt_transports != NULL ? opt_transports
+                                              : BENCH_TRANSPORTS, ",", 0);
+    ok = bench_fork_each(names, bench_transport);
+  }
+  g_strfreev(names);
+  return ok ? 0 : 1;
+}
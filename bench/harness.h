@@ -0,0 +1,16 @@
+#ifndef __BENCH_HARNESS_H__
+#define __BENCH_HARNESS_H__ 1
+
+/**
+ * @file harness.h
+ * @brief harness.c header file
+ */
+
+#include <glib.h>
+
+gboolean bench_load(const gchar *name);
+gboolean bench_unload(const gchar *name);
+void bench_unload_all(void);
+void bench_remove_dir(const gchar *path);
+
+#endif
@@ -0,0 +1,685 @@
+/*
+ * micro.c
+ *
+ * Copyright (C) 2026 mcabber-jingle contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+/*
+ * Microbenchmarks of the jingle core, run by jingle-bench --micro.
+ *
+ * The functions measured are those of the modules loaded, looked up by
+ * name: this program is not linked with them. Where only functions the
+ * first version of the modules already had are used, the same
+ * microbenchmark can measure an older build, given with --modules.
+ */
+
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <gmodule.h>
+#include <stdio.h>
+#include <string.h>
+#ifdef __GLIBC__
+# include <malloc.h>
+#endif
+
+#include <jingle/jingle.h>
+#include <jingle/check.h>
+#include <jingle/sessions.h>
+
+#include <jingle-ft/filetransfer.h>
+#include <jingle-ibb/ibb.h>
+
+#include "bench.h"
+#include "harness.h"
+#include "micro.h"
+
+/* Sessions of the registry benchmark, and lookups at each size */
+#define MICRO_SESSIONS 10000
+#define MICRO_LOOKUPS  1000000
+
+/* Actions and namespaces looked up by the dispatch benchmark */
+#define MICRO_DISPATCHES 10000000
+
+/* session-initiate parsed for each number of contents */
+#define MICRO_PARSES 100000
+
+/* Bytes of the file being sent when jingle-ft is unloaded, and stanzas
+ * exchanged before */
+#define MICRO_UNLOAD_SIZE     8388608
+#define MICRO_UNLOAD_STANZAS  50
+
+/* Chunks given to the send path, and their size */
+#define MICRO_CHUNKS     1000000
+#define MICRO_CHUNK_SIZE 2048
+
+#define NS_MICRO_APP       NS_JINGLE_APP_PREFIX "bench"
+#define NS_MICRO_TRANSPORT NS_JINGLE_TRANSPORT_PREFIX "bench"
+
+static gboolean micro_registry(guint count);
+static gboolean micro_footprint(guint count);
+static gboolean micro_send(guint count);
+static gboolean micro_dispatch(guint count);
+static gboolean micro_parse(guint count);
+static gboolean micro_unload(guint count);
+
+static const BenchMicro micros[] = {
+  { "registry",  { "jingle", NULL }, micro_registry },
+  { "footprint", { "jingle", NULL }, micro_footprint },
+  { "send",      { "jingle", NULL }, micro_send },
+  { "dispatch",  { "jingle", "jingle-ft", "jingle-ibb", NULL },
+    micro_dispatch },
+  { "parse",     { "jingle", NULL }, micro_parse },
+  { "unload",    { "jingle", "jingle-ibb", "jingle-ft", NULL },
+    micro_unload },
+};
+
+#ifdef __GLIBC__
+/* Every allocation of the process, the modules and glib included, goes
+ * through these: the executable exports them, and comes first */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static gint micro_allocs = 0;
+
+void *malloc(size_t size)
+{
+  g_atomic_int_inc(&micro_allocs);
+  return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+  g_atomic_int_inc(&micro_allocs);
+  return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+  g_atomic_int_inc(&micro_allocs);
+  return __libc_realloc(ptr, size);
+}
+#endif
+
+/**
+ * @brief Allocations so far, or -1 where they are not counted
+ */
+static gint micro_alloc_count(void)
+{
+#ifdef __GLIBC__
+  return g_atomic_int_get(&micro_allocs);
+#else
+  return -1;
+#endif
+}
+
+/**
+ * @brief Find a function of the loaded modules
+ */
+static gpointer micro_symbol(const gchar *name)
+{
+  static GModule *self = NULL;
+  gpointer symbol = NULL;
+
+  if (self == NULL)
+    self = g_module_open(NULL, 0);
+  if (self == NULL || !g_module_symbol(self, name, &symbol))
+    fprintf(stderr, "%s: %s\n", name, g_module_error());
+  return symbol;
+}
+
+#define MICRO_SYMBOL(var, name) \
+  ((*(gpointer *)&(var) = micro_symbol(name)) != NULL)
+
+/**
+ * @brief Nanoseconds per operation since start
+ */
+static gdouble micro_ns(gint64 start, guint ops)
+{
+  return (g_get_monotonic_time() - start) * 1000.0 / MAX(ops, 1);
+}
+
+const BenchMicro *bench_micro_find(const gchar *name)
+{
+  guint i;
+
+  for (i = 0; i < G_N_ELEMENTS(micros); i++)
+    if (!g_strcmp0(micros[i].name, name))
+      return &micros[i];
+  return NULL;
+}
+
+gchar **bench_micro_names(void)
+{
+  gchar **names = g_new0(gchar *, G_N_ELEMENTS(micros) + 1);
+  guint i;
+
+  for (i = 0; i < G_N_ELEMENTS(micros); i++)
+    names[i] = g_strdup(micros[i].name);
+  return names;
+}
+
+/**
+ * @brief Insert, look up and delete sessions, with ten times more
+ *        sessions at each round up to count
+ *
+ * The cost of an operation should not grow with the number of sessions.
+ */
+static gboolean micro_registry(guint count)
+{
+  JingleSession *(*new_session)(const gchar *, const gchar *, const gchar *,
+                                SessionOrigin);
+  JingleSession *(*find_session)(const gchar *, const gchar *);
+  void (*delete_session)(JingleSession *);
+  const gchar *peer = BENCH_BOB "/" BENCH_RESOURCE;
+  JingleSession **sessions;
+  gchar **sids;
+  guint n, i, missed = 0;
+  gint64 start;
+  gdouble insert, lookup, del;
+
+  if (!MICRO_SYMBOL(new_session, "session_new") ||
+      !MICRO_SYMBOL(find_session, "session_find_by_sid") ||
+      !MICRO_SYMBOL(delete_session, "session_delete"))
+    return FALSE;
+
+  count = count > 0 ? count : MICRO_SESSIONS;
+  sessions = g_new(JingleSession *, count);
+  sids = g_new(gchar *, count);
+  for (i = 0; i < count; i++)
+    sids[i] = g_strdup_printf("%08x%u", g_random_int(), i);
+
+  for (n = MIN(count, 10); ; n = MIN(n * 10, count)) {
+    start = g_get_monotonic_time();
+    for (i = 0; i < n; i++)
+      sessions[i] = new_session(sids[i], BENCH_ALICE "/" BENCH_RESOURCE,
+                                peer, JINGLE_SESSION_OUTGOING);
+    insert = micro_ns(start, n);
+
+    // Spread over the table, not always the same few sessions
+    start = g_get_monotonic_time();
+    for (i = 0; i < MICRO_LOOKUPS; i++)
+      if (find_session(sids[(i * 7919u) % n], peer) == NULL)
+        missed++;
+    lookup = micro_ns(start, MICRO_LOOKUPS);
+
+    start = g_get_monotonic_time();
+    for (i = 0; i < n; i++)
+      delete_session(sessions[i]);
+    del = micro_ns(start, n);
+
+    printf("registry: %6u sessions: insert %6.0f ns, lookup %6.0f ns,"
+           " delete %6.0f ns\n", n, insert, lookup, del);
+    if (n == count)
+      break;
+  }
+
+  for (i = 0; i < count; i++)
+    g_free(sids[i]);
+  g_free(sids);
+  g_free(sessions);
+  if (missed > 0)
+    printf("registry: %u lookups did not find their session\n", missed);
+  return missed == 0;
+}
+
+/**
+ * @brief Bytes of the heap in use, malloc overhead included, or 0 where
+ *        the C library cannot tell
+ */
+static gsize micro_heap_size(void)
+{
+#ifdef __GLIBC__
+# if __GLIBC_PREREQ(2, 33)
+  return mallinfo2().uordblks;
+# else
+  return (guint) mallinfo().uordblks;
+# endif
+#else
+  return 0;
+#endif
+}
+
+/**
+ * @brief Heap taken by count idle sessions, each with a file transfer
+ *        content on IBB, as a session waiting for an answer holds
+ */
+static gboolean micro_footprint(guint count)
+{
+  JingleSession *(*new_session)(const gchar *, const gchar *, const gchar *,
+                                SessionOrigin);
+  SessionContent *(*add_content)(JingleSession *, const gchar *,
+                                 SessionState);
+  void (*add_app)(JingleSession *, const gchar *, const gchar *,
+                  gconstpointer);
+  void (*add_trans)(JingleSession *, const gchar *, const gchar *,
+                    gconstpointer);
+  void (*delete_session)(JingleSession *);
+  JingleSession **sessions;
+  gchar **sids;
+  guint i;
+  gsize before, after;
+
+  if (!MICRO_SYMBOL(new_session, "session_new") ||
+      !MICRO_SYMBOL(add_content, "session_add_content") ||
+      !MICRO_SYMBOL(add_app, "session_add_app") ||
+      !MICRO_SYMBOL(add_trans, "session_add_trans") ||
+      !MICRO_SYMBOL(delete_session, "session_delete"))
+    return FALSE;
+
+  count = count > 0 ? count : MICRO_SESSIONS;
+  sessions = g_new(JingleSession *, count);
+  sids = g_new(gchar *, count);
+  for (i = 0; i < count; i++)
+    sids[i] = g_strdup_printf("%08x%u", g_random_int(), i);
+
+  // The tables of the registry are there before the first session
+  delete_session(new_session("warmup", BENCH_ALICE "/" BENCH_RESOURCE,
+                             BENCH_BOB "/" BENCH_RESOURCE,
+                             JINGLE_SESSION_OUTGOING));
+
+  before = micro_heap_size();
+  for (i = 0; i < count; i++) {
+    sessions[i] = new_session(sids[i], BENCH_ALICE "/" BENCH_RESOURCE,
+                              BENCH_BOB "/" BENCH_RESOURCE,
+                              JINGLE_SESSION_OUTGOING);
+    add_content(sessions[i], "file", JINGLE_SESSION_STATE_PENDING);
+    // Only their addresses are used: the tables are keyed by them
+    add_app(sessions[i], "file", NS_JINGLE_APP_FT, &sessions[i]);
+    add_trans(sessions[i], "file", NS_JINGLE_TRANSPORT_IBB, &sids[i]);
+  }
+  after = micro_heap_size();
+
+  if (before == 0 && after == 0)
+    printf("footprint: the heap in use is unknown with this C library\n");
+  else
+    printf("footprint: %u idle sessions: %" G_GSIZE_FORMAT
+           " bytes per session\n", count, (after - before) / count);
+
+  for (i = 0; i < count; i++) {
+    delete_session(sessions[i]);
+    g_free(sids[i]);
+  }
+  g_free(sids);
+  g_free(sessions);
+  return TRUE;
+}
+
+/* The app and transport of the send benchmark: the app gives a chunk
+ * each time the transport asks for the next one */
+static struct {
+  void (*app_data)(const gchar *, const gchar *, const gchar *,
+                   const gchar *, gsize);
+  gchar chunk[MICRO_CHUNK_SIZE];
+  session_content *next;
+  guint64 sent;
+} micro_flow;
+
+static void micro_app_send(session_content *sc)
+{
+  micro_flow.app_data(sc->sid, sc->from, sc->name, micro_flow.chunk,
+                      sizeof(micro_flow.chunk));
+}
+
+static void micro_trans_send(session_content *sc, gconstpointer data,
+                             const gchar *buf, gsize size)
+{
+  micro_flow.sent += size;
+  micro_flow.next = sc;
+}
+
+/**
+ * @brief Allocations of the send path once it runs: an app handing
+ *        chunks over to a transport, count times
+ *
+ * Without any rate limit, a chunk goes from the app to the transport
+ * without a single allocation. The transport is a stand-in, its own
+ * buffers are not counted.
+ */
+static gboolean micro_send(guint count)
+{
+  static JingleAppFuncs app = { .send = micro_app_send };
+  static JingleTransportFuncs trans = { .send = micro_trans_send };
+  void (*register_app)(const gchar *, JingleAppFuncs *, JingleTransportType);
+  void (*register_trans)(const gchar *, JingleTransportFuncs *,
+                         JingleTransportType, JingleTransportPriority);
+  void (*unregister_app)(const gchar *);
+  void (*unregister_trans)(const gchar *);
+  void (*trans_next)(session_content *);
+  JingleSession *(*new_session)(const gchar *, const gchar *, const gchar *,
+                                SessionOrigin);
+  SessionContent *(*add_content)(JingleSession *, const gchar *,
+                                 SessionState);
+  void (*add_app)(JingleSession *, const gchar *, const gchar *,
+                  gconstpointer);
+  void (*add_trans)(JingleSession *, const gchar *, const gchar *,
+                    gconstpointer);
+  void (*delete_session)(JingleSession *);
+  JingleSession *sess;
+  SessionContent *sc;
+  gint64 start;
+  gint allocs;
+  guint i;
+
+  if (!MICRO_SYMBOL(register_app, "jingle_register_app") ||
+      !MICRO_SYMBOL(register_trans, "jingle_register_transport") ||
+      !MICRO_SYMBOL(unregister_app, "jingle_unregister_app") ||
+      !MICRO_SYMBOL(unregister_trans, "jingle_unregister_transport") ||
+      !MICRO_SYMBOL(trans_next, "handle_trans_next") ||
+      !MICRO_SYMBOL(micro_flow.app_data, "handle_app_data") ||
+      !MICRO_SYMBOL(new_session, "session_new") ||
+      !MICRO_SYMBOL(add_content, "session_add_content") ||
+      !MICRO_SYMBOL(add_app, "session_add_app") ||
+      !MICRO_SYMBOL(add_trans, "session_add_trans") ||
+      !MICRO_SYMBOL(delete_session, "session_delete"))
+    return FALSE;
+
+  count = count > 0 ? count : MICRO_CHUNKS;
+  register_app(NS_MICRO_APP, &app, JINGLE_TRANSPORT_STREAMING);
+  register_trans(NS_MICRO_TRANSPORT, &trans, JINGLE_TRANSPORT_STREAMING,
+                 JINGLE_TRANSPORT_PRIO_LOW);
+  sess = new_session("micro", BENCH_ALICE "/" BENCH_RESOURCE,
+                     BENCH_BOB "/" BENCH_RESOURCE, JINGLE_SESSION_OUTGOING);
+  sc = add_content(sess, "file", JINGLE_SESSION_STATE_ACTIVE);
+  add_app(sess, "file", NS_MICRO_APP, &app);
+  add_trans(sess, "file", NS_MICRO_TRANSPORT, &trans);
+
+  // The first chunk, which is not counted
+  micro_app_send(&sc->handle);
+
+  allocs = micro_alloc_count();
+  start = g_get_monotonic_time();
+  for (i = 0; i < count && micro_flow.next != NULL; i++)
+    trans_next(micro_flow.next);
+  if (allocs >= 0)
+    allocs = micro_alloc_count() - allocs;
+  printf("send: %u chunks of %u bytes: %6.0f ns per chunk",
+         i, MICRO_CHUNK_SIZE, micro_ns(start, i));
+  if (allocs >= 0)
+    printf(", %d allocations", allocs);
+  printf("\n");
+
+  delete_session(sess);
+  unregister_app(NS_MICRO_APP);
+  unregister_trans(NS_MICRO_TRANSPORT);
+  return i == count && allocs <= 0;
+}
+
+/**
+ * @brief Cost of finding the action of an incoming jingle IQ and the
+ *        app and transport of each of its contents
+ *
+ * The names are copies, as they come out of a parsed stanza: a lookup
+ * cannot get away with comparing pointers.
+ */
+static gboolean micro_dispatch(guint count)
+{
+  static const gchar *actions[] = {
+    "content-accept", "content-add", "content-modify", "content-reject",
+    "content-remove", "description-info", "security-info", "session-accept",
+    "session-info", "session-initiate", "session-terminate",
+    "transport-accept", "transport-info", "transport-reject",
+    "transport-replace", "no-such-action",
+  };
+  static const gchar *apps[] = { NS_JINGLE_APP_FT, NS_JINGLE_APP_PREFIX "x" };
+  static const gchar *transports[] = {
+    NS_JINGLE_TRANSPORT_IBB, NS_JINGLE_TRANSPORT_PREFIX "x"
+  };
+  JingleAction (*action_from_str)(const gchar *);
+  JingleAppFuncs *(*get_app)(const gchar *);
+  JingleTransportFuncs *(*get_trans)(const gchar *);
+  gchar *names[G_N_ELEMENTS(actions)];
+  gchar *appns[G_N_ELEMENTS(apps)];
+  gchar *transns[G_N_ELEMENTS(transports)];
+  guint i, wrong = 0;
+  gint64 start;
+
+  if (!MICRO_SYMBOL(action_from_str, "jingle_action_from_str") ||
+      !MICRO_SYMBOL(get_app, "jingle_get_appfuncs") ||
+      !MICRO_SYMBOL(get_trans, "jingle_get_transportfuncs"))
+    return FALSE;
+
+  count = count > 0 ? count : MICRO_DISPATCHES;
+  for (i = 0; i < G_N_ELEMENTS(actions); i++)
+    names[i] = g_strdup(actions[i]);
+  for (i = 0; i < G_N_ELEMENTS(apps); i++)
+    appns[i] = g_strdup(apps[i]);
+  for (i = 0; i < G_N_ELEMENTS(transports); i++)
+    transns[i] = g_strdup(transports[i]);
+
+  // The last action is unknown, the others follow the enum
+  start = g_get_monotonic_time();
+  for (i = 0; i < count; i++) {
+    guint a = i % G_N_ELEMENTS(names);
+    JingleAction expected = (a + 1 < G_N_ELEMENTS(names)) ?
+                            (JingleAction)(a + 1) : JINGLE_UNKNOWN_ACTION;
+    if (action_from_str(names[a]) != expected)
+      wrong++;
+  }
+  printf("dispatch: action %6.1f ns", micro_ns(start, count));
+
+  // Only the file transfer and IBB are loaded
+  start = g_get_monotonic_time();
+  for (i = 0; i < count; i++) {
+    guint a = i % G_N_ELEMENTS(appns);
+    if ((get_app(appns[a]) != NULL) != (a == 0))
+      wrong++;
+  }
+  printf(", app %6.1f ns", micro_ns(start, count));
+
+  start = g_get_monotonic_time();
+  for (i = 0; i < count; i++) {
+    guint t = i % G_N_ELEMENTS(transns);
+    if ((get_trans(transns[t]) != NULL) != (t == 0))
+      wrong++;
+  }
+  printf(", transport %6.1f ns\n", micro_ns(start, count));
+
+  for (i = 0; i < G_N_ELEMENTS(names); i++)
+    g_free(names[i]);
+  for (i = 0; i < G_N_ELEMENTS(appns); i++)
+    g_free(appns[i]);
+  for (i = 0; i < G_N_ELEMENTS(transns); i++)
+    g_free(transns[i]);
+  if (wrong > 0)
+    printf("dispatch: %u lookups gave the wrong answer\n", wrong);
+  return wrong == 0;
+}
+
+/**
+ * @brief A session-initiate offering contents files on IBB
+ */
+static LmMessage *micro_initiate(guint contents)
+{
+  LmMessage *m = lm_message_new_with_sub_type(BENCH_BOB "/" BENCH_RESOURCE,
+                                              LM_MESSAGE_TYPE_IQ,
+                                              LM_MESSAGE_SUB_TYPE_SET);
+  LmMessageNode *jnode, *node;
+  guint i;
+
+  lm_message_node_set_attribute(lm_message_get_node(m), "from",
+                                BENCH_ALICE "/" BENCH_RESOURCE);
+  jnode = lm_message_node_add_child(lm_message_get_node(m), "jingle", NULL);
+  lm_message_node_set_attributes(jnode, "xmlns", NS_JINGLE,
+                                 "action", "session-initiate",
+                                 "initiator", BENCH_ALICE "/" BENCH_RESOURCE,
+                                 "sid", "micro", NULL);
+  for (i = 0; i < contents; i++) {
+    gchar *name = g_strdup_printf("file%u", i);
+
+    node = lm_message_node_add_child(jnode, "content", NULL);
+    lm_message_node_set_attributes(node, "creator", "initiator",
+                                   "name", name, "senders", "initiator",
+                                   NULL);
+    lm_message_node_set_attribute(
+      lm_message_node_add_child(node, "description", NULL),
+      "xmlns", NS_JINGLE_APP_FT);
+    lm_message_node_set_attributes(
+      lm_message_node_add_child(node, "transport", NULL),
+      "xmlns", NS_JINGLE_TRANSPORT_IBB, "block-size", "4096",
+      "sid", name, NULL);
+    g_free(name);
+  }
+  return m;
+}
+
+/**
+ * @brief Parse session-initiate IQs with 1, 10 and 100 contents, count
+ *        times each, as the IQ handler does
+ */
+static gboolean micro_parse(guint count)
+{
+  static const guint sizes[] = { 1, 10, 100 };
+  JingleNode *(*new_node)(void);
+  gboolean (*check)(LmMessage *, LmMessageNode *, JingleNode *, GError **);
+  gboolean (*check_all)(JingleNode *, GError **);
+  void (*free_node)(JingleNode *);
+  guint s, i, failed = 0;
+  gint64 start;
+  gint allocs;
+  gdouble elapsed;
+
+  if (!MICRO_SYMBOL(new_node, "jingle_new_jinglenode") ||
+      !MICRO_SYMBOL(check, "check_jingle") ||
+      !MICRO_SYMBOL(check_all, "check_contents") ||
+      !MICRO_SYMBOL(free_node, "jingle_free_jinglenode"))
+    return FALSE;
+
+  count = count > 0 ? count : MICRO_PARSES;
+  for (s = 0; s < G_N_ELEMENTS(sizes); s++) {
+    LmMessage *m = micro_initiate(sizes[s]);
+    LmMessageNode *jnode = lm_message_node_get_child(lm_message_get_node(m),
+                                                     "jingle");
+
+    allocs = micro_alloc_count();
+    start = g_get_monotonic_time();
+    for (i = 0; i < count; i++) {
+      JingleNode *jn = new_node();
+      GError *err = NULL;
+
+      if (!check(m, jnode, jn, &err) || !check_all(jn, &err)) {
+        failed++;
+        g_clear_error(&err);
+      }
+      free_node(jn);
+    }
+    elapsed = (g_get_monotonic_time() - start) / (gdouble)G_USEC_PER_SEC;
+    if (allocs >= 0)
+      allocs = micro_alloc_count() - allocs;
+
+    printf("parse: %3u contents: %9.0f IQs/s, %10.0f contents/s",
+           sizes[s], count / MAX(elapsed, 1e-6),
+           count * sizes[s] / MAX(elapsed, 1e-6));
+    if (allocs >= 0)
+      printf(", %.1f allocations per IQ", allocs / (gdouble)MAX(count, 1));
+    printf("\n");
+    lm_message_unref(m);
+  }
+
+  if (failed > 0)
+    printf("parse: %u IQs were refused\n", failed);
+  return failed == 0;
+}
+
+/* Stanzas seen by the unload check, and session-terminates among them */
+typedef struct {
+  guint stanzas;
+  guint terminates;
+} MicroTraffic;
+
+static void micro_observe(LmMessage *m, gpointer user_data)
+{
+  MicroTraffic *t = (MicroTraffic *)user_data;
+  LmMessageNode *jingle = lm_message_node_get_child(m->node, "jingle");
+
+  t->stanzas++;
+  if (jingle != NULL && lm_message_get_sub_type(m) == LM_MESSAGE_SUB_TYPE_SET
+      && !g_strcmp0(lm_message_node_get_attribute(jingle, "action"),
+                    "session-terminate"))
+    t->terminates++;
+}
+
+/**
+ * @brief Run the main loop for usec, or until stanzas went through
+ */
+static void micro_run_until(MicroTraffic *t, guint stanzas, gint64 usec)
+{
+  gint64 deadline = g_get_monotonic_time() + usec;
+
+  while (t->stanzas < stanzas && g_get_monotonic_time() < deadline)
+    if (!g_main_context_iteration(NULL, FALSE))
+      g_usleep(1000);
+}
+
+/**
+ * @brief Unload jingle-ft in the middle of a transfer, then let the
+ *        acks in flight, the peer's session-terminate and a reaper
+ *        tick come
+ *
+ * Not a measure: it fails if the sessions were not terminated, and
+ * crashes if something still used a freed transfer.
+ */
+static gboolean micro_unload(guint count)
+{
+  MicroTraffic t = { 0, 0 };
+  gchar *srcdir = g_dir_make_tmp("jingle-bench-src-XXXXXX", NULL);
+  gchar *dstdir = g_dir_make_tmp("jingle-bench-dst-XXXXXX", NULL);
+  gchar *path = NULL, *arg = NULL, *data = NULL;
+  gboolean ok = FALSE;
+  guint i;
+
+  if (srcdir == NULL || dstdir == NULL)
+    goto out;
+  path = g_build_filename(srcdir, "file", NULL);
+  // Neither holes nor compressible, it takes its time
+  data = g_malloc(MICRO_UNLOAD_SIZE);
+  for (i = 0; i < MICRO_UNLOAD_SIZE / 4; i++)
+    ((guint32 *)data)[i] = g_random_int();
+  if (!g_file_set_contents(path, data, MICRO_UNLOAD_SIZE, NULL))
+    goto out;
+
+  bench_set_option("jingle_ft_dir", dstdir);
+  bench_set_observer(micro_observe, &t);
+  arg = g_strdup_printf("send %s", path);
+  bench_command("jft", arg);
+  micro_run_until(&t, MICRO_UNLOAD_STANZAS, 10 * G_USEC_PER_SEC);
+  if (t.stanzas < MICRO_UNLOAD_STANZAS || t.terminates > 0) {
+    printf("unload: the transfer did not start (%u stanzas)\n", t.stanzas);
+    goto out;
+  }
+
+  bench_unload("jingle-ft");
+  micro_run_until(&t, G_MAXUINT,
+                  (JINGLE_SESSION_REAPER_TICK + 1) * G_USEC_PER_SEC);
+  ok = t.terminates > 0;
+  printf("unload: jingle-ft unloaded after %u stanzas, %u session-terminate"
+         " sent\n", MICRO_UNLOAD_STANZAS, t.terminates);
+
+out:
+  bench_set_observer(NULL, NULL);
+  if (srcdir != NULL)
+    bench_remove_dir(srcdir);
+  if (dstdir != NULL)
+    bench_remove_dir(dstdir);
+  g_free(srcdir);
+  g_free(dstdir);
+  g_free(path);
+  g_free(arg);
+  g_free(data);
+  return ok;
+}
@@ -0,0 +1,28 @@
+#ifndef __BENCH_MICRO_H__
+#define __BENCH_MICRO_H__ 1
+
+/**
+ * @file micro.h
+ * @brief micro.c header file
+ */
+
+#include <glib.h>
+
+typedef struct {
+  const gchar *name;
+
+  /* Modules loaded first, in this order */
+  const gchar *modules[4];
+
+  /**
+   * @brief Measure and print the results
+   * @param count The size asked with --count, 0 for the default one
+   * @return FALSE if something did not work as it should
+   */
+  gboolean (*run)(guint count);
+} BenchMicro;
+
+const BenchMicro *bench_micro_find(const gchar *name);
+gchar **bench_micro_names(void);
+
+#endif
@@ -0,0 +1,593 @@
+/*
+ * stubs.c
+ *
+ * Copyright (C) 2026 mcabber-jingle contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+/*
+ * What the modules take from mcabber and from its XMPP connection, for
+ * two peers in one process: alice@bench and bob@bench, each the only
+ * contact of the other, with every feature.
+ *
+ * A stanza sent by one peer is handed to the other from the main loop,
+ * like the server would once it put the from attribute; it goes through
+ * neither a socket nor an XML parser. Both peers share the handlers the
+ * modules registered, as the modules keep their state per session.
+ *
+ * These definitions are exported by the executable and take precedence
+ * over those of loudmouth for the modules, which loudmouth is still
+ * linked for: messages and nodes are the real ones. The handlers are
+ * ours, only the modules see them.
+ *
+ * The mcabber headers are not included, the functions are defined with
+ * the types of the mcabber 0.10 API.
+ */
+
+#include <glib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include <loudmouth/loudmouth.h>
+
+#include "bench.h"
+
+/* mcabber/events.h */
+#define BENCH_EVS_CONTEXT_ACCEPT 2
+
+static GHashTable *options;
+static GHashTable *guards;
+static GHashTable *commands;
+static gboolean verbose;
+
+static BenchObserver observer;
+static gpointer observer_data;
+
+/* A registered handler of loudmouth */
+typedef struct {
+  LmMessageHandler *handler;
+  LmMessageType type;
+  LmHandlerPriority priority;
+} BenchHandler;
+
+/* What an LmMessageHandler points to */
+typedef struct {
+  LmHandleMessageFunction function;
+  gpointer user_data;
+  GDestroyNotify notify;
+  gboolean valid;
+  gint ref_count;
+} BenchMessageHandler;
+
+#define BENCH_HANDLER(h) ((BenchMessageHandler *)(h))
+
+/* BenchHandler, highest priority first */
+static GSList *handlers;
+
+/* Handlers waiting for the reply to an IQ, by id */
+static GHashTable *replies;
+
+/* Stanzas on their way, and the idle source delivering them */
+static GQueue stanzas = G_QUEUE_INIT;
+static guint deliver_source;
+
+/* A pending event, accepted from the main loop */
+typedef struct {
+  gchar *id;
+  gboolean (*callback)(guint, const gchar *, gpointer);
+  gpointer data;
+  GDestroyNotify notify;
+  guint source;
+} BenchEvent;
+
+static GHashTable *events;
+static guint event_count;
+
+/* The roster: both peers, bob having the focus */
+static const gchar *roster_jids[] = { BENCH_ALICE, BENCH_BOB };
+static GList roster[] = {
+  { (gpointer) &roster_jids[0], NULL, NULL },
+  { (gpointer) &roster_jids[1], NULL, NULL },
+};
+
+LmConnection *lconnection;
+GList *current_buddy = &roster[1];
+
+void bench_init(void)
+{
+  options = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+  guards = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+  commands = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+  replies = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+  events = g_hash_table_new(g_str_hash, g_str_equal);
+  // Only a handle for the modules, never connected
+  lconnection = lm_connection_new(NULL);
+}
+
+void bench_set_option(const gchar *key, const gchar *value)
+{
+  gchar *(*guard)(const gchar *, const gchar *);
+
+  guard = g_hash_table_lookup(guards, key);
+  g_hash_table_insert(options, g_strdup(key),
+                      guard != NULL ? guard(key, value) : g_strdup(value));
+}
+
+void bench_set_verbose(gboolean v)
+{
+  verbose = v;
+}
+
+void bench_set_observer(BenchObserver obs, gpointer user_data)
+{
+  observer = obs;
+  observer_data = user_data;
+}
+
+/**
+ * @brief Run a command a module added, like /name arg
+ * @return FALSE if no module added it
+ */
+gboolean bench_command(const gchar *name, const gchar *arg)
+{
+  void (*f)(char *) = g_hash_table_lookup(commands, name);
+  gchar *args;
+
+  if (f == NULL)
+    return FALSE;
+  args = g_strdup(arg);
+  f(args);
+  g_free(args);
+  return TRUE;
+}
+
+/* mcabber: settings */
+
+const gchar *settings_get(guint type, const gchar *key)
+{
+  return g_hash_table_lookup(options, key);
+}
+
+int settings_get_int(guint type, const gchar *key)
+{
+  const gchar *value = settings_get(type, key);
+
+  return value != NULL ? atoi(value) : 0;
+}
+
+gboolean settings_set_guard(const gchar *key,
+                            gchar *(*guard)(const gchar *, const gchar *))
+{
+  if (g_hash_table_lookup(guards, key) != NULL)
+    return FALSE;
+  g_hash_table_insert(guards, g_strdup(key), guard);
+  return TRUE;
+}
+
+void settings_del_guard(const gchar *key)
+{
+  g_hash_table_remove(guards, key);
+}
+
+/* mcabber: screen and logs */
+
+static void bench_vprint(const char *fmt, va_list ap)
+{
+  if (!verbose)
+    return;
+  vfprintf(stderr, fmt, ap);
+  fputc('\n', stderr);
+}
+
+void scr_log_print(unsigned int flag, const char *fmt, ...)
+{
+  va_list ap;
+
+  va_start(ap, fmt);
+  bench_vprint(fmt, ap);
+  va_end(ap);
+}
+
+void scr_LogPrint(unsigned int flag, const char *fmt, ...)
+{
+  va_list ap;
+
+  va_start(ap, fmt);
+  bench_vprint(fmt, ap);
+  va_end(ap);
+}
+
+void scr_WriteIncomingMessage(const char *jidfrom, const char *text,
+                              time_t timestamp, guint prefix,
+                              unsigned mucnicklen)
+{
+  if (verbose)
+    fprintf(stderr, "<%s> %s\n", jidfrom, text);
+}
+
+/* mcabber: hooks, commands, completion, features */
+
+guint hk_add_handler(guint (*handler)(const gchar *, gpointer, gpointer),
+                     const gchar *hookname, gint priority, gpointer userdata)
+{
+  static guint hid = 0;
+
+  // Never connected, never disconnected: nothing to call
+  return ++hid;
+}
+
+void hk_del_handler(const gchar *hookname, guint hid)
+{
+}
+
+void cmd_add(const char *name, const char *help, guint flags1, guint flags2,
+             void (*f)(char *), gpointer userdata)
+{
+  g_hash_table_insert(commands, g_strdup(name), f);
+}
+
+void cmd_del(const char *name)
+{
+  g_hash_table_remove(commands, name);
+}
+
+guint compl_new_category(guint flags)
+{
+  static guint cat = 0;
+
+  return ++cat;
+}
+
+void compl_add_category_word(guint categ, const gchar *word)
+{
+}
+
+void compl_del_category(guint categ)
+{
+}
+
+void xmpp_add_feature(const char *xmlns)
+{
+}
+
+void xmpp_del_feature(const char *xmlns)
+{
+}
+
+/* mcabber: roster and capabilities */
+
+const char *buddy_getjid(gpointer rosterdata)
+{
+  return *(const gchar **)rosterdata;
+}
+
+GList *buddy_search_jid(const char *jid)
+{
+  guint i;
+
+  for (i = 0; i < G_N_ELEMENTS(roster); i++)
+    if (!g_ascii_strncasecmp(jid, roster_jids[i], strlen(roster_jids[i])))
+      return &roster[i];
+  return NULL;
+}
+
+GSList *roster_find(const char *jidname, int type, guint roster_type)
+{
+  static GSList found = { NULL, NULL };
+  GList *buddy = buddy_search_jid(jidname);
+
+  if (buddy == NULL)
+    return NULL;
+  found.data = buddy->data;
+  return &found;
+}
+
+GSList *buddy_getresources(gpointer rosterdata)
+{
+  return g_slist_append(NULL, g_strdup(BENCH_RESOURCE));
+}
+
+char *buddy_resource_getcaps(gpointer rosterdata, const char *resname)
+{
+  return "bench";
+}
+
+gboolean caps_has_feature(char *hash, char *feature, char *bjid)
+{
+  return TRUE;
+}
+
+/* mcabber: events, accepted as soon as the main loop runs */
+
+static void bench_event_free(BenchEvent *ev)
+{
+  if (ev->source != 0)
+    g_source_remove(ev->source);
+  if (ev->notify != NULL)
+    ev->notify(ev->data);
+  g_free(ev->id);
+  g_free(ev);
+}
+
+static gboolean bench_event_accept(gpointer data)
+{
+  BenchEvent *ev = (BenchEvent *)data;
+
+  ev->source = 0;
+  g_hash_table_steal(events, ev->id);
+  ev->callback(BENCH_EVS_CONTEXT_ACCEPT, NULL, ev->data);
+  bench_event_free(ev);
+  return FALSE;
+}
+
+const char *evs_new(const char *desc, const char *id, time_t timeout,
+                    gboolean (*callback)(guint, const gchar *, gpointer),
+                    gpointer data, GDestroyNotify notify)
+{
+  BenchEvent *ev = g_new0(BenchEvent, 1);
+
+  ev->id = id != NULL ? g_strdup(id) : g_strdup_printf("%u", ++event_count);
+  ev->callback = callback;
+  ev->data = data;
+  ev->notify = notify;
+  ev->source = g_idle_add(bench_event_accept, ev);
+  g_hash_table_insert(events, ev->id, ev);
+  return ev->id;
+}
+
+int evs_del(const char *evid)
+{
+  BenchEvent *ev = g_hash_table_lookup(events, evid);
+
+  if (ev == NULL)
+    return -1;
+  g_hash_table_steal(events, evid);
+  bench_event_free(ev);
+  return 0;
+}
+
+/* mcabber: utils */
+
+char *jidtodisp(const char *fjid)
+{
+  const gchar *slash = strchr(fjid, '/');
+
+  return slash != NULL ? g_strndup(fjid, slash - fjid) : g_strdup(fjid);
+}
+
+int check_jid_syntax(const char *fjid)
+{
+  return 0;
+}
+
+char *expand_filename(const char *fname)
+{
+  return g_strdup(fname);
+}
+
+time_t from_iso8601(const char *timestamp, int utc)
+{
+  return 0;
+}
+
+int to_iso8601(char *dststr, time_t timestamp)
+{
+  struct tm *tm_time = gmtime(&timestamp);
+
+  if (tm_time == NULL)
+    return -1;
+  return strftime(dststr, 19, "%Y%m%dT%H:%M:%SZ", tm_time) > 0 ? 0 : -1;
+}
+
+char **split_arg(const char *arg, unsigned int n, int dontstriplast)
+{
+  gchar **parts = g_strsplit(arg, " ", n);
+  char **args = g_new0(char *, n + 1);
+  guint i;
+
+  for (i = 0; parts[i] != NULL; i++)
+    args[i] = parts[i];
+  g_free(parts);
+  return args;
+}
+
+void free_arg_lst(char **arglst)
+{
+  g_strfreev(arglst);
+}
+
+/* loudmouth: handlers */
+
+LmMessageHandler *lm_message_handler_new(LmHandleMessageFunction function,
+                                         gpointer user_data,
+                                         GDestroyNotify notify)
+{
+  BenchMessageHandler *handler = g_new0(BenchMessageHandler, 1);
+
+  handler->function = function;
+  handler->user_data = user_data;
+  handler->notify = notify;
+  handler->valid = TRUE;
+  handler->ref_count = 1;
+  return (LmMessageHandler *)handler;
+}
+
+void lm_message_handler_invalidate(LmMessageHandler *handler)
+{
+  BENCH_HANDLER(handler)->valid = FALSE;
+}
+
+gboolean lm_message_handler_is_valid(LmMessageHandler *handler)
+{
+  return BENCH_HANDLER(handler)->valid;
+}
+
+LmMessageHandler *lm_message_handler_ref(LmMessageHandler *handler)
+{
+  BENCH_HANDLER(handler)->ref_count++;
+  return handler;
+}
+
+void lm_message_handler_unref(LmMessageHandler *handler)
+{
+  BenchMessageHandler *h = BENCH_HANDLER(handler);
+
+  if (--h->ref_count > 0)
+    return;
+  if (h->notify != NULL)
+    h->notify(h->user_data);
+  g_free(h);
+}
+
+/**
+ * @brief Call a handler, unless it was invalidated
+ */
+static LmHandlerResult bench_handle(LmMessageHandler *handler, LmMessage *m)
+{
+  BenchMessageHandler *h = BENCH_HANDLER(handler);
+
+  if (!h->valid)
+    return LM_HANDLER_RESULT_ALLOW_MORE_HANDLERS;
+  return h->function(handler, lconnection, m, h->user_data);
+}
+
+static gint bench_handler_cmp(gconstpointer a, gconstpointer b)
+{
+  return ((const BenchHandler *)b)->priority -
+         ((const BenchHandler *)a)->priority;
+}
+
+void lm_connection_register_message_handler(LmConnection *connection,
+                                            LmMessageHandler *handler,
+                                            LmMessageType type,
+                                            LmHandlerPriority priority)
+{
+  BenchHandler *bh = g_new0(BenchHandler, 1);
+
+  bh->handler = lm_message_handler_ref(handler);
+  bh->type = type;
+  bh->priority = priority;
+  handlers = g_slist_insert_sorted(handlers, bh, bench_handler_cmp);
+}
+
+void lm_connection_unregister_message_handler(LmConnection *connection,
+                                              LmMessageHandler *handler,
+                                              LmMessageType type)
+{
+  GSList *el;
+
+  for (el = handlers; el; el = el->next) {
+    BenchHandler *bh = (BenchHandler *)el->data;
+    if (bh->handler == handler && bh->type == type) {
+      handlers = g_slist_delete_link(handlers, el);
+      lm_message_handler_unref(bh->handler);
+      g_free(bh);
+      return;
+    }
+  }
+}
+
+/* loudmouth: the connection */
+
+const gchar *lm_connection_get_jid(LmConnection *connection)
+{
+  return BENCH_ALICE "/" BENCH_RESOURCE;
+}
+
+/**
+ * @brief Give a stanza to the peer it is sent to
+ */
+static void bench_deliver(LmMessage *m)
+{
+  const gchar *to = lm_message_node_get_attribute(m->node, "to");
+  const gchar *id = lm_message_node_get_attribute(m->node, "id");
+  LmMessageSubType sub = lm_message_get_sub_type(m);
+  LmMessageType type = lm_message_get_type(m);
+  LmMessageHandler *handler;
+  GSList *el, *next;
+
+  if (to != NULL && !g_ascii_strncasecmp(to, BENCH_ALICE, strlen(BENCH_ALICE)))
+    lm_message_node_set_attribute(m->node, "from",
+                                  BENCH_BOB "/" BENCH_RESOURCE);
+  else
+    lm_message_node_set_attribute(m->node, "from",
+                                  BENCH_ALICE "/" BENCH_RESOURCE);
+
+  if (observer != NULL)
+    observer(m, observer_data);
+
+  // Both peers share this table: only replies are looked up
+  if (type == LM_MESSAGE_TYPE_IQ && id != NULL &&
+      (sub == LM_MESSAGE_SUB_TYPE_RESULT || sub == LM_MESSAGE_SUB_TYPE_ERROR) &&
+      (handler = g_hash_table_lookup(replies, id)) != NULL) {
+    g_hash_table_remove(replies, id);
+    bench_handle(handler, m);
+    lm_message_handler_unref(handler);
+    return;
+  }
+
+  for (el = handlers; el; el = next) {
+    BenchHandler *bh = (BenchHandler *)el->data;
+    next = el->next;
+    if (bh->type == type &&
+        bench_handle(bh->handler, m) == LM_HANDLER_RESULT_REMOVE_MESSAGE)
+      break;
+  }
+}
+
+static gboolean bench_deliver_all(gpointer data)
+{
+  guint count = g_queue_get_length(&stanzas);
+  LmMessage *m;
+
+  // What is sent meanwhile waits for the next round, like the network
+  while (count-- > 0 && (m = g_queue_pop_head(&stanzas)) != NULL) {
+    bench_deliver(m);
+    lm_message_unref(m);
+  }
+  if (!g_queue_is_empty(&stanzas))
+    return TRUE;
+  deliver_source = 0;
+  return FALSE;
+}
+
+gboolean lm_connection_send(LmConnection *connection, LmMessage *message,
+                            GError **error)
+{
+  g_queue_push_tail(&stanzas, lm_message_ref(message));
+  if (deliver_source == 0)
+    deliver_source = g_idle_add(bench_deliver_all, NULL);
+  return TRUE;
+}
+
+gboolean lm_connection_send_with_reply(LmConnection *connection,
+                                       LmMessage *message,
+                                       LmMessageHandler *handler,
+                                       GError **error)
+{
+  const gchar *id = lm_message_node_get_attribute(message->node, "id");
+
+  if (id == NULL) {
+    g_set_error(error, g_quark_from_static_string("bench"), 0,
+                "stanza without id");
+    return FALSE;
+  }
+  g_hash_table_insert(replies, g_strdup(id), lm_message_handler_ref(handler));
+  return lm_connection_send(connection, message, error);
+}
@@ -0,0 +1,154 @@
+/*
+ * compress.c
+ *
+ * Copyright (C) 2026 mcabber-jingle contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+#include <glib.h>
+#include <zlib.h>
+
+#include <mcabber/settings.h>
+
+#include "compress.h"
+
+/*
+ * The sender deflates each chunk it reads and flushes the stream after
+ * it, so that the receiver can inflate and write every chunk as soon as
+ * it comes, whatever the transport cut it into. The stream is raw
+ * deflate: the hash of the file already checks it.
+ * Files already compressed (archives, pictures, videos...) are told by
+ * their beginning: the rest is only stored, which costs a copy.
+ */
+
+struct _JingleFTCompress {
+  z_stream z;
+  gboolean inflate;
+
+  /* Bytes deflated so far and what they gave, until the sample is
+   * taken */
+  guint64 in;
+  guint64 out;
+  gboolean sampled;
+};
+
+/**
+ * @return The zlib level to use, 0 if we must not compress
+ */
+gint jingle_ft_compress_level(void)
+{
+  if (settings_opt_get("jingle_ft_compress") == NULL)
+    return JINGLE_FT_COMPRESS_LEVEL;
+  return CLAMP(settings_opt_get_int("jingle_ft_compress"), 0, 9);
+}
+
+/**
+ * @param inflate TRUE to decompress what we receive, FALSE to compress
+ *                what we send
+ * @return NULL if zlib cannot be initialized
+ */
+JingleFTCompress *jingle_ft_compress_new(gboolean inflate, gint level)
+{
+  JingleFTCompress *c = g_new0(JingleFTCompress, 1);
+  gint ret;
+
+  // A negative window size means no zlib header nor trailer
+  c->inflate = inflate;
+  if (inflate)
+    ret = inflateInit2(&c->z, -15);
+  else
+    ret = deflateInit2(&c->z, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY);
+
+  if (ret != Z_OK) {
+    g_free(c);
+    return NULL;
+  }
+  return c;
+}
+
+/**
+ * @brief (De)compress a chunk
+ * @param last No more data will follow, end the stream (compression)
+ * @param out  Set to the result, to be freed with g_free. The transport
+ *             may ask for the next chunk before it is done with it.
+ * @return FALSE with err set if the data is not a deflate stream
+ */
+gboolean jingle_ft_compress_data(JingleFTCompress *c, const gchar *data,
+                                 gsize len, gboolean last,
+                                 gchar **out, gsize *outlen,
+                                 GError **err)
+{
+  GByteArray *buf = g_byte_array_new();
+  gint flush = c->inflate ? Z_NO_FLUSH : (last ? Z_FINISH : Z_SYNC_FLUSH);
+  gsize room = MAX(c->inflate ? len * 4 : len + len / 8,
+                   JINGLE_FT_COMPRESS_ROOM);
+  guint used;
+  gint ret;
+
+  c->z.next_in = (Bytef *)data;
+  c->z.avail_in = len;
+
+  // Until all the input is taken and the output is not cut short
+  do {
+    used = buf->len;
+    g_byte_array_set_size(buf, used + room);
+    c->z.next_out = buf->data + used;
+    c->z.avail_out = room;
+
+    ret = c->inflate ? inflate(&c->z, flush) : deflate(&c->z, flush);
+    g_byte_array_set_size(buf, used + room - c->z.avail_out);
+
+    if (ret == Z_STREAM_END)
+      break;
+    if (ret != Z_OK && ret != Z_BUF_ERROR) {
+      g_set_error(err, G_IO_CHANNEL_ERROR, G_IO_CHANNEL_ERROR_FAILED,
+                  "cannot %s: %s", c->inflate ? "decompress" : "compress",
+                  c->z.msg ? c->z.msg : "zlib error");
+      g_byte_array_free(buf, TRUE);
+      return FALSE;
+    }
+  } while (c->z.avail_out == 0 || c->z.avail_in > 0 || flush == Z_FINISH);
+
+  // The stream was just flushed, the level can change without any
+  // output room
+  if (!c->inflate && !c->sampled) {
+    c->in += len;
+    c->out += buf->len;
+    if (c->in >= JINGLE_FT_COMPRESS_SAMPLE) {
+      c->sampled = TRUE;
+      c->z.avail_out = 0;
+      if (c->out * 100 > c->in * JINGLE_FT_COMPRESS_RATIO)
+        deflateParams(&c->z, 0, Z_DEFAULT_STRATEGY);
+    }
+  }
+
+  *outlen = buf->len;
+  *out = (gchar *)g_byte_array_free(buf, FALSE);
+  return TRUE;
+}
+
+void jingle_ft_compress_free(JingleFTCompress *c)
+{
+  if (c == NULL)
+    return;
+
+  if (c->inflate)
+    inflateEnd(&c->z);
+  else
+    deflateEnd(&c->z);
+  g_free(c);
+}
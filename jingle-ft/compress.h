@@ -0,0 +1,40 @@
+#ifndef __JINGLEFT_COMPRESS_H__
+#define __JINGLEFT_COMPRESS_H__ 1
+
+/**
+ * \file compress.h
+ * \brief Deflate the data of a transfer on the fly
+ */
+
+#include <glib.h>
+
+/* Our own extension of the description, and the disco feature telling
+ * that we understand it */
+#define NS_JINGLE_APP_FT_COMPRESS "http://mcabber.com/protocol/jingle-ft/compress"
+#define JINGLE_FT_COMPRESS_ALGO   "deflate"
+
+/* zlib level when jingle_ft_compress is not set, 0 disables it */
+#define JINGLE_FT_COMPRESS_LEVEL 1
+
+/* Bytes at the beginning of a file deflated before deciding whether the
+ * rest is worth compressing */
+#define JINGLE_FT_COMPRESS_SAMPLE 65536
+
+/* Compressed size, in percent of the sample, above which the rest of
+ * the file is only stored in the deflate stream */
+#define JINGLE_FT_COMPRESS_RATIO 90
+
+/* Output room added at once while (de)compressing a chunk */
+#define JINGLE_FT_COMPRESS_ROOM 16384
+
+typedef struct _JingleFTCompress JingleFTCompress;
+
+gint jingle_ft_compress_level(void);
+JingleFTCompress *jingle_ft_compress_new(gboolean inflate, gint level);
+gboolean jingle_ft_compress_data(JingleFTCompress *c, const gchar *data,
+                                 gsize len, gboolean last,
+                                 gchar **out, gsize *outlen,
+                                 GError **err);
+void jingle_ft_compress_free(JingleFTCompress *c);
+
+#endif
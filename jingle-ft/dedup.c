@@ -0,0 +1,600 @@
+/*
+ * dedup.c
+ *
+ * Copyright (C) 2026 mcabber-jingle contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif
+
+#include <mcabber/settings.h>
+#include <mcabber/logprint.h>
+#include <mcabber/utils.h>
+
+#include "filetransfer.h"
+#include "dedup.h"
+
+/*
+ * The index is a key file with a group per file, named after its full
+ * path. Its size, dates and inode tell whether the file changed since
+ * it was hashed, the hashes are keys named after their algorithm.
+ *
+ * It is kept in memory, with a table giving the files of each hash,
+ * and read again only when its file changed: another mcabber of ours
+ * may share it. It lives with the rest of mcabber's files, readable by
+ * us only: jingle_ft_dir is /tmp by default, where anybody could write
+ * entries pointing us at their files.
+ *
+ * Only the files we received and those of jingle_ft_dir are indexed,
+ * and only those of jingle_ft_dir are reused: what we send is none of
+ * the receiver's business, and may be changed in place later. A file
+ * is only reused if it is ours, so that nobody changes it once we have
+ * taken it, and once it was hashed again: the index only tells which
+ * files to hash first.
+ */
+
+/* The index, the file it was read from or written to, and its stat
+ * then, zeroed when there was none we could trust */
+static GKeyFile *index_kf = NULL;
+static gchar *index_path = NULL;
+static struct stat index_st;
+
+/* Lists of paths by "algo:hash", in lower case */
+static GHashTable *index_hashes = NULL;
+
+struct _JingleFTDedupSearch {
+  gchar *dir;
+  guint64 size;
+  GChecksumType type;
+  gchar *hash;
+
+  /* Files of dir left to hash */
+  GQueue paths;
+
+  /* The one being hashed, and its stat when it was opened */
+  gchar *path;
+  struct stat st;
+  JingleFTHash *hasher;
+
+  JingleFTDedupFound found;
+  gpointer user_data;
+};
+
+/**
+ * @return FALSE if jingle_ft_dedup is set to 0
+ */
+gboolean jingle_ft_dedup_enabled(void)
+{
+  return settings_opt_get("jingle_ft_dedup") == NULL
+         || settings_opt_get_int("jingle_ft_dedup") != 0;
+}
+
+static gchar *dedup_path(void)
+{
+  const gchar *path = settings_opt_get("jingle_ft_dedup_index");
+
+  return expand_filename(path != NULL ? path : JINGLE_FT_DEDUP_INDEX);
+}
+
+static gchar *dedup_hash_key(const gchar *algo, const gchar *hash)
+{
+  gchar *lower = g_ascii_strdown(hash, -1);
+  gchar *key = g_strconcat(algo, ":", lower, NULL);
+
+  g_free(lower);
+  return key;
+}
+
+static void dedup_link(const gchar *algo, const gchar *hash,
+                       const gchar *path)
+{
+  gchar *key = dedup_hash_key(algo, hash);
+  gpointer orig;
+  GSList *paths = NULL;
+
+  if (g_hash_table_lookup_extended(index_hashes, key, &orig,
+                                   (gpointer *)&paths)) {
+    if (g_slist_find_custom(paths, path, (GCompareFunc)g_strcmp0) != NULL) {
+      g_free(key);
+      return;
+    }
+    // The list gets a new head, which the table must not free
+    g_hash_table_steal(index_hashes, key);
+    g_free(orig);
+  }
+  g_hash_table_insert(index_hashes, key,
+                      g_slist_prepend(paths, g_strdup(path)));
+}
+
+static void dedup_unlink(const gchar *algo, const gchar *hash,
+                         const gchar *path)
+{
+  gchar *key = dedup_hash_key(algo, hash);
+  gpointer orig;
+  GSList *paths, *el;
+
+  if (g_hash_table_lookup_extended(index_hashes, key, &orig,
+                                   (gpointer *)&paths)) {
+    el = g_slist_find_custom(paths, path, (GCompareFunc)g_strcmp0);
+    if (el != NULL) {
+      g_hash_table_steal(index_hashes, key);
+      g_free(orig);
+      g_free(el->data);
+      paths = g_slist_delete_link(paths, el);
+      if (paths != NULL)
+        g_hash_table_insert(index_hashes, g_strdup(key), paths);
+    }
+  }
+  g_free(key);
+}
+
+/**
+ * Add the hashes of a group to the table, or take them out of it
+ */
+static void dedup_table(const gchar *path, gboolean add)
+{
+  gchar **keys = g_key_file_get_keys(index_kf, path, NULL, NULL);
+  GChecksumType type;
+  gchar *hash;
+  gsize i;
+
+  for (i = 0; keys != NULL && keys[i] != NULL; i++) {
+    if (!jingle_ft_hash_type_from_name(keys[i], &type))
+      continue;
+    hash = g_key_file_get_string(index_kf, path, keys[i], NULL);
+    if (hash != NULL && add)
+      dedup_link(keys[i], hash, path);
+    else if (hash != NULL)
+      dedup_unlink(keys[i], hash, path);
+    g_free(hash);
+  }
+  g_strfreev(keys);
+}
+
+static void dedup_drop(void)
+{
+  if (index_kf != NULL)
+    g_key_file_free(index_kf);
+  if (index_hashes != NULL)
+    g_hash_table_destroy(index_hashes);
+  g_free(index_path);
+  index_kf = NULL;
+  index_hashes = NULL;
+  index_path = NULL;
+}
+
+static void dedup_paths_free(gpointer paths)
+{
+  g_slist_free_full(paths, g_free);
+}
+
+static gboolean dedup_same_stat(const struct stat *a, const struct stat *b)
+{
+  return a->st_dev == b->st_dev && a->st_ino == b->st_ino &&
+         a->st_size == b->st_size && a->st_mtime == b->st_mtime &&
+         a->st_ctime == b->st_ctime;
+}
+
+/**
+ * The index, read again if another mcabber wrote it since.
+ * Only an index we wrote, that nobody else can write, is trusted.
+ */
+static GKeyFile *dedup_load(void)
+{
+  gchar *path = dedup_path();
+  gchar **groups;
+  struct stat st;
+  gboolean ours = g_stat(path, &st) == 0 && st.st_uid == getuid() &&
+                  (st.st_mode & (S_IWGRP | S_IWOTH)) == 0;
+  gsize i;
+
+  if (index_kf != NULL && !g_strcmp0(path, index_path) &&
+      (ours ? dedup_same_stat(&st, &index_st) : index_st.st_ino == 0)) {
+    g_free(path);
+    return index_kf;
+  }
+
+  dedup_drop();
+  index_kf = g_key_file_new();
+  index_hashes = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+                                       dedup_paths_free);
+  index_path = path;
+  memset(&index_st, 0, sizeof(index_st));
+  if (ours && g_key_file_load_from_file(index_kf, path, G_KEY_FILE_NONE,
+                                        NULL))
+    index_st = st;
+
+  groups = g_key_file_get_groups(index_kf, NULL);
+  for (i = 0; groups[i] != NULL; i++)
+    dedup_table(groups[i], TRUE);
+  g_strfreev(groups);
+  return index_kf;
+}
+
+/**
+ * Replace the file of the index with data, readable by us only
+ */
+static gboolean dedup_write(const gchar *data, gsize len)
+{
+  gchar *tmp = g_strconcat(index_path, ".tmp", NULL);
+  gint fd = g_open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  gboolean ok = fd >= 0 && fchmod(fd, 0600) == 0;
+  ssize_t w;
+
+  while (ok && len > 0) {
+    w = write(fd, data, len);
+    if (w < 0 && errno == EINTR)
+      continue;
+    ok = w > 0;
+    if (ok) {
+      data += w;
+      len -= w;
+    }
+  }
+  if (fd >= 0 && close(fd) != 0)
+    ok = FALSE;
+  ok = ok && g_rename(tmp, index_path) == 0;
+  if (!ok && fd >= 0)
+    g_unlink(tmp);
+  g_free(tmp);
+  return ok;
+}
+
+static void dedup_save(GKeyFile *kf)
+{
+  gsize len;
+  gchar *data = g_key_file_to_data(kf, &len, NULL);
+
+  if (data == NULL || !dedup_write(data, len))
+    scr_LogPrint(LPRINT_DEBUG, "Jingle File Transfer: cannot write %s",
+                 index_path);
+  // What we wrote is what we have, no need to read it again
+  else if (g_stat(index_path, &index_st) != 0)
+    memset(&index_st, 0, sizeof(index_st));
+  g_free(data);
+}
+
+/**
+ * Whether a path can name a group of the index
+ */
+static gboolean dedup_key(const gchar *path)
+{
+  return g_path_is_absolute(path) && strpbrk(path, "[]\n\r") == NULL;
+}
+
+static void dedup_set(GKeyFile *kf, const gchar *path, const struct stat *st)
+{
+  g_key_file_set_uint64(kf, path, "size", st->st_size);
+  g_key_file_set_int64(kf, path, "mtime", st->st_mtime);
+  g_key_file_set_int64(kf, path, "ctime", st->st_ctime);
+  g_key_file_set_uint64(kf, path, "inode", st->st_ino);
+}
+
+static void dedup_set_hash(GKeyFile *kf, const gchar *path,
+                           const gchar *algo, const gchar *hash)
+{
+  gchar *old = g_key_file_get_string(kf, path, algo, NULL);
+
+  if (old != NULL)
+    dedup_unlink(algo, old, path);
+  g_free(old);
+  g_key_file_set_string(kf, path, algo, hash);
+  dedup_link(algo, hash, path);
+}
+
+static void dedup_remove(GKeyFile *kf, const gchar *path)
+{
+  dedup_table(path, FALSE);
+  g_key_file_remove_group(kf, path, NULL);
+}
+
+/**
+ * Whether the file is still what the index says. Otherwise it is
+ * dropped from the index, and changed is set.
+ */
+static gboolean dedup_fresh(GKeyFile *kf, const gchar *path, struct stat *st,
+                            gboolean *changed)
+{
+  if (g_stat(path, st) == 0 && S_ISREG(st->st_mode)
+      && g_key_file_get_uint64(kf, path, "size", NULL) == (guint64)st->st_size
+      && g_key_file_get_int64(kf, path, "mtime", NULL) == st->st_mtime
+      && g_key_file_get_int64(kf, path, "ctime", NULL) == st->st_ctime
+      && g_key_file_get_uint64(kf, path, "inode", NULL) == st->st_ino)
+    return TRUE;
+
+  dedup_remove(kf, path);
+  *changed = TRUE;
+  return FALSE;
+}
+
+/**
+ * @brief The hash of a file, if the index has it and the file did not
+ *        change since
+ * @return a newly allocated hexadecimal string, or NULL
+ */
+gchar *jingle_ft_dedup_get(const gchar *path, GChecksumType type)
+{
+  GKeyFile *kf;
+  gchar *hash = NULL;
+  gboolean changed = FALSE;
+  struct stat st;
+
+  if (!jingle_ft_dedup_enabled() || !dedup_key(path))
+    return NULL;
+
+  kf = dedup_load();
+  if (g_key_file_has_group(kf, path) && dedup_fresh(kf, path, &st, &changed))
+    hash = g_key_file_get_string(kf, path, jingle_ft_hash_type_to_name(type),
+                                 NULL);
+  if (changed)
+    dedup_save(kf);
+  return hash;
+}
+
+/**
+ * @brief Record the hash of a file we received
+ * @param date The modification time the file had when we started to
+ *             read it, or 0 for a file we just wrote
+ */
+void jingle_ft_dedup_add(const gchar *path, time_t date, GChecksumType type,
+                         const gchar *hash)
+{
+  GKeyFile *kf;
+  gboolean changed = FALSE;
+  struct stat st;
+
+  if (!jingle_ft_dedup_enabled() || !dedup_key(path) || hash == NULL ||
+      *hash == '\0')
+    return;
+
+  kf = dedup_load();
+  // It changed while we read it, the hash may be of neither version
+  if (g_stat(path, &st) == 0 && S_ISREG(st.st_mode) &&
+      (date == 0 || date == st.st_mtime)) {
+    if (!g_key_file_has_group(kf, path) ||
+        !dedup_fresh(kf, path, &st, &changed))
+      dedup_set(kf, path, &st);
+    dedup_set_hash(kf, path, jingle_ft_hash_type_to_name(type), hash);
+    dedup_save(kf);
+  }
+}
+
+/**
+ * Whether a file of dir may be the one we look for: the index does not
+ * know it, or says it is. known is set in the latter case.
+ */
+static gboolean dedup_candidate(GKeyFile *kf, const gchar *path,
+                                const gchar *name, guint64 size,
+                                const gchar *algo, const gchar *hash,
+                                const struct stat *dirst, struct stat *st,
+                                gboolean *known, gboolean *changed)
+{
+  gchar *indexed;
+
+  // Neither what we are receiving nor our checkpoints
+  if (g_str_has_suffix(name, JINGLE_FT_PARTIAL) ||
+      g_str_has_suffix(name, JINGLE_FT_CHECKPOINT) || !dedup_key(path))
+    return FALSE;
+
+  // Somebody else could change it once we took it. A hard link cannot
+  // cross file systems.
+  if (g_stat(path, st) != 0 || !S_ISREG(st->st_mode) ||
+      (guint64)st->st_size != size || st->st_uid != getuid() ||
+      st->st_dev != dirst->st_dev)
+    return FALSE;
+
+  // Already compared with the index, unless it changed since
+  *known = FALSE;
+  if (!g_key_file_has_key(kf, path, algo, NULL) ||
+      !dedup_fresh(kf, path, st, changed))
+    return TRUE;
+  indexed = g_key_file_get_string(kf, path, algo, NULL);
+  *known = indexed != NULL && !g_ascii_strcasecmp(indexed, hash);
+  g_free(indexed);
+  return *known;
+}
+
+static void dedup_search_hashed(gpointer data);
+
+/**
+ * Give the next file of the search to the workers
+ * @return FALSE if none is left
+ */
+static gboolean dedup_search_next(JingleFTDedupSearch *s)
+{
+  gint fd;
+
+  g_free(s->path);
+  while ((s->path = g_queue_pop_head(&s->paths)) != NULL) {
+    fd = g_open(s->path, O_RDONLY, 0);
+    if (fd >= 0 && fstat(fd, &s->st) == 0 &&
+        (guint64)s->st.st_size == s->size) {
+      s->hasher = jingle_ft_hash_new(s->type);
+      jingle_ft_hash_update_fd(s->hasher, fd, 0, s->size);
+      jingle_ft_hash_finish(s->hasher, dedup_search_hashed, s);
+      close(fd);
+      return TRUE;
+    }
+    if (fd >= 0)
+      close(fd);
+    g_free(s->path);
+  }
+  return FALSE;
+}
+
+/**
+ * A file of the search was hashed: it goes in the index, whether it is
+ * the one we look for or not, so that it is done only once
+ */
+static void dedup_search_hashed(gpointer data)
+{
+  JingleFTDedupSearch *s = data;
+  const gchar *algo = jingle_ft_hash_type_to_name(s->type);
+  const gchar *hex = jingle_ft_hash_get_string(s->hasher);
+  JingleFTDedupFound found = s->found;
+  gpointer user_data = s->user_data;
+  gchar *path = NULL;
+  struct stat st;
+  GKeyFile *kf;
+
+  // Unless it could not be read entirely, or changed while it was
+  if (*hex != '\0' && g_stat(s->path, &st) == 0 &&
+      dedup_same_stat(&st, &s->st)) {
+    kf = dedup_load();
+    if (g_key_file_has_group(kf, s->path))
+      dedup_remove(kf, s->path);
+    dedup_set(kf, s->path, &st);
+    dedup_set_hash(kf, s->path, algo, hex);
+    dedup_save(kf);
+    if (!g_ascii_strcasecmp(hex, s->hash))
+      path = g_strdup(s->path);
+  }
+  jingle_ft_hash_free(s->hasher);
+  s->hasher = NULL;
+
+  if (path == NULL && dedup_search_next(s))
+    return;
+
+  jingle_ft_dedup_search_free(s);
+  found(user_data, path);
+}
+
+/**
+ * @brief Hash, on the workers, the files of dir that may have the given
+ *        content
+ *
+ * Those the index says have it come first, then those the index does
+ * not know, JINGLE_FT_DEDUP_HASH_MAX bytes at most. found is called in
+ * the main loop with the path of the first one that has it, newly
+ * allocated, or NULL, once the search is freed.
+ * @return the search, or NULL if there is no file to hash: found is
+ *         not called then
+ */
+JingleFTDedupSearch *jingle_ft_dedup_search(const gchar *dir, guint64 size,
+                                            GChecksumType type,
+                                            const gchar *hash,
+                                            JingleFTDedupFound found,
+                                            gpointer user_data)
+{
+  const gchar *algo = jingle_ft_hash_type_to_name(type);
+  const gchar *entry;
+  guint64 budget = JINGLE_FT_DEDUP_HASH_MAX;
+  gboolean changed = FALSE, known;
+  JingleFTDedupSearch *s;
+  struct stat dirst, st;
+  GKeyFile *kf;
+  GDir *gdir;
+
+  if (!jingle_ft_dedup_enabled() || hash == NULL || size == 0 ||
+      g_stat(dir, &dirst) != 0 || (gdir = g_dir_open(dir, 0, NULL)) == NULL)
+    return NULL;
+
+  s = g_new0(JingleFTDedupSearch, 1);
+  g_queue_init(&s->paths);
+  kf = dedup_load();
+  while ((entry = g_dir_read_name(gdir)) != NULL) {
+    gchar *path = g_build_filename(dir, entry, NULL);
+    if (!dedup_candidate(kf, path, entry, size, algo, hash, &dirst, &st,
+                         &known, &changed)) {
+      g_free(path);
+    } else if (known) {
+      g_queue_push_head(&s->paths, path);
+    } else if (budget >= size) {
+      budget -= size;
+      g_queue_push_tail(&s->paths, path);
+    } else {
+      g_free(path);
+    }
+  }
+  g_dir_close(gdir);
+  if (changed)
+    dedup_save(kf);
+
+  s->dir = g_strdup(dir);
+  s->size = size;
+  s->type = type;
+  s->hash = g_strdup(hash);
+  s->found = found;
+  s->user_data = user_data;
+  if (!dedup_search_next(s)) {
+    jingle_ft_dedup_search_free(s);
+    return NULL;
+  }
+  return s;
+}
+
+/**
+ * @brief Stop a search, found is not called
+ */
+void jingle_ft_dedup_search_free(JingleFTDedupSearch *s)
+{
+  if (s == NULL)
+    return;
+
+  jingle_ft_hash_free(s->hasher);
+  g_queue_foreach(&s->paths, (GFunc)g_free, NULL);
+  g_queue_clear(&s->paths);
+  g_free(s->path);
+  g_free(s->dir);
+  g_free(s->hash);
+  g_free(s);
+}
+
+/**
+ * @brief Make to a clone of from, sharing its blocks, if the file
+ *        system can
+ * @return FALSE if it cannot, to is then left as it was
+ */
+gboolean jingle_ft_dedup_clone(const gchar *from, const gchar *to)
+{
+#ifdef FICLONE
+  gint in, out;
+  gboolean cloned;
+
+  if ((in = g_open(from, O_RDONLY, 0)) < 0)
+    return FALSE;
+  if ((out = g_open(to, O_WRONLY | O_CREAT | O_EXCL, 0644)) < 0) {
+    close(in);
+    return FALSE;
+  }
+  cloned = ioctl(out, FICLONE, in) == 0;
+  close(in);
+  close(out);
+  if (!cloned)
+    g_unlink(to);
+  return cloned;
+#else
+  return FALSE;
+#endif
+}
+
+/**
+ * @brief Forget the index, every search must have been freed
+ */
+void jingle_ft_dedup_uninit(void)
+{
+  dedup_drop();
+}
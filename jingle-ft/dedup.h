@@ -0,0 +1,40 @@
+#ifndef __JINGLEFT_DEDUP_H__
+#define __JINGLEFT_DEDUP_H__ 1
+
+/**
+ * \file dedup.h
+ * \brief Remember the hashes of the files we have, so that we do not
+ *        receive again a file we already have
+ */
+
+#include <glib.h>
+#include <time.h>
+
+/* The index of the hashes, unless jingle_ft_dedup_index says otherwise */
+#define JINGLE_FT_DEDUP_INDEX "~/.mcabber/jft-index"
+
+/* Bytes of files missing from the index we hash at most to look for
+ * a copy of an offered file. Those the index gives are hashed again
+ * whatever their size. */
+#define JINGLE_FT_DEDUP_HASH_MAX 67108864
+
+typedef struct _JingleFTDedupSearch JingleFTDedupSearch;
+
+/* Called in the main loop with the path of the copy found, to free,
+ * or NULL */
+typedef void (*JingleFTDedupFound)(gpointer user_data, gchar *path);
+
+gboolean jingle_ft_dedup_enabled(void);
+gchar *jingle_ft_dedup_get(const gchar *path, GChecksumType type);
+void jingle_ft_dedup_add(const gchar *path, time_t date, GChecksumType type,
+                         const gchar *hash);
+JingleFTDedupSearch *jingle_ft_dedup_search(const gchar *dir, guint64 size,
+                                            GChecksumType type,
+                                            const gchar *hash,
+                                            JingleFTDedupFound found,
+                                            gpointer user_data);
+void jingle_ft_dedup_search_free(JingleFTDedupSearch *s);
+gboolean jingle_ft_dedup_clone(const gchar *from, const gchar *to);
+void jingle_ft_dedup_uninit(void);
+
+#endif
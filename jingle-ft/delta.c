@@ -0,0 +1,646 @@
+/*
+ * delta.c
+ *
+ * Copyright (C) 2026 mcabber-jingle contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#include <mcabber/settings.h>
+
+#include "delta.h"
+
+/*
+ * The receiver cuts the version it has in blocks and gives, for each of
+ * them, a weak checksum that can be rolled one byte at a time and the
+ * beginning of its md5. The sender slides a block-sized window over its
+ * file: where the weak checksum, then the md5, match a block, it tells
+ * the receiver to copy that block, and the bytes it passed over in
+ * between are sent as they are. The data of the transfer becomes a
+ * sequence of:
+ *   'L' <length: 4 bytes> <length bytes of the file>
+ *   'B' <first block: 4 bytes> <count: 4 bytes>
+ *   'H' <length: 4 bytes>
+ * numbers being big endian. The hash of the whole file checks the
+ * result, whatever the checksums of the blocks missed.
+ *
+ * Holes are zeros the sender did not even read, see sparse.c. A sparse
+ * file is sent in that format without older version.
+ *
+ * The signature is computed by a worker, the old version being read
+ * entirely: the main loop is called back once it is there. A decoder
+ * freed meanwhile is left to the worker, which frees it once it gave
+ * up, so that the main loop never waits for it.
+ */
+
+/* Bytes of the signature of a block: weak checksum, then md5 */
+#define DELTA_SIG (4 + JINGLE_FT_DELTA_STRONG)
+
+/* Chains of blocks, by 16 bits of their weak checksum */
+#define DELTA_TAGS 65536
+
+struct _JingleFTDelta {
+  guint block;
+  guint blocks;
+
+  /* Decoder: the old version, its signature in base64, and the
+   * instruction being read */
+  gint fd;
+  gchar *signature;
+  guchar head[9];
+  guint headlen;
+  guint32 literal;
+
+  /* Decoder: the worker computing the signature, and what to call from
+   * the main loop once it is done. The worker owns a decoder cancelled
+   * while it is signing. */
+  GMutex lock;
+  gboolean signing;
+  gint cancelled;
+  guint idle;
+  JingleFTDeltaReady ready;
+  gpointer ready_data;
+
+  /* Encoder: the signature of the blocks, chained by tag, and the
+   * rolling checksum of the window at pos */
+  guint32 *weak;
+  guchar *strong;
+  gint32 *tag;
+  gint32 *next;
+  guint64 pos;
+  guint32 s1, s2;
+  gboolean rolling;
+};
+
+static GThreadPool *pool = NULL;
+
+static void delta_job(gpointer data, gpointer user_data);
+static gboolean delta_notify(gpointer data);
+static void delta_destroy(JingleFTDelta *d);
+
+/**
+ * @return FALSE if jingle_ft_delta is set to 0
+ */
+gboolean jingle_ft_delta_enabled(void)
+{
+  return settings_opt_get("jingle_ft_delta") == NULL
+         || settings_opt_get_int("jingle_ft_delta") != 0;
+}
+
+static void delta_put32(guchar *p, guint32 v)
+{
+  p[0] = v >> 24;
+  p[1] = v >> 16;
+  p[2] = v >> 8;
+  p[3] = v;
+}
+
+static guint32 delta_get32(const guchar *p)
+{
+  return (guint32)p[0] << 24 | (guint32)p[1] << 16 | (guint32)p[2] << 8 | p[3];
+}
+
+/**
+ * The checksum of rsync: s1 sums the bytes, s2 the successive s1
+ */
+static void delta_sum(const guchar *data, guint len, guint32 *s1, guint32 *s2)
+{
+  guint32 a = 0, b = 0;
+  guint i;
+
+  for (i = 0; i < len; i++) {
+    a += data[i];
+    b += a;
+  }
+  *s1 = a;
+  *s2 = b;
+}
+
+static guint32 delta_weak(guint32 s1, guint32 s2)
+{
+  return (s1 & 0xffff) | (s2 << 16);
+}
+
+static guint delta_tag(guint32 weak)
+{
+  return (weak ^ (weak >> 16)) & (DELTA_TAGS - 1);
+}
+
+static void delta_strong(const guchar *data, gsize len, guchar *strong)
+{
+  GChecksum *md5 = g_checksum_new(G_CHECKSUM_MD5);
+  guint8 digest[16];
+  gsize digestlen = sizeof(digest);
+
+  g_checksum_update(md5, data, len);
+  g_checksum_get_digest(md5, digest, &digestlen);
+  memcpy(strong, digest, JINGLE_FT_DELTA_STRONG);
+  g_checksum_free(md5);
+}
+
+static gboolean delta_pread(gint fd, guchar *buf, gsize len, guint64 offset)
+{
+  ssize_t r;
+
+  while (len > 0) {
+    r = pread(fd, buf, len, offset);
+    if (r < 0 && errno == EINTR)
+      continue;
+    if (r <= 0)
+      return FALSE;
+    buf += r;
+    offset += r;
+    len -= r;
+  }
+  return TRUE;
+}
+
+static JingleFTDelta *delta_new(void)
+{
+  JingleFTDelta *d = g_new0(JingleFTDelta, 1);
+
+  d->fd = -1;
+  g_mutex_init(&d->lock);
+  return d;
+}
+
+/**
+ * Run by a worker: the signature of the whole old version
+ */
+static void delta_job(gpointer data, gpointer user_data)
+{
+  JingleFTDelta *d = (JingleFTDelta *)data;
+  GByteArray *sig;
+  guchar *buf, entry[DELTA_SIG];
+  gchar *signature = NULL;
+  guint32 s1, s2;
+  guint i;
+
+  buf = g_malloc(d->block);
+  sig = g_byte_array_sized_new(d->blocks * DELTA_SIG);
+  for (i = 0; i < d->blocks && !g_atomic_int_get(&d->cancelled); i++) {
+    if (!delta_pread(d->fd, buf, d->block, (guint64)i * d->block))
+      break;
+    delta_sum(buf, d->block, &s1, &s2);
+    delta_put32(entry, delta_weak(s1, s2));
+    delta_strong(buf, d->block, entry + 4);
+    g_byte_array_append(sig, entry, DELTA_SIG);
+  }
+  g_free(buf);
+
+  if (i == d->blocks)
+    signature = g_base64_encode(sig->data, sig->len);
+  g_byte_array_free(sig, TRUE);
+
+  g_mutex_lock(&d->lock);
+  d->signing = FALSE;
+  // Freed meanwhile, it is ours
+  if (g_atomic_int_get(&d->cancelled)) {
+    g_mutex_unlock(&d->lock);
+    g_free(signature);
+    delta_destroy(d);
+    return;
+  }
+  d->signature = signature;
+  d->idle = g_idle_add(delta_notify, d);
+  g_mutex_unlock(&d->lock);
+}
+
+/**
+ * Run in the main loop once the signature is computed.
+ */
+static gboolean delta_notify(gpointer data)
+{
+  JingleFTDelta *d = (JingleFTDelta *)data;
+
+  g_mutex_lock(&d->lock);
+  d->idle = 0;
+  g_mutex_unlock(&d->lock);
+
+  // ready may free the decoder
+  d->ready(d->ready_data);
+  return FALSE;
+}
+
+/**
+ * @brief Prepare to ask for a delta against the version of a file we
+ *        have
+ *
+ * Its signature is computed by a worker, ready is called from the main
+ * loop once it is, unless the decoder is freed first.
+ * @return NULL if we have no version of it we can use
+ */
+JingleFTDelta *jingle_ft_delta_new_decoder(const gchar *path,
+                                           JingleFTDeltaReady ready,
+                                           gpointer user_data)
+{
+  JingleFTDelta *d;
+  struct stat st;
+  gint fd = g_open(path, O_RDONLY, 0);
+
+  if (fd < 0)
+    return NULL;
+  if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) ||
+      st.st_size < JINGLE_FT_DELTA_BLOCK) {
+    close(fd);
+    return NULL;
+  }
+
+  // Larger blocks for a larger file, so that the signature stays small.
+  // What follows the last whole block is not in it.
+  d = delta_new();
+  d->fd = fd;
+  d->block = MAX(JINGLE_FT_DELTA_BLOCK,
+                 (st.st_size + JINGLE_FT_DELTA_BLOCKS - 1) /
+                 JINGLE_FT_DELTA_BLOCKS);
+  d->blocks = st.st_size / d->block;
+  d->ready = ready;
+  d->ready_data = user_data;
+
+  if (pool == NULL)
+    pool = g_thread_pool_new(delta_job, NULL, JINGLE_FT_DELTA_THREADS,
+                             FALSE, NULL);
+  d->signing = TRUE;
+  g_thread_pool_push(pool, d, NULL);
+  return d;
+}
+
+/**
+ * @brief Whether the worker is still computing the signature
+ */
+gboolean jingle_ft_delta_is_signing(JingleFTDelta *d)
+{
+  gboolean signing;
+
+  g_mutex_lock(&d->lock);
+  signing = d->signing;
+  g_mutex_unlock(&d->lock);
+  return signing;
+}
+
+/**
+ * @brief Rebuild a sparse file, there is no older version to copy from
+ */
+JingleFTDelta *jingle_ft_delta_new_sparse(void)
+{
+  return delta_new();
+}
+
+/**
+ * @brief The signature to put in the session-accept, in base64
+ * @param block Set to the size of the blocks
+ * @return NULL if it is not computed yet, or the old version could not
+ *         be read
+ */
+const gchar *jingle_ft_delta_get_signature(JingleFTDelta *d, guint *block)
+{
+  *block = d->block;
+  return jingle_ft_delta_is_signing(d) ? NULL : d->signature;
+}
+
+/**
+ * Give count blocks of the old version, from first
+ */
+static gboolean delta_copy(JingleFTDelta *d, guint32 first, guint32 count,
+                           JingleFTDeltaWrite write, gpointer user_data,
+                           GError **err)
+{
+  guchar *buf;
+  guint32 i;
+  gboolean ok = TRUE;
+
+  if (count == 0 || first >= d->blocks || count > d->blocks - first) {
+    g_set_error(err, G_IO_CHANNEL_ERROR, G_IO_CHANNEL_ERROR_FAILED,
+                "invalid delta: we have no block %u", first + count - 1);
+    return FALSE;
+  }
+
+  buf = g_malloc(d->block);
+  for (i = 0; ok && i < count; i++) {
+    ok = delta_pread(d->fd, buf, d->block, (guint64)(first + i) * d->block);
+    if (!ok)
+      g_set_error(err, G_IO_CHANNEL_ERROR, G_IO_CHANNEL_ERROR_FAILED,
+                  "cannot read the old version");
+    else
+      ok = write(user_data, (const gchar *)buf, d->block, err);
+  }
+  g_free(buf);
+  return ok;
+}
+
+/**
+ * @brief Rebuild the file from a part of the data of the transfer
+ *
+ * The data may be cut anywhere, even in the middle of an instruction.
+ * @return FALSE with err set if the data is invalid or write failed
+ */
+gboolean jingle_ft_delta_decode(JingleFTDelta *d, const gchar *data,
+                                gsize len, JingleFTDeltaWrite write,
+                                gpointer user_data, GError **err)
+{
+  const guchar *p = (const guchar *)data;
+  gsize n;
+
+  while (len > 0) {
+    // The rest of a literal goes through as it is
+    if (d->literal > 0) {
+      n = MIN(len, d->literal);
+      if (!write(user_data, (const gchar *)p, n, err))
+        return FALSE;
+      p += n;
+      len -= n;
+      d->literal -= n;
+      continue;
+    }
+
+    d->head[d->headlen++] = *p++;
+    len--;
+    if (d->head[0] == 'L' && d->headlen == 5) {
+      d->literal = delta_get32(d->head + 1);
+      d->headlen = 0;
+    } else if (d->head[0] == 'H' && d->headlen == 5) {
+      d->headlen = 0;
+      if (!write(user_data, NULL, delta_get32(d->head + 1), err))
+        return FALSE;
+    } else if (d->head[0] == 'B' && d->headlen == 9) {
+      d->headlen = 0;
+      if (!delta_copy(d, delta_get32(d->head + 1), delta_get32(d->head + 5),
+                      write, user_data, err))
+        return FALSE;
+    } else if (d->head[0] != 'L' && d->head[0] != 'B' &&
+               d->head[0] != 'H') {
+      g_set_error(err, G_IO_CHANNEL_ERROR, G_IO_CHANNEL_ERROR_FAILED,
+                  "invalid delta instruction");
+      return FALSE;
+    }
+  }
+  return TRUE;
+}
+
+/**
+ * @brief Prepare to send a file against the signature the receiver
+ *        gave of its version
+ * @return NULL if the signature is invalid
+ */
+JingleFTDelta *jingle_ft_delta_new_encoder(guint block,
+                                           const gchar *signature)
+{
+  JingleFTDelta *d;
+  guchar *sig;
+  gsize len = 0;
+  guint i, t;
+
+  if (block < JINGLE_FT_DELTA_BLOCK || signature == NULL)
+    return NULL;
+
+  sig = g_base64_decode(signature, &len);
+  if (len == 0 || len % DELTA_SIG != 0) {
+    g_free(sig);
+    return NULL;
+  }
+
+  d = delta_new();
+  d->block = block;
+  d->blocks = len / DELTA_SIG;
+  d->weak = g_new(guint32, d->blocks);
+  d->strong = g_malloc(d->blocks * JINGLE_FT_DELTA_STRONG);
+  d->next = g_new(gint32, d->blocks);
+  d->tag = g_new(gint32, DELTA_TAGS);
+  for (t = 0; t < DELTA_TAGS; t++)
+    d->tag[t] = -1;
+
+  // Chained from the last, so that the first of identical blocks is
+  // found first
+  for (i = d->blocks; i-- > 0;) {
+    d->weak[i] = delta_get32(sig + i * DELTA_SIG);
+    memcpy(d->strong + i * JINGLE_FT_DELTA_STRONG, sig + i * DELTA_SIG + 4,
+           JINGLE_FT_DELTA_STRONG);
+    t = delta_tag(d->weak[i]);
+    d->next[i] = d->tag[t];
+    d->tag[t] = i;
+  }
+  g_free(sig);
+  return d;
+}
+
+/**
+ * The block of the old version the window at data is, or -1
+ */
+static gint32 delta_find(JingleFTDelta *d, guint32 weak, const guchar *data)
+{
+  guchar strong[JINGLE_FT_DELTA_STRONG];
+  gboolean hashed = FALSE;
+  gint32 i;
+
+  for (i = d->tag[delta_tag(weak)]; i >= 0; i = d->next[i]) {
+    if (d->weak[i] != weak)
+      continue;
+    if (!hashed) {
+      delta_strong(data, d->block, strong);
+      hashed = TRUE;
+    }
+    if (!memcmp(d->strong + i * JINGLE_FT_DELTA_STRONG, strong,
+                JINGLE_FT_DELTA_STRONG))
+      return i;
+  }
+  return -1;
+}
+
+/**
+ * Whether the window at data is block i of the old version
+ */
+static gboolean delta_is(JingleFTDelta *d, guint32 i, const guchar *data)
+{
+  guchar strong[JINGLE_FT_DELTA_STRONG];
+  guint32 s1, s2;
+
+  delta_sum(data, d->block, &s1, &s2);
+  if (d->weak[i] != delta_weak(s1, s2))
+    return FALSE;
+  delta_strong(data, d->block, strong);
+  return !memcmp(d->strong + i * JINGLE_FT_DELTA_STRONG, strong,
+                 JINGLE_FT_DELTA_STRONG);
+}
+
+/**
+ * @brief Add a part of the file to send as it is
+ */
+void jingle_ft_delta_literal(GByteArray *out, const gchar *data, gsize len)
+{
+  guchar head[5];
+  gsize n;
+
+  while (len > 0) {
+    n = MIN(len, JINGLE_FT_DELTA_LITERAL);
+    head[0] = 'L';
+    delta_put32(head + 1, n);
+    g_byte_array_append(out, head, sizeof(head));
+    g_byte_array_append(out, (const guint8 *)data, n);
+    data += n;
+    len -= n;
+  }
+}
+
+/**
+ * @brief Add a hole, len zeros the receiver does not write
+ */
+void jingle_ft_delta_hole(GByteArray *out, guint64 len)
+{
+  guchar head[5];
+  guint32 n;
+
+  while (len > 0) {
+    n = MIN(len, G_MAXUINT32);
+    head[0] = 'H';
+    delta_put32(head + 1, n);
+    g_byte_array_append(out, head, sizeof(head));
+    len -= n;
+  }
+}
+
+static void delta_blocks(GByteArray *out, guint32 first, guint32 count)
+{
+  guchar head[9];
+
+  head[0] = 'B';
+  delta_put32(head + 1, first);
+  delta_put32(head + 5, count);
+  g_byte_array_append(out, head, sizeof(head));
+}
+
+/**
+ * @brief Encode the file from pos, len bytes or a little more when a
+ *        block matches across the end
+ *
+ * map is the whole file, which the prefetcher faults in ahead.
+ * @return how many bytes of the file were encoded
+ */
+gsize jingle_ft_delta_encode(JingleFTDelta *d, const gchar *map,
+                             guint64 size, guint64 pos, gsize len,
+                             GByteArray *out)
+{
+  const guchar *file = (const guchar *)map;
+  guint64 p = pos, lit = pos, end = MIN(pos + len, size);
+  guint32 n;
+  gint32 i;
+
+  if (pos != d->pos)
+    d->rolling = FALSE;
+
+  while (p < end) {
+    // Less than a block is left, it can only be sent as it is
+    if (p + d->block > size) {
+      p = end;
+      break;
+    }
+
+    if (!d->rolling) {
+      delta_sum(file + p, d->block, &d->s1, &d->s2);
+      d->rolling = TRUE;
+    }
+
+    i = delta_find(d, delta_weak(d->s1, d->s2), file + p);
+    if (i >= 0) {
+      // The blocks following it too make a single instruction
+      for (n = 1; i + n < d->blocks &&
+                  (guint64)(n + 1) * d->block <= JINGLE_FT_DELTA_COPY &&
+                  p + (guint64)n * d->block < end &&
+                  p + (guint64)(n + 1) * d->block <= size &&
+                  delta_is(d, i + n, file + p + (guint64)n * d->block); n++)
+        ;
+      jingle_ft_delta_literal(out, map + lit, p - lit);
+      delta_blocks(out, i, n);
+      p += (guint64)n * d->block;
+      lit = p;
+      d->rolling = FALSE;
+      continue;
+    }
+
+    // Slide the window by a byte
+    if (p + d->block < size) {
+      d->s1 += file[p + d->block] - file[p];
+      d->s2 += d->s1 - d->block * file[p];
+    } else {
+      d->rolling = FALSE;
+    }
+    p++;
+  }
+
+  jingle_ft_delta_literal(out, map + lit, p - lit);
+  d->pos = p;
+  return p - pos;
+}
+
+static void delta_destroy(JingleFTDelta *d)
+{
+  g_mutex_clear(&d->lock);
+  if (d->fd >= 0)
+    close(d->fd);
+  g_free(d->signature);
+  g_free(d->weak);
+  g_free(d->strong);
+  g_free(d->tag);
+  g_free(d->next);
+  g_free(d);
+}
+
+/**
+ * @brief Free the decoder or encoder
+ *
+ * ready is not called anymore. A worker still signing gives up and
+ * frees it itself.
+ */
+void jingle_ft_delta_free(JingleFTDelta *d)
+{
+  gboolean signing;
+
+  if (d == NULL)
+    return;
+
+  // The worker cannot add the source once it sees cancelled
+  g_mutex_lock(&d->lock);
+  g_atomic_int_set(&d->cancelled, 1);
+  signing = d->signing;
+  if (d->idle != 0)
+    g_source_remove(d->idle);
+  d->idle = 0;
+  g_mutex_unlock(&d->lock);
+
+  if (!signing)
+    delta_destroy(d);
+}
+
+/**
+ * @brief Stop the workers, every decoder must have been freed
+ *
+ * Waits for the workers to give up the decoders freed while they
+ * were signing them.
+ */
+void jingle_ft_delta_uninit(void)
+{
+  if (pool != NULL) {
+    g_thread_pool_free(pool, FALSE, TRUE);
+    pool = NULL;
+  }
+}
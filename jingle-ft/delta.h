@@ -0,0 +1,69 @@
+#ifndef __JINGLEFT_DELTA_H__
+#define __JINGLEFT_DELTA_H__ 1
+
+/**
+ * \file delta.h
+ * \brief Send only what changed in a file the receiver has an older
+ *        version of, the rsync way
+ */
+
+#include <glib.h>
+
+/* Our own extension of the description, and the disco feature telling
+ * that we understand it */
+#define NS_JINGLE_APP_FT_DELTA "http://mcabber.com/protocol/jingle-ft/delta"
+
+/* Smallest block, and most blocks in the signature of a file: 32 KiB
+ * of base64 at most, see also JINGLE_FT_DELTA_ACCEPT_MAX */
+#define JINGLE_FT_DELTA_BLOCK  4096
+#define JINGLE_FT_DELTA_BLOCKS 2048
+
+/* Most bytes of signatures, in base64, in a single session-accept.
+ * The files offered past it are received whole. */
+#define JINGLE_FT_DELTA_ACCEPT_MAX 65536
+
+/* Worker threads computing signatures, shared by all the transfers */
+#define JINGLE_FT_DELTA_THREADS 1
+
+/* Bytes of the md5 of a block kept in the signature */
+#define JINGLE_FT_DELTA_STRONG 8
+
+/* Most bytes a single literal or copy instruction stands for */
+#define JINGLE_FT_DELTA_LITERAL 65536
+#define JINGLE_FT_DELTA_COPY    4194304
+
+/**
+ * \brief Given each part of the file rebuilt by the receiver, in order.
+ *        data is NULL for a hole of len zeros.
+ */
+typedef gboolean (*JingleFTDeltaWrite) (gpointer user_data, const gchar *data,
+                                        gsize len, GError **err);
+
+/**
+ * \brief Called in the main loop once the signature is computed
+ */
+typedef void (*JingleFTDeltaReady) (gpointer user_data);
+
+typedef struct _JingleFTDelta JingleFTDelta;
+
+gboolean jingle_ft_delta_enabled(void);
+JingleFTDelta *jingle_ft_delta_new_decoder(const gchar *path,
+                                           JingleFTDeltaReady ready,
+                                           gpointer user_data);
+gboolean jingle_ft_delta_is_signing(JingleFTDelta *d);
+JingleFTDelta *jingle_ft_delta_new_sparse(void);
+const gchar *jingle_ft_delta_get_signature(JingleFTDelta *d, guint *block);
+gboolean jingle_ft_delta_decode(JingleFTDelta *d, const gchar *data,
+                                gsize len, JingleFTDeltaWrite write,
+                                gpointer user_data, GError **err);
+JingleFTDelta *jingle_ft_delta_new_encoder(guint block,
+                                           const gchar *signature);
+gsize jingle_ft_delta_encode(JingleFTDelta *d, const gchar *map,
+                             guint64 size, guint64 pos, gsize len,
+                             GByteArray *out);
+void jingle_ft_delta_literal(GByteArray *out, const gchar *data, gsize len);
+void jingle_ft_delta_hole(GByteArray *out, guint64 len);
+void jingle_ft_delta_free(JingleFTDelta *d);
+void jingle_ft_delta_uninit(void);
+
+#endif
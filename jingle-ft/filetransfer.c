@@ -23,6 +23,9 @@
 #include <glib.h>
 #include <glib/gstdio.h>
 #include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
 
 #include <mcabber/modules.h>
 #include <mcabber/utils.h>
@@ -32,6 +35,7 @@
 #include <mcabber/compl.h>
 #include <mcabber/commands.h>
 #include <mcabber/roster.h>
+#include <mcabber/caps.h>
 
 #include <jingle/jingle.h>
 #include <jingle/check.h>
@@ -51,24 +55,66 @@ static void start(session_content *sc);
 static void send(session_content *sc);
 static void stop(gconstpointer data);
 static gchar* info(gconstpointer data);
+static gboolean ready(gconstpointer data);
 
 
 static void jingle_ft_init(void);
 static void jingle_ft_uninit(void);
 // Return must be free
 static gchar *_convert_size(guint64 size);
+static gchar *_convert_time(gint64 usec);
 static int _next_index(void);
+static void _set_state(JingleFT *jft, JingleFTState state);
+static void _stats_collect(JingleFT *jft);
 static void _free(JingleFT *jft);
-static gboolean _check_hash(const gchar *hash1, GChecksum *md5);
-static gboolean _is_md5_hash(const gchar *hash);
+static void _sent_hashed(gpointer data);
+static void _received_hashed(gpointer data);
+static void _received(JingleFT *jft, gboolean verified);
+static gboolean _parse_hash(JingleFT *ft, LmMessageNode *file);
+static GChecksumType _hash_type(const gchar *jid, const gchar *res);
 static void _jft_send(char **args, JingleFT *jft);
 static void _jft_info(char **args);
 static void _jft_flush(char **args);
+static void _info_add(JingleFT *jft);
 static JingleFT* _new(const gchar *name);
+static gboolean _stat(JingleFT *jft);
+static gboolean _open(JingleFT *jft);
+static void _next(JingleSession *sess, const gchar *name, gboolean sent);
+static gboolean _open_incoming(JingleFT *jft);
+static gboolean _resume(JingleFT *jft);
+static gboolean _publish(JingleFT *jft);
+static gboolean _link_copy(JingleFT *jft);
+static void _take_copy(JingleFT *jft, gchar *path);
+static void _dedup_found(gpointer data, gchar *path);
+static void _sign(JingleFT *jft);
+static void _signed(gpointer data);
+static void _checkpoint_load(JingleFT *jft);
+static void _checkpoint_save(JingleFT *jft);
+static void _checkpoint_remove(JingleFT *jft);
+static gsize _write_buffer_size(void);
+static gboolean _flush_timeout(gpointer data);
+static void _prefetch_ready(gpointer data);
+static void _hash_caught_up(gpointer data);
+static gboolean _has_compress(LmMessageNode *node);
+static gboolean _has_feature(const gchar *jid, const gchar *res,
+                             const gchar *ns);
+static LmMessageNode *_find_ext(LmMessageNode *node, const gchar *name,
+                                const gchar *ns);
+static gboolean _in_hole(JingleFT *jft, guint64 pos, guint64 *end);
+static gboolean _write_hole(JingleFT *jft, guint64 len, GError **err);
+static void _add_signature(JingleFT *jft, LmMessageNode *content,
+                           LmMessageNode *file);
+static gsize _signatures_size(LmMessageNode *content);
+static gboolean _write(gpointer data, const gchar *buf, gsize len,
+                       GError **err);
+static gboolean _deflate(JingleFT *jft, const gchar *data, gsize len,
+                         gboolean last, gchar **packed, gsize *packedlen);
 
 const gchar *deps[] = { "jingle", NULL };
 
-static GSList *info_list = NULL;
+/* Transfers by index, and in the order they were created */
+static GHashTable *info_table = NULL;
+static GQueue info_queue = G_QUEUE_INIT;
 static guint jft_cid = 0;
 
 const gchar* strstate[] = {
@@ -87,7 +133,8 @@ static JingleAppFuncs funcs = {
   .start            = start,
   .send             = send,
   .stop             = stop,
-  .info             = info
+  .info             = info,
+  .ready            = ready
 };
 
 module_info_t info_jingle_ft = {
@@ -138,8 +185,8 @@ static gconstpointer newfrommessage(JingleContent *cn, GError **err)
   }
 
   ft = g_new0(JingleFT, 1);
+  jingle_ft_stats_init(&ft->stats, JINGLE_FT_PENDING);
   datestr  = lm_message_node_get_attribute(node, "date");
-  ft->hash = (gchar *) lm_message_node_get_attribute(node, "hash");
   ft->name = (gchar *) lm_message_node_get_attribute(node, "name");
   sizestr  = lm_message_node_get_attribute(node, "size");
   ft->transmit = 0;
@@ -179,22 +226,44 @@ static gconstpointer newfrommessage(JingleContent *cn, GError **err)
     return NULL;
   }
 
-  // check if the md5 hash is valid ([a-fA-F0-9){32})
-  if (ft->hash != NULL && (strlen(ft->hash) != 32 || !_is_md5_hash(ft->hash))) {
+  if (!_parse_hash(ft, node)) {
     g_set_error(err, JINGLE_CHECK_ERROR, JINGLE_CHECK_ERROR_BADVALUE,
                 "the offered file has an invalid hash");
+    g_free(ft->hash);
     g_free(ft->name);
     g_free(ft);
     return NULL;
   }
-  ft->hash = g_strndup(ft->hash, 32);
 
-  {
-    JingleFTInfo *jfti = g_new0(JingleFTInfo, 1);
-    jfti->index = _next_index();
-    jfti->jft = ft;
-    info_list = g_slist_append(info_list, jfti);
+  // We tell in the session-accept that we take it deflated
+  ft->compress = _has_compress(node) && jingle_ft_compress_level() > 0;
+
+  // And that we have an older version, if we do
+  ft->delta = _find_ext(node, "delta", NS_JINGLE_APP_FT_DELTA) != NULL &&
+              jingle_ft_delta_enabled();
+
+  // And that we make its holes ourselves
+  ft->sparse = _find_ext(node, "sparse", NS_JINGLE_APP_FT_SPARSE) != NULL &&
+               jingle_ft_sparse_enabled();
+
+  // We may already have a part of it from an earlier attempt
+  ft->tmpname = g_strconcat(ft->name, JINGLE_FT_PARTIAL, NULL);
+  _checkpoint_load(ft);
+
+  // Or all of it, under that name or another: the range tells the
+  // sender that there is nothing to send. The files that may be it are
+  // hashed before the session-accept is sent, even those the index
+  // knows.
+  if (ft->hash != NULL && ft->hasher != NULL) {
+    gchar *dir = g_path_get_dirname(ft->name);
+    ft->search = jingle_ft_dedup_search(dir, ft->size, ft->hashtype,
+                                        ft->hash, _dedup_found, ft);
+    g_free(dir);
   }
+  if (ft->search == NULL)
+    _sign(ft);
+
+  _info_add(ft);
 
   return (gconstpointer) ft;
 }
@@ -213,90 +282,621 @@ static JingleHandleStatus handle(JingleAction action, gconstpointer data,
     if (!g_strcmp0(lm_message_node_get_attribute(node, "xmlns"),
                    NS_JINGLE_APP_FT_INFO)
         && !g_strcmp0(node->name, "hash")) {
-      ((JingleFT *)data)->hash = g_strdup(lm_message_node_get_value(node));
+      JingleFT *jft = (JingleFT *)data;
+      const gchar *algo = lm_message_node_get_attribute(node, "algo");
+      const gchar *value = lm_message_node_get_value(node);
+      const gchar *name = lm_message_node_get_attribute(node, "name");
+      SessionContent *sc = sessioncontent_find_by_app(data);
+      GChecksumType type = G_CHECKSUM_MD5;
+
+      // Without name, the session has only one file
+      if (name != NULL && sc != NULL && g_strcmp0(name, sc->name))
+        return JINGLE_STATUS_NOT_HANDLED;
+
+      // Without algo, it is the md5 sent by older versions
+      if ((algo != NULL && !jingle_ft_hash_type_from_name(algo, &type))
+          || jft->hasher == NULL
+          || type != jingle_ft_hash_get_type(jft->hasher)
+          || !jingle_ft_hash_is_valid(type, value)) {
+        scr_LogPrint(LPRINT_DEBUG, "Jingle File Transfer: cannot use the "
+                     "%s hash of %s", algo ? algo : "md5", jft->name);
+        return JINGLE_STATUS_HANDLED;
+      }
+      g_free(jft->hash);
+      jft->hash = g_strdup(value);
       return JINGLE_STATUS_HANDLED;
     }
     return JINGLE_STATUS_NOT_HANDLED;
   }
+  if (action == JINGLE_SESSION_ACCEPT) {
+    JingleFT *jft = (JingleFT *)data;
+    LmMessageNode *range = lm_message_node_find_child(node, "range");
+    LmMessageNode *delta;
+    const gchar *offset;
+
+    if (jft->dir != JINGLE_FT_OUTGOING)
+      return JINGLE_STATUS_HANDLED;
+
+    // Older receivers ignore the offer, the data is then sent as is
+    jft->compress = jft->compress && _has_compress(node);
+    jft->sparse = jft->sparse &&
+                  _find_ext(node, "sparse", NS_JINGLE_APP_FT_SPARSE) != NULL;
+
+    // The receiver has an older version. Without a signature we can
+    // use, the file is sent in the delta format all the same.
+    delta = _find_ext(node, "delta", NS_JINGLE_APP_FT_DELTA);
+    jft->delta = jft->delta && delta != NULL;
+    if (jft->delta) {
+      const gchar *block = lm_message_node_get_attribute(delta, "block");
+      jft->rsync = jingle_ft_delta_new_encoder(
+                     block ? g_ascii_strtoull(block, NULL, 10) : 0,
+                     lm_message_node_get_value(delta));
+      if (jft->rsync == NULL)
+        scr_LogPrint(LPRINT_DEBUG, "Jingle File Transfer: invalid signature"
+                     " for %s", jft->name);
+    }
+
+    if (range == NULL)
+      return JINGLE_STATUS_HANDLED;
+
+    // The receiver already has the beginning of the file
+    offset = lm_message_node_get_attribute(range, "offset");
+    if (offset == NULL)
+      return JINGLE_STATUS_HANDLED;
+    jft->offset = g_ascii_strtoull(offset, NULL, 10);
+    if (jft->offset > jft->size) {
+      g_set_error(err, JINGLE_CHECK_ERROR, JINGLE_CHECK_ERROR_BADVALUE,
+                  "the range starts after the end of the file");
+      jft->offset = 0;
+      _set_state(jft, JINGLE_FT_ERROR);
+      return JINGLE_STATUS_HANDLE_ERROR;
+    }
+    jft->transmit = jft->offset;
+
+    // The hash covers the whole file, what is not sent again too.
+    // The worker reads it while we send the rest, unless the index
+    // gave it to us.
+    if (jft->offset > 0 && jft->hash == NULL) {
+      gint fd = g_open(jft->path, O_RDONLY, 0);
+      jingle_ft_hash_free(jft->hasher);
+      jft->hasher = jingle_ft_hash_new(jft->hashtype);
+      if (fd >= 0) {
+        jingle_ft_hash_update_fd(jft->hasher, fd, 0, jft->offset);
+        close(fd);
+      }
+    }
+    if (jft->offset > 0 && jft->offset == jft->size)
+      scr_LogPrint(LPRINT_LOGNORM, "Jingle File Transfer: the receiver"
+                   " already has %s", jft->name);
+    else if (jft->offset > 0)
+      scr_LogPrint(LPRINT_LOGNORM, "Jingle File Transfer: resuming %s from %"
+                   G_GUINT64_FORMAT " bytes", jft->name, jft->offset);
+    return JINGLE_STATUS_HANDLED;
+  }
   return JINGLE_STATUS_NOT_HANDLED;
 }
 
-static gboolean _is_md5_hash(const gchar *hash)
+/**
+ * @brief Look for our deflate extension in a description
+ */
+static gboolean _has_compress(LmMessageNode *node)
+{
+  LmMessageNode *compress = _find_ext(node, "compress",
+                                      NS_JINGLE_APP_FT_COMPRESS);
+
+  return compress != NULL
+         && !g_strcmp0(lm_message_node_get_attribute(compress, "algo"),
+                       JINGLE_FT_COMPRESS_ALGO);
+}
+
+/**
+ * @brief Look for one of our extensions in a description
+ */
+static LmMessageNode *_find_ext(LmMessageNode *node, const gchar *name,
+                                const gchar *ns)
+{
+  LmMessageNode *ext = lm_message_node_find_child(node, name);
+
+  if (ext == NULL ||
+      g_strcmp0(lm_message_node_get_attribute(ext, "xmlns"), ns))
+    return NULL;
+  return ext;
+}
+
+/**
+ * @brief Find which hash the sender uses, and the hash itself if
+ *        it was given in the offer
+ *
+ * XEP-0300 hash and hash-used children are prefered to the md5 hash
+ * attribute of XEP-0096. Without any of them, the sender may still
+ * give a md5 hash in a session-info.
+ * @return FALSE if a hash is malformed
+ */
+static gboolean _parse_hash(JingleFT *ft, LmMessageNode *file)
 {
-  int i = 0;
-  for (i = 0; i < 32 && hash[i]; i++)
-    if (!g_ascii_isxdigit(hash[i])) break;
+  LmMessageNode *child;
+  const gchar *legacy = lm_message_node_get_attribute(file, "hash");
+  gboolean known = FALSE, unknown = FALSE;
+  GChecksumType type;
+
+  for (child = file->children; child; child = child->next) {
+    if (g_strcmp0(lm_message_node_get_attribute(child, "xmlns"), NS_HASHES))
+      continue;
+    if (g_strcmp0(child->name, "hash") && g_strcmp0(child->name, "hash-used"))
+      continue;
+
+    if (!jingle_ft_hash_type_from_name(
+          lm_message_node_get_attribute(child, "algo"), &type)) {
+      unknown = TRUE;
+      continue;
+    }
+
+    if (!g_strcmp0(child->name, "hash")) {
+      gchar *hex = jingle_ft_hash_base64_to_hex(type,
+                                              lm_message_node_get_value(child));
+      if (hex == NULL)
+        return FALSE;
+      // A hash we can check beats anything else
+      g_free(ft->hash);
+      ft->hash = hex;
+      ft->hashtype = type;
+      known = TRUE;
+      break;
+    }
+    if (!known) {
+      ft->hashtype = type;
+      known = TRUE;
+    }
+  }
 
-  if (i == 32)
+  if (!known && legacy != NULL) {
+    if (!jingle_ft_hash_is_valid(G_CHECKSUM_MD5, legacy))
+      return FALSE;
+    ft->hash = g_strdup(legacy);
+    ft->hashtype = G_CHECKSUM_MD5;
+    known = TRUE;
+  }
+
+  // Nothing we could check would match what the sender computes
+  if (!known && unknown)
     return TRUE;
-  else
-    return FALSE;
+
+  if (!known)
+    ft->hashtype = G_CHECKSUM_MD5;
+  ft->hasher = jingle_ft_hash_new(ft->hashtype);
+  return TRUE;
+}
+
+/**
+ * @brief Hash used for the files we send, from jingle_ft_hash
+ *
+ * A receiver which does not advertise XEP-0300 only knows md5.
+ */
+static GChecksumType _hash_type(const gchar *jid, const gchar *res)
+{
+  const gchar *name = settings_opt_get("jingle_ft_hash");
+  GChecksumType type;
+
+  if (!_has_feature(jid, res, NS_HASHES))
+    return G_CHECKSUM_MD5;
+  if (name != NULL && jingle_ft_hash_type_from_name(name, &type))
+    return type;
+  if (name != NULL)
+    scr_LogPrint(LPRINT_LOGNORM, "Jingle File Transfer: unsupported hash %s,"
+                 " using %s", name, JINGLE_FT_HASH_DEFAULT);
+
+  jingle_ft_hash_type_from_name(JINGLE_FT_HASH_DEFAULT, &type);
+  return type;
 }
 
 static gboolean handle_data(gconstpointer jingleft, const gchar *data, guint len)
 {
   JingleFT *jft = (JingleFT *) jingleft;
   GError *err = NULL;
-  GIOStatus status;
-  gsize bytes_written = 0;
+  gchar *plain = NULL;
+  gboolean written;
 
   if (jft->dir != JINGLE_FT_INCOMING)
     return FALSE;
 
-  if (jft->md5 == NULL) {
-    jft->md5 = g_checksum_new(G_CHECKSUM_MD5);
+  // Writing failed already, the rest of the file has nowhere to go
+  if (jft->state == JINGLE_FT_ERROR)
+    return FALSE;
+
+  // The sender ignored the range, we get the whole file after all
+  if (jft->copy != NULL) {
+    g_free(jft->copy);
+    jft->copy = NULL;
+    jft->offset = jft->transmit = 0;
+  }
+
+  if (jft->outfile == NULL && !_open_incoming(jft)) {
+    _set_state(jft, JINGLE_FT_ERROR);
+    return FALSE;
   }
   
-  g_checksum_update(jft->md5, (guchar*)data, (gsize)len);
-    
-  // TODO: check if the file already exist or if it was created
-  // during the call to jingle_ft_check and handle_data
-  if (jft->outfile == NULL) {
-    jft->outfile = g_io_channel_new_file(jft->name, "w", &err);
-    if (jft->outfile == NULL || err != NULL) {
-      scr_LogPrint(LPRINT_LOGNORM, "Jingle File Transfer: %s %s", err->message,
-                   jft->name);
-    //TODO: propagate the GError ?
-      g_error_free(err);
+  _set_state(jft, JINGLE_FT_STARTING);
+
+  jingle_ft_stats_progress(&jft->stats, JINGLE_FT_STAGE_WIRE, len);
+  if (jft->compress) {
+    gsize plainlen = 0;
+    if (jft->zlib == NULL)
+      jft->zlib = jingle_ft_compress_new(TRUE, 0);
+    if (jft->zlib == NULL ||
+        !jingle_ft_compress_data(jft->zlib, data, len, FALSE, &plain,
+                                 &plainlen, &err)) {
+      scr_LogPrint(LPRINT_LOGNORM, "Jingle File Transfer: %s %s",
+                   err ? err->message : "cannot decompress", jft->name);
+      if (err != NULL)
+        g_error_free(err);
+      _set_state(jft, JINGLE_FT_ERROR);
       return FALSE;
     }
-    jft->state = JINGLE_FT_STARTING;
-    status = g_io_channel_set_encoding(jft->outfile, NULL, &err);
-    if (status != G_IO_STATUS_NORMAL || err != NULL) {
-     scr_LogPrint(LPRINT_LOGNORM, "Jingle File Transfer: %s %s", err->message,
-                  jft->name);
-     g_error_free(err);
-     return FALSE;
-   }
+    data = plain;
+    len = plainlen;
+  }
+
+  // The data tells what to take from our older version, and where
+  // the holes are
+  if (jft->rsync == NULL && jft->sparse)
+    jft->rsync = jingle_ft_delta_new_sparse();
+  if (jft->rsync != NULL)
+    written = jingle_ft_delta_decode(jft->rsync, data, len, _write, jft, &err);
+  else
+    written = _write(jft, data, len, &err);
+  g_free(plain);
+  if (!written) {
+    scr_LogPrint(LPRINT_LOGNORM, "Jingle File Transfer: %s %s",
+                 err ? err->message : "cannot write", jft->name);
+    if (err != NULL)
+      g_error_free(err);
+    _set_state(jft, JINGLE_FT_ERROR);
+    return FALSE;
+  }
+  return TRUE;
+}
+
+/**
+ * @brief Hash and write a part of the file we receive
+ */
+static gboolean _write(gpointer data, const gchar *buf, gsize len,
+                       GError **err)
+{
+  JingleFT *jft = (JingleFT *)data;
+  GIOStatus status;
+  gsize bytes_written = 0;
+  gboolean behind;
+  gint64 t;
+
+  if (buf == NULL)
+    return _write_hole(jft, len, err);
+
+  // buf is only ours during the call, the worker hashes a copy.
+  // This comes after a resumed file queued what precedes it. While
+  // the worker is still far behind, e.g. reading that beginning again,
+  // it reads the data back from the file instead.
+  jingle_ft_stats_progress(&jft->stats, JINGLE_FT_STAGE_RECEIVED, len);
+  t = g_get_monotonic_time();
+  behind = jft->hasher != NULL && jingle_ft_hash_is_behind(jft->hasher);
+  if (jft->hasher != NULL && !behind)
+    jingle_ft_hash_update(jft->hasher, buf, len);
+  jft->stats.hash_wait += g_get_monotonic_time() - t;
+
+  t = g_get_monotonic_time();
+  status = g_io_channel_write_chars(jft->outfile, buf, (gssize) len,
+                                    &bytes_written, err);
+  jft->stats.write_time += g_get_monotonic_time() - t;
+  if (status != G_IO_STATUS_NORMAL)
+    return FALSE;
+
+  if (bytes_written != len) {
+    // not supposed to happen if status is normal, unless outfile is non-blocking
+    g_set_error(err, G_IO_CHANNEL_ERROR, G_IO_CHANNEL_ERROR_FAILED,
+                "short write");
+    return FALSE;
+  }
+
+  if (behind) {
+    if (g_io_channel_flush(jft->outfile, err) != G_IO_STATUS_NORMAL)
+      return FALSE;
+    jingle_ft_hash_update_fd(jft->hasher,
+                             g_io_channel_unix_get_fd(jft->outfile),
+                             jft->transmit, len);
   }
   
-  jft->state = JINGLE_FT_STARTING;
+  jft->transmit += len;
+  return TRUE;
+}
 
-  status = g_io_channel_write_chars(jft->outfile, data, (gssize) len,
-                                    &bytes_written, &err);
-  if (status != G_IO_STATUS_NORMAL || err != NULL) {
-     scr_LogPrint(LPRINT_LOGNORM, "Jingle File Transfer: %s %s", err->message,
-                  jft->name);
+
+/**
+ * @brief Leave a hole of len bytes in the file we receive
+ */
+static gboolean _write_hole(JingleFT *jft, guint64 len, GError **err)
+{
+  jingle_ft_stats_progress(&jft->stats, JINGLE_FT_STAGE_RECEIVED, len);
+  if (jft->hasher != NULL)
+    jingle_ft_hash_update_zeros(jft->hasher, len);
+
+  // What is buffered goes before it. An earlier attempt may have
+  // written something there.
+  if (g_io_channel_flush(jft->outfile, err) != G_IO_STATUS_NORMAL)
+    return FALSE;
+  if (!jingle_ft_sparse_punch(g_io_channel_unix_get_fd(jft->outfile),
+                              jft->transmit, len)) {
+    g_set_error(err, G_IO_CHANNEL_ERROR, G_IO_CHANNEL_ERROR_FAILED,
+                "cannot make a hole in");
+    return FALSE;
+  }
+  if (g_io_channel_seek_position(jft->outfile, jft->transmit + len,
+                                 G_SEEK_SET, err) != G_IO_STATUS_NORMAL)
+    return FALSE;
+
+  jft->transmit += len;
+  return TRUE;
+}
+
+/**
+ * @brief Open the temporary file where we write what we receive
+ *
+ * The whole file is allocated at once, so that it is not fragmented
+ * and a full disk is found before the transfer rather than during.
+ * A sparse file only gets its size, its holes must stay holes.
+ */
+static gboolean _open_incoming(JingleFT *jft)
+{
+  GError *err = NULL;
+  GIOStatus status;
+  int ret;
+
+  // TODO: check if the file already exist or if it was created
+  // during the call to jingle_ft_check and handle_data
+
+  // Resume after what the checkpoint says we have
+  jft->outfile = g_io_channel_new_file(jft->tmpname,
+                                       jft->offset > 0 ? "r+" : "w", &err);
+  if (jft->outfile == NULL || err != NULL) {
+    scr_LogPrint(LPRINT_LOGNORM, "Jingle File Transfer: %s %s", err->message,
+                 jft->tmpname);
+  //TODO: propagate the GError ?
     g_error_free(err);
     return FALSE;
   }
-  status = g_io_channel_flush(jft->outfile, &err);
+  _set_state(jft, JINGLE_FT_STARTING);
+  status = g_io_channel_set_encoding(jft->outfile, NULL, &err);
   if (status != G_IO_STATUS_NORMAL || err != NULL) {
     scr_LogPrint(LPRINT_LOGNORM, "Jingle File Transfer: %s %s", err->message,
-                 jft->name);
+                 jft->tmpname);
     g_error_free(err);
+    goto error;
+  }
+
+  if (jft->sparse && jft->offset == 0 &&
+      ftruncate(g_io_channel_unix_get_fd(jft->outfile), jft->size) != 0) {
+    scr_LogPrint(LPRINT_LOGNORM, "Jingle File Transfer: cannot make %s"
+                 " sparse", jft->tmpname);
+    goto error;
+  }
+
+  if (jft->size > jft->offset && !jft->sparse) {
+    ret = posix_fallocate(g_io_channel_unix_get_fd(jft->outfile),
+                          jft->offset, jft->size - jft->offset);
+    if (ret == ENOSPC || ret == EFBIG) {
+      scr_LogPrint(LPRINT_LOGNORM, "Jingle File Transfer: not enough space"
+                   " for %s", jft->name);
+      goto error;
+    }
+    // Otherwise the file system cannot, we just grow the file as we write
+  }
+
+  if (jft->offset > 0 && !_resume(jft))
+    goto error;
+
+  // The channel writes its buffer out by itself once it is full
+  g_io_channel_set_buffer_size(jft->outfile, _write_buffer_size());
+  jft->flush_source = g_timeout_add_seconds(JINGLE_FT_FLUSH_INTERVAL,
+                                            _flush_timeout, jft);
+  return TRUE;
+
+error:
+  g_io_channel_unref(jft->outfile);
+  jft->outfile = NULL;
+  return FALSE;
+}
+
+/**
+ * @brief Drop what follows the file in the file we receive, go to the
+ *        offset we resume from, and hash what precedes it
+ */
+static gboolean _resume(JingleFT *jft)
+{
+  gint fd = g_io_channel_unix_get_fd(jft->outfile);
+  GError *err = NULL;
+
+  if (ftruncate(fd, jft->size) != 0 ||
+      g_io_channel_seek_position(jft->outfile, jft->offset, G_SEEK_SET,
+                                 &err) != G_IO_STATUS_NORMAL) {
+    scr_LogPrint(LPRINT_LOGNORM, "Jingle File Transfer: cannot resume %s",
+                 jft->name);
+    if (err != NULL)
+      g_error_free(err);
     return FALSE;
   }
 
-  if (bytes_written != len) {
-    // not supposed to happen if status is normal, unless outfile is non-blocking
+  // Queued before the data that follows, so it is hashed in order
+  if (jft->hasher != NULL)
+    jingle_ft_hash_update_fd(jft->hasher, fd, 0, jft->offset);
+  return TRUE;
+}
+
+static gchar *_checkpoint_path(JingleFT *jft)
+{
+  return g_strconcat(jft->name, JINGLE_FT_CHECKPOINT, NULL);
+}
+
+/**
+ * @brief Resume from the checkpoint left by an earlier attempt to
+ *        receive the same file, if any
+ */
+static void _checkpoint_load(JingleFT *jft)
+{
+  GKeyFile *kf = g_key_file_new();
+  gchar *path = _checkpoint_path(jft);
+  gchar *algo = NULL, *hash = NULL;
+  guint64 offset = 0;
+  struct stat fileinfo;
+
+  if (g_key_file_load_from_file(kf, path, G_KEY_FILE_NONE, NULL)) {
+    algo = g_key_file_get_string(kf, "checkpoint", "algo", NULL);
+    hash = g_key_file_get_string(kf, "checkpoint", "hash", NULL);
+    offset = g_key_file_get_uint64(kf, "checkpoint", "offset", NULL);
+
+    // It must be the same file, that we can check the same way
+    if (jft->hasher == NULL
+        || g_key_file_get_uint64(kf, "checkpoint", "size", NULL) != jft->size
+        || g_key_file_get_int64(kf, "checkpoint", "date", NULL) != jft->date
+        || g_strcmp0(algo, jingle_ft_hash_type_to_name(jft->hashtype))
+        || (hash != NULL && jft->hash != NULL &&
+            g_ascii_strcasecmp(hash, jft->hash))
+        || g_stat(jft->tmpname, &fileinfo) != 0)
+      offset = 0;
+    else // What was not written out before a crash is lost
+      offset = MIN(offset, MIN((guint64)fileinfo.st_size, jft->size));
+  }
+
+  jft->offset = jft->transmit = jft->checkpoint = offset;
+
+  g_free(algo);
+  g_free(hash);
+  g_free(path);
+  g_key_file_free(kf);
+}
+
+/**
+ * @brief Record how much of the file we have, once it is written out
+ */
+static void _checkpoint_save(JingleFT *jft)
+{
+  GKeyFile *kf;
+  gchar *path, *data;
+  gsize len;
+
+  if (jft->dir != JINGLE_FT_INCOMING || jft->hasher == NULL ||
+      jft->transmit == jft->checkpoint)
+    return;
+
+  kf = g_key_file_new();
+  g_key_file_set_uint64(kf, "checkpoint", "size", jft->size);
+  g_key_file_set_int64(kf, "checkpoint", "date", jft->date);
+  g_key_file_set_string(kf, "checkpoint", "algo",
+                        jingle_ft_hash_type_to_name(jft->hashtype));
+  if (jft->hash != NULL)
+    g_key_file_set_string(kf, "checkpoint", "hash", jft->hash);
+  g_key_file_set_uint64(kf, "checkpoint", "offset", jft->transmit);
+
+  path = _checkpoint_path(jft);
+  data = g_key_file_to_data(kf, &len, NULL);
+  if (data != NULL && g_file_set_contents(path, data, len, NULL))
+    jft->checkpoint = jft->transmit;
+  else
+    scr_LogPrint(LPRINT_DEBUG, "Jingle File Transfer: cannot write %s", path);
+
+  g_free(data);
+  g_free(path);
+  g_key_file_free(kf);
+}
+
+static void _checkpoint_remove(JingleFT *jft)
+{
+  gchar *path;
+
+  if (jft->dir != JINGLE_FT_INCOMING)
+    return;
+
+  path = _checkpoint_path(jft);
+  g_unlink(path);
+  g_free(path);
+}
+
+/**
+ * @brief Size of the write-behind buffer from jingle_ft_write_buffer (KiB)
+ */
+static gsize _write_buffer_size(void)
+{
+  gint kib = JINGLE_FT_WRITE_BUFFER;
+
+  if (settings_opt_get("jingle_ft_write_buffer") != NULL)
+    kib = settings_opt_get_int("jingle_ft_write_buffer");
+
+  kib = CLAMP(kib, JINGLE_FT_WRITE_BUFFER_MIN, JINGLE_FT_WRITE_BUFFER_MAX);
+  return (gsize)kib * 1024;
+}
+
+static JingleFTSync _sync_policy(void)
+{
+  const gchar *policy = settings_opt_get("jingle_ft_sync");
+
+  if (!g_strcmp0(policy, "end"))
+    return JINGLE_FT_SYNC_END;
+  if (!g_strcmp0(policy, "flush"))
+    return JINGLE_FT_SYNC_FLUSH;
+  return JINGLE_FT_SYNC_NEVER;
+}
+
+/**
+ * @brief Write out the buffer of a received file
+ * @param sync Also wait for the data to reach the disk
+ * @return FALSE if writing failed
+ */
+static gboolean _flush(JingleFT *jft, gboolean sync)
+{
+  GError *err = NULL;
+  GIOStatus status;
+  gint64 t = g_get_monotonic_time();
+  gboolean ret = TRUE;
+
+  if (jft->outfile == NULL || jft->dir != JINGLE_FT_INCOMING)
+    return TRUE;
+
+  status = g_io_channel_flush(jft->outfile, &err);
+  if (status != G_IO_STATUS_NORMAL || err != NULL) {
+    scr_LogPrint(LPRINT_LOGNORM, "Jingle File Transfer: %s %s",
+                 err ? err->message : "cannot write", jft->name);
+    if (err != NULL)
+      g_error_free(err);
+    ret = FALSE;
+  } else if (sync && fdatasync(g_io_channel_unix_get_fd(jft->outfile)) != 0) {
+    scr_LogPrint(LPRINT_LOGNORM, "Jingle File Transfer: cannot sync %s",
+                 jft->name);
+    ret = FALSE;
+  } else {
+    jft->stats.bytes[JINGLE_FT_STAGE_WRITTEN] = jft->transmit - jft->offset;
+  }
+
+  jft->stats.write_time += g_get_monotonic_time() - t;
+  return ret;
+}
+
+static gboolean _flush_timeout(gpointer data)
+{
+  JingleFT *jft = (JingleFT *) data;
+
+  if (!_flush(jft, _sync_policy() == JINGLE_FT_SYNC_FLUSH)) {
+    _set_state(jft, JINGLE_FT_ERROR);
+    jft->flush_source = 0;
     return FALSE;
   }
-  
-  jft->transmit += len;
+  _checkpoint_save(jft);
   return TRUE;
 }
 
+static void _flush_stop(JingleFT *jft)
+{
+  if (jft->flush_source != 0) {
+    g_source_remove(jft->flush_source);
+    jft->flush_source = 0;
+  }
+}
 
 static int _next_index(void)
 {
@@ -304,14 +904,211 @@ static int _next_index(void)
   return ++a;
 }
 
+static void _set_state(JingleFT *jft, JingleFTState state)
+{
+  jingle_ft_stats_state(&jft->stats, state);
+  // No more data moves once we get there
+  if (state != JINGLE_FT_PENDING && state != JINGLE_FT_STARTING)
+    jingle_ft_stats_finish(&jft->stats);
+  jft->state = state;
+}
+
+/**
+ * @brief Copy in what the workers counted
+ */
+static void _stats_collect(JingleFT *jft)
+{
+  JingleFTStats *st = &jft->stats;
+
+  if (jft->prefetch != NULL)
+    jingle_ft_prefetch_get_stats(jft->prefetch,
+                                 &st->bytes[JINGLE_FT_STAGE_READ],
+                                 &st->read_time);
+  if (jft->hasher != NULL)
+    jingle_ft_hash_get_stats(jft->hasher, &st->bytes[JINGLE_FT_STAGE_HASHED],
+                             &st->hash_time);
+}
+
+/**
+ * @brief A transfer is over, and no session uses it anymore
+ */
+static gboolean _is_finished(JingleFT *jft)
+{
+  return (jft->state == JINGLE_FT_ERROR ||
+          jft->state == JINGLE_FT_REJECT ||
+          jft->state == JINGLE_FT_ENDING) &&
+         jft->digesting == 0 && sessioncontent_find_by_app(jft) == NULL;
+}
+
+static void _info_remove(JingleFTInfo *jftinf)
+{
+  g_hash_table_remove(info_table, GINT_TO_POINTER(jftinf->index));
+  g_queue_delete_link(&info_queue, jftinf->link);
+  _free(jftinf->jft);
+  g_free(jftinf);
+}
+
+/**
+ * @brief Forget the oldest finished transfers beyond jingle_ft_history
+ */
+static void _info_trim(void)
+{
+  gint limit = JINGLE_FT_HISTORY;
+  guint finished = 0;
+  GList *el, *next;
+
+  if (settings_opt_get("jingle_ft_history") != NULL)
+    limit = settings_opt_get_int("jingle_ft_history");
+  if (limit <= 0)
+    return;
+
+  for (el = info_queue.head; el; el = el->next)
+    if (_is_finished(((JingleFTInfo *)el->data)->jft))
+      finished++;
+
+  for (el = info_queue.head; el && finished > (guint)limit; el = next) {
+    next = el->next;
+    if (_is_finished(((JingleFTInfo *)el->data)->jft)) {
+      _info_remove(el->data);
+      finished--;
+    }
+  }
+}
+
+/**
+ * @brief Give a new transfer an index
+ */
+static void _info_add(JingleFT *jft)
+{
+  JingleFTInfo *jftinf = g_new0(JingleFTInfo, 1);
+
+  if (info_table == NULL)
+    info_table = g_hash_table_new(g_direct_hash, g_direct_equal);
+
+  jftinf->index = _next_index();
+  jftinf->jft = jft;
+  g_queue_push_tail(&info_queue, jftinf);
+  jftinf->link = info_queue.tail;
+  g_hash_table_insert(info_table, GINT_TO_POINTER(jftinf->index), jftinf);
+
+  _info_trim();
+}
+
+/**
+ * @brief Find the transfer whose index is the first argument
+ */
+static JingleFTInfo *_info_lookup(char **args)
+{
+  JingleFTInfo *jftinf = NULL;
+
+  if (!args[1]) {
+    scr_LogPrint(LPRINT_LOGNORM, "Jingle File Transfer: give me a number!");
+    return NULL;
+  }
+
+  if (info_table != NULL)
+    jftinf = g_hash_table_lookup(info_table,
+                   GINT_TO_POINTER(g_ascii_strtoll(args[1], NULL, 10)));
+  if (jftinf == NULL)
+    scr_LogPrint(LPRINT_LOGNORM, "Jingle File Transfer: give me a correct number!");
+  return jftinf;
+}
+
+/**
+ * @brief Where the time of a transfer went
+ */
+static void _jft_info_details(JingleFT *jft)
+{
+  JingleFTStats *st = &jft->stats;
+  JingleFTStage moved = (jft->dir == JINGLE_FT_INCOMING) ?
+                          JINGLE_FT_STAGE_RECEIVED : JINGLE_FT_STAGE_ACKED;
+  gchar *avg = _convert_size(jingle_ft_stats_average(st, moved));
+  gchar *pending = _convert_time(jingle_ft_stats_state_time(st,
+                                                     JINGLE_FT_PENDING));
+  gchar *active = _convert_time(jingle_ft_stats_state_time(st,
+                                                     JINGLE_FT_STARTING));
+  gchar *histo = jingle_ft_stats_histogram(st);
+  gchar *rtt = _convert_time(st->rtt_count ?
+                             st->rtt_total / (gint64)st->rtt_count : 0);
+  gchar *rttmax = _convert_time(st->rtt_max);
+  gchar *bytes, *worker, *wait;
+
+  scr_LogPrint(LPRINT_LOGNORM, "    pending %s, transferring %s, %s/s on"
+               " average", pending, active, avg);
+
+  if (jft->dir == JINGLE_FT_OUTGOING) {
+    bytes = _convert_size(st->bytes[JINGLE_FT_STAGE_READ]);
+    worker = _convert_time(st->read_time);
+    wait = _convert_time(st->read_wait);
+    scr_LogPrint(LPRINT_LOGNORM, "    disk: read %s in %s, waited for it"
+                 " %s", bytes, worker, wait);
+    g_free(bytes);
+    g_free(worker);
+    g_free(wait);
+    bytes = _convert_size(st->bytes[JINGLE_FT_STAGE_SENT]);
+    wait = _convert_size(st->bytes[JINGLE_FT_STAGE_ACKED]);
+    scr_LogPrint(LPRINT_LOGNORM, "    transport: %s sent, %s through",
+                 bytes, wait);
+    if (st->bytes[JINGLE_FT_STAGE_WIRE] != st->bytes[JINGLE_FT_STAGE_SENT])
+      scr_LogPrint(LPRINT_LOGNORM, "    %.1f%% of it on the wire",
+                   st->bytes[JINGLE_FT_STAGE_SENT] ?
+                   100.0 * st->bytes[JINGLE_FT_STAGE_WIRE] /
+                   st->bytes[JINGLE_FT_STAGE_SENT] : 0);
+    g_free(bytes);
+    g_free(wait);
+  } else {
+    bytes = _convert_size(st->bytes[JINGLE_FT_STAGE_WRITTEN]);
+    worker = _convert_time(st->write_time);
+    scr_LogPrint(LPRINT_LOGNORM, "    disk: %s written out, writing took %s",
+                 bytes, worker);
+    if (st->bytes[JINGLE_FT_STAGE_WIRE] != st->bytes[JINGLE_FT_STAGE_RECEIVED])
+      scr_LogPrint(LPRINT_LOGNORM, "    %.1f%% of it on the wire",
+                   st->bytes[JINGLE_FT_STAGE_RECEIVED] ?
+                   100.0 * st->bytes[JINGLE_FT_STAGE_WIRE] /
+                   st->bytes[JINGLE_FT_STAGE_RECEIVED] : 0);
+    g_free(bytes);
+    g_free(worker);
+  }
+
+  bytes = _convert_size(st->bytes[JINGLE_FT_STAGE_HASHED]);
+  worker = _convert_time(st->hash_time);
+  wait = _convert_time(st->hash_wait);
+  scr_LogPrint(LPRINT_LOGNORM, "    hash: %s in %s, waited for it %s%s",
+               bytes, worker, wait, st->bytes[JINGLE_FT_STAGE_VERIFIED] ?
+               ", verified" : "");
+  g_free(bytes);
+  g_free(worker);
+  g_free(wait);
+
+  if (st->rtt_count > 0) {
+    scr_LogPrint(LPRINT_LOGNORM, "    round trips: %" G_GUINT64_FORMAT
+                 ", %s on average, %s at most", st->rtt_count, rtt, rttmax);
+    scr_LogPrint(LPRINT_LOGNORM, "    %s", histo);
+  }
+
+  g_free(avg);
+  g_free(pending);
+  g_free(active);
+  g_free(histo);
+  g_free(rtt);
+  g_free(rttmax);
+}
+
+/**
+ * @brief List the transfers, or show one of them in details
+ */
 static void _jft_info(char **args)
 {
-  GSList *el = info_list;
+  GList *el;
+  JingleFTInfo *only = NULL;
+
+  if (args[1] != NULL && (only = _info_lookup(args)) == NULL)
+    return;
 
-  if (!info_list)
+  if (info_queue.length == 0)
     scr_LogPrint(LPRINT_LOGNORM, "JFT: no file");
 
-  for (el = info_list; el; el = el->next) {
+  for (el = info_queue.head; el; el = el->next) {
     JingleFTInfo *jftio = el->data;
     JingleFT *jft = jftio->jft;
     gchar *strsize = _convert_size(jft->size);
@@ -324,189 +1121,484 @@ static void _jft_info(char **args)
     const gchar *hash = "";
     if (jft->dir == JINGLE_FT_INCOMING &&
         jft->state == JINGLE_FT_ENDING) {
-      if (_check_hash(jft->hash, jft->md5) == FALSE)
+      if (jft->digesting != 0)
+        hash = "checking";
+      else if (jft->corrupt)
         hash = "corrupt";
-      else
+      else if (jft->stats.bytes[JINGLE_FT_STAGE_VERIFIED] > 0 ||
+               jft->copy != NULL)
         hash = "checked";
     }
 
+    if (only != NULL && only != jftio) {
+      g_free(strsize);
+      continue;
+    }
+
     scr_LogPrint(LPRINT_LOGNORM, "[%i]%s %s %s %.2f%%: %s %s %s", jftio->index, 
                  dir, jftio->jft->name, strsize, percent, desc, state, hash);
     g_free(strsize);
+
+    _stats_collect(jft);
+    if (jft->state == JINGLE_FT_STARTING && jft->offset > 0 &&
+        jft->hasher != NULL) {
+      // The hash cannot be saved, the worker hashes that part again
+      guint64 hashed;
+      gint64 usec;
+      jingle_ft_hash_get_stats(jft->hasher, &hashed, &usec);
+      if (hashed < jft->offset) {
+        gchar *done = _convert_size(hashed);
+        gchar *prefix = _convert_size(jft->offset);
+        scr_LogPrint(LPRINT_LOGNORM, "    still hashing the %s transfered"
+                     " before, %s done", prefix, done);
+        g_free(done);
+        g_free(prefix);
+      }
+    }
+    if (jft->state == JINGLE_FT_STARTING) {
+      gchar *rate = _convert_size(jingle_ft_stats_rate(&jft->stats));
+      gint64 eta = jingle_ft_stats_eta(&jft->stats, jft->size - jft->transmit);
+      gchar *streta = (eta < 0) ? g_strdup("unknown") :
+                                  _convert_time(eta * G_USEC_PER_SEC);
+      scr_LogPrint(LPRINT_LOGNORM, "    %s/s, ETA %s", rate, streta);
+      g_free(rate);
+      g_free(streta);
+    }
+    if (only != NULL)
+      _jft_info_details(jft);
+  }
+}
+
+/**
+ * @brief Every counter of the transfers, one line each, for scripts
+ *        reading the log
+ */
+static void _jft_stats(char **args)
+{
+  GList *el;
+  JingleFTInfo *only = NULL;
+
+  if (args[1] != NULL && (only = _info_lookup(args)) == NULL)
+    return;
+
+  for (el = info_queue.head; el; el = el->next) {
+    JingleFTInfo *jftio = el->data;
+    JingleFT *jft = jftio->jft;
+    gchar *dump;
+
+    if (only != NULL && only != jftio)
+      continue;
+
+    _stats_collect(jft);
+    dump = jingle_ft_stats_dump(&jft->stats, strstate);
+    scr_LogPrint(LPRINT_LOGNORM, "JFT-STATS index=%i dir=%s state=%s size=%"
+                 G_GUINT64_FORMAT " offset=%" G_GUINT64_FORMAT " %s",
+                 jftio->index, (jft->dir == JINGLE_FT_INCOMING) ? "in" : "out",
+                 strstate[jft->state], jft->size, jft->offset, dump);
+    g_free(dump);
   }
 }
 
 static void _jft_flush(char **args)
 {
-  GSList *el, *el2 = info_list;
+  GList *el, *next;
   int count = 0;
-  el = info_list;
-  while (el) {
-    JingleFTInfo *jftinf;
-    jftinf = el->data;
-    if (jftinf->jft->state == JINGLE_FT_ERROR ||
-        jftinf->jft->state == JINGLE_FT_REJECT ||
-        jftinf->jft->state == JINGLE_FT_ENDING) {
+
+  for (el = info_queue.head; el; el = next) {
+    next = el->next;
+    if (_is_finished(((JingleFTInfo *)el->data)->jft)) {
       count++;
-      _free(jftinf->jft);
-      info_list = g_slist_delete_link(info_list, el);
-      if (info_list == NULL)
-        break;
-      el = el2;
-      continue;
+      _info_remove(el->data);
     }
-    el2 = el;
-    el = el->next;
   }
   scr_LogPrint(LPRINT_LOGNORM, "JFT: %i file%s removed", count, (count>1) ? "s" : "");
 }
 
 static JingleFT* _new(const gchar *name)
 {
-  struct stat fileinfo;
-  GError *err = NULL;
   gchar *filename = expand_filename(name); // expand ~ to HOME
   JingleFT *jft = g_new0(JingleFT, 1);
   
+  jingle_ft_stats_init(&jft->stats, JINGLE_FT_PENDING);
   jft->desc = g_strdup(name);
   jft->type = JINGLE_FT_OFFER;
   jft->name = g_path_get_basename(filename);
+  jft->path = filename;
   jft->transmit = 0;
+  jft->offset = 0;
   jft->hash = NULL;
-  jft->md5 = NULL;
-  jft->state = JINGLE_FT_PENDING;
+  jft->hashtype = G_CHECKSUM_MD5;
+  jft->hasher = NULL;
+  _set_state(jft, JINGLE_FT_PENDING);
   jft->dir = JINGLE_FT_OUTGOING;
   jft->date = 0;
   jft->size = 0;
   
-  // Add the jft to the list
-  JingleFTInfo *jftinf = g_new0(JingleFTInfo, 1);
-  jftinf->index = _next_index();
-  jftinf->jft = jft;
-  info_list = g_slist_append(info_list, jftinf);
+  _info_add(jft);
 
-  if (g_stat(filename, &fileinfo) != 0) {
-    scr_LogPrint(LPRINT_LOGNORM, "Jingle File Transfer: unable to stat %s",
-                 filename);
-    jft->state = JINGLE_FT_ERROR;
+  if (!_stat(jft))
     return NULL;
+  return jft;
+}
+
+/**
+ * @brief Find the size and date of the file we send
+ */
+static gboolean _stat(JingleFT *jft)
+{
+  struct stat fileinfo;
+
+  if (g_stat(jft->path, &fileinfo) != 0) {
+    scr_LogPrint(LPRINT_LOGNORM, "Jingle File Transfer: unable to stat %s",
+                 jft->path);
+    _set_state(jft, JINGLE_FT_ERROR);
+    return FALSE;
   }
 
   if (!S_ISREG(fileinfo.st_mode) || S_ISLNK(fileinfo.st_mode)) {
     scr_LogPrint(LPRINT_LOGNORM, "Jingle File Transfer: File doesn't exist!");
-    jft->state = JINGLE_FT_ERROR;
-    return NULL;
+    _set_state(jft, JINGLE_FT_ERROR);
+    return FALSE;
   }
 
   jft->date = fileinfo.st_mtime;
   jft->size = fileinfo.st_size;
+  // Offered as sparse if the receiver takes it, the holes are found
+  // once the file is sent
+  jft->sparse = jingle_ft_sparse_maybe(&fileinfo);
+  return TRUE;
+}
+
+/**
+ * @brief Open the file we send, once its turn comes
+ */
+static gboolean _open(JingleFT *jft)
+{
+  GError *err = NULL;
+
+  // Found again now, the file may have changed since it was offered
+  if (jft->sparse) {
+    jft->holes = jingle_ft_sparse_holes(jft->path, jft->size);
+    jft->hole = 0;
+  }
+
+  // Transports read a mapped file in place. What cannot be mapped
+  // is read through a GIOChannel.
+  jft->mapped = g_mapped_file_new(jft->path, FALSE, NULL);
+  if (jft->mapped != NULL)
+    return TRUE;
   
-  jft->outfile = g_io_channel_new_file(filename, "r", &err);
+  jft->outfile = g_io_channel_new_file(jft->path, "r", &err);
   if (jft->outfile == NULL || err != NULL) {
     scr_LogPrint(LPRINT_LOGNORM, "Jingle File Transfer: %s %s", err->message,
-                 name);
+                 jft->path);
     g_error_free(err);
-    jft->state = JINGLE_FT_ERROR;
-    return NULL;
+    _set_state(jft, JINGLE_FT_ERROR);
+    return FALSE;
   }
 
   g_io_channel_set_encoding(jft->outfile, NULL, &err);
-  if (jft->outfile == NULL || err != NULL) {
+  if (err != NULL) {
     scr_LogPrint(LPRINT_LOGNORM, "Jingle File Transfer: %s %s", err->message,
-                 name);
+                 jft->path);
     g_error_free(err);
-    jft->state = JINGLE_FT_ERROR;
-    return NULL;
+    g_io_channel_unref(jft->outfile);
+    jft->outfile = NULL;
+    _set_state(jft, JINGLE_FT_ERROR);
+    return FALSE;
   }
   
-  return jft;
+  return TRUE;
 }
 
-static void _jft_send(char **args, JingleFT *jft2)
+/**
+ * @brief Add the regular files of a directory, by name, to files
+ *
+ * Subdirectories are not sent, the receiver puts every file in
+ * jingle_ft_dir. Files named like one sent with them are not offered.
+ */
+static GSList *_add_dir(GSList *files, const gchar *path)
 {
-  JingleFT *jft = jft2;
+  GError *err = NULL;
+  GDir *dir = g_dir_open(path, 0, &err);
+  GSList *names = NULL, *el;
+  const gchar *entry;
+  JingleFT *jft;
 
-  if (jft == NULL && !args[1]) {
-    scr_LogPrint(LPRINT_LOGNORM, "Jingle File Transfer: give me a name!");
-    return;
+  if (dir == NULL) {
+    scr_LogPrint(LPRINT_LOGNORM, "Jingle File Transfer: %s", err->message);
+    g_error_free(err);
+    return files;
   }
 
-  scr_LogPrint(LPRINT_LOGNORM, "Jingle File Transfer: Trying to send %s",
-               args[1]);
+  while ((entry = g_dir_read_name(dir)) != NULL) {
+    gchar *filename = g_build_filename(path, entry, NULL);
+    if (g_file_test(filename, G_FILE_TEST_IS_REGULAR))
+      names = g_slist_prepend(names, filename);
+    else
+      g_free(filename);
+  }
+  g_dir_close(dir);
+  names = g_slist_sort(names, (GCompareFunc)g_strcmp0);
 
-  if (jft == NULL && (jft = _new(args[1])) == NULL)
-    return;
-  
-  {
-    gchar *ressource, *recipientjid;
-    const gchar *namespaces[] = {NS_JINGLE, NS_JINGLE_APP_FT, NULL};
+  if (names == NULL)
+    scr_LogPrint(LPRINT_LOGNORM, "Jingle File Transfer: no file in %s", path);
 
-    if (CURRENT_JID == NULL) { // CURRENT_JID = the jid of the user which has focus
-      scr_LogPrint(LPRINT_LOGNORM, "Jingle File Transfer: Please, choose a valid JID in the roster");
-      jft->state = JINGLE_FT_ERROR;
-      return;
-    }
-    ressource = jingle_find_compatible_res(CURRENT_JID, namespaces);
-    if (ressource == NULL) {
-      scr_LogPrint(LPRINT_LOGNORM, "Jingle File Transfer: Cannot send file, because this buddy"
-                                   " has no compatible ressource available");
+  for (el = names; el; el = el->next) {
+    if ((jft = _new(el->data)) != NULL)
+      files = g_slist_append(files, jft);
+    g_free(el->data);
+  }
+  g_slist_free(names);
+  return files;
+}
 
-      jft->state = JINGLE_FT_ERROR;
-      return;
-    }
+/**
+ * @brief Whether a resource advertises a feature
+ */
+static gboolean _has_feature(const gchar *jid, const gchar *res,
+                             const gchar *ns)
+{
+  GList *usr = buddy_search_jid(jid);
 
-    recipientjid = g_strdup_printf("%s/%s", CURRENT_JID, ressource);
+  return usr != NULL &&
+         caps_has_feature(buddy_resource_getcaps(usr->data, res),
+                          (gchar *)ns, NULL);
+}
 
-    new_session_with_apps(recipientjid, (const gchar*[]){"file", NULL},
-                          (gconstpointer[]){jft, NULL},
-                          (const gchar*[]){NS_JINGLE_APP_FT, NULL});
+/**
+ * @brief Offer files to the buddy which has the focus
+ *
+ * The files go in as few sessions as possible, one content each, so
+ * that the buddy accepts them all at once.
+ */
+static void _offer(GSList *files)
+{
+  gchar *ressource, *recipientjid;
+  const gchar *namespaces[] = {NS_JINGLE, NS_JINGLE_APP_FT,
+                               NS_JINGLE_APP_FT_COMPRESS, NULL};
+  GSList *el = files;
+  gint level = jingle_ft_compress_level();
+  gboolean delta, sparse;
+  GChecksumType hashtype;
+
+  if (CURRENT_JID == NULL) { // CURRENT_JID = the jid of the user which has focus
+    scr_LogPrint(LPRINT_LOGNORM, "Jingle File Transfer: Please, choose a valid JID in the roster");
+    for (; el; el = el->next)
+      _set_state(el->data, JINGLE_FT_ERROR);
+    return;
+  }
+  // A resource taking deflated data is prefered
+  ressource = (level > 0) ? jingle_find_compatible_res(CURRENT_JID, namespaces)
+                          : NULL;
+  if (ressource == NULL) {
+    level = 0;
+    namespaces[2] = NULL;
+    ressource = jingle_find_compatible_res(CURRENT_JID, namespaces);
+  }
+  if (ressource == NULL) {
+    scr_LogPrint(LPRINT_LOGNORM, "Jingle File Transfer: Cannot send file, because this buddy"
+                                 " has no compatible ressource available");
 
-    jingle_handle_app("file", NS_JINGLE_APP_FT, jft, recipientjid);
+    for (; el; el = el->next)
+      _set_state(el->data, JINGLE_FT_ERROR);
+    return;
+  }
+
+  recipientjid = g_strdup_printf("%s/%s", CURRENT_JID, ressource);
+  delta = jingle_ft_delta_enabled() &&
+          _has_feature(CURRENT_JID, ressource, NS_JINGLE_APP_FT_DELTA);
+  sparse = jingle_ft_sparse_enabled() &&
+           _has_feature(CURRENT_JID, ressource, NS_JINGLE_APP_FT_SPARSE);
+  hashtype = _hash_type(CURRENT_JID, ressource);
+
+  while (el != NULL) {
+    guint count = MIN(g_slist_length(el), JINGLE_FT_SESSION_FILES), i;
+    gchar **names = g_new0(gchar *, count + 1);
+    gconstpointer *datas = g_new0(gconstpointer, count + 1);
+    const gchar **ns = g_new0(const gchar *, count + 1);
+
+    for (i = 0; i < count; i++, el = el->next) {
+      JingleFT *jft = (JingleFT *)el->data;
+      names[i] = (count == 1) ? g_strdup("file")
+                              : g_strdup_printf("file-%u", i + 1);
+      // Offered with the file if we know it, then not computed again
+      jft->hashtype = hashtype;
+      g_free(jft->hash);
+      jft->hash = jingle_ft_dedup_get(jft->path, jft->hashtype);
+      jft->compress = level > 0;
+      jft->delta = delta && jft->size >= JINGLE_FT_DELTA_BLOCK;
+      jft->sparse = sparse && jft->sparse;
+      datas[i] = el->data;
+      ns[i] = NS_JINGLE_APP_FT;
+    }
+
+    session_initiate(new_session_with_apps(recipientjid,
+                                           (const gchar **)names, datas, ns));
+    g_strfreev(names);
+    g_free(datas);
+    g_free(ns);
+  }
     
-    g_free(recipientjid);
-    g_free(ressource);
+  g_free(recipientjid);
+  g_free(ressource);
+}
+
+/**
+ * @brief Drop from files those named like one before them
+ *
+ * Only the name of a file is offered, and the receiver puts them all
+ * in jingle_ft_dir: the second one would overwrite the first, or be
+ * taken for the rest of it.
+ */
+static GSList *_drop_duplicates(GSList *files)
+{
+  GHashTable *seen = g_hash_table_new(g_str_hash, g_str_equal);
+  GSList *el, *next;
+
+  for (el = files; el; el = next) {
+    JingleFT *jft = (JingleFT *)el->data;
+    next = el->next;
+    if (g_hash_table_lookup(seen, jft->name) == NULL) {
+      g_hash_table_insert(seen, jft->name, jft);
+      continue;
+    }
+    scr_LogPrint(LPRINT_LOGNORM, "Jingle File Transfer: %s not sent, another"
+                 " file is named %s", jft->path, jft->name);
+    _set_state(jft, JINGLE_FT_ERROR);
+    files = g_slist_delete_link(files, el);
   }
+  g_hash_table_destroy(seen);
+  return files;
 }
 
-static void _jft_retry(char **args)
+static void _jft_send(char **args, JingleFT *jft2)
 {
-  GSList *el;
+  GSList *files = NULL;
   JingleFT *jft;
-  JingleFTInfo *jftinf;
-  gint index = g_ascii_strtoll(args[1], NULL, 10);
-  for (el = info_list; el; el = el->next) {
-    jftinf = el->data;
-    if (jftinf->index == index);
-      break;
+  gchar *filename;
+  int i;
+
+  if (jft2 == NULL && !args[1]) {
+    scr_LogPrint(LPRINT_LOGNORM, "Jingle File Transfer: give me a name!");
+    return;
   }
-  
-  if (!args[1]) {
-    scr_LogPrint(LPRINT_LOGNORM, "Jingle File Transfer: give me a number!");
-    return;  
+
+  if (jft2 != NULL) {
+    scr_LogPrint(LPRINT_LOGNORM, "Jingle File Transfer: Trying to send %s",
+                 jft2->name);
+    files = g_slist_append(files, jft2);
   }
-  
 
-  
-  if (el == NULL) {
-    scr_LogPrint(LPRINT_LOGNORM, "Jingle File Transfer: give me a correct number!");
-    return;  
+  // Every file named and every file in the directories named
+  for (i = 1; jft2 == NULL && args[i]; i++) {
+    scr_LogPrint(LPRINT_LOGNORM, "Jingle File Transfer: Trying to send %s",
+                 args[i]);
+    filename = expand_filename(args[i]); // expand ~ to HOME
+    if (g_file_test(filename, G_FILE_TEST_IS_DIR))
+      files = _add_dir(files, filename);
+    else if ((jft = _new(args[i])) != NULL)
+      files = g_slist_append(files, jft);
+    g_free(filename);
   }
+
+  files = _drop_duplicates(files);
+  if (files != NULL)
+    _offer(files);
+  g_slist_free(files);
+}
+
+static void _jft_retry(char **args)
+{
+  JingleFT *jft;
+  JingleFTInfo *jftinf = _info_lookup(args);
+
+  if (jftinf == NULL)
+    return;
   
   jft = jftinf->jft;
+  if (jft->dir != JINGLE_FT_OUTGOING) {
+    scr_LogPrint(LPRINT_LOGNORM, "Jingle File Transfer: only the sender can"
+                 " retry, we will resume %s if it does", jft->name);
+    return;
+  }
+  if (jft->state == JINGLE_FT_PENDING || jft->state == JINGLE_FT_STARTING ||
+      sessioncontent_find_by_app(jft) != NULL) {
+    scr_LogPrint(LPRINT_LOGNORM, "Jingle File Transfer: %s is still being"
+                 " sent", jft->name);
+    return;
+  }
+
+  // Start over with the file as it is now, the receiver tells us
+  // with a range what it already has
+  jingle_ft_prefetch_free(jft->prefetch);
+  jft->prefetch = NULL;
+  if (jft->mapped != NULL)
+    g_mapped_file_unref(jft->mapped);
+  jft->mapped = NULL;
+  if (jft->outfile != NULL)
+    g_io_channel_unref(jft->outfile);
+  jft->outfile = NULL;
+  jingle_ft_hash_free(jft->hasher);
+  jft->hasher = NULL;
+  jft->digesting = 0;
+  jingle_ft_compress_free(jft->zlib);
+  jft->zlib = NULL;
+  jingle_ft_delta_free(jft->rsync);
+  jft->rsync = NULL;
+  if (jft->holes != NULL)
+    g_array_free(jft->holes, TRUE);
+  jft->holes = NULL;
+  jft->sparse = FALSE;
+  g_free(jft->hash);
   jft->hash = NULL;
-  jft->size = 0;
   jft->transmit = 0;
-  jft->outfile = NULL;
-  jft->state = JINGLE_FT_PENDING;
-  jft->desc = NULL;
-  jft->md5 = NULL;
+  jft->offset = 0;
+  jft->queued = FALSE;
+  _set_state(jft, JINGLE_FT_PENDING);
+  jingle_ft_stats_init(&jft->stats, JINGLE_FT_PENDING);
+
+  if (!_stat(jft))
+    return;
   
   _jft_send(args, jft);
 }
 
+/**
+ * @brief Terminate the session of a transfer
+ *
+ * Jingle cannot remove a single content here, so the other files of
+ * the session are cancelled too.
+ */
+static void _jft_cancel(char **args)
+{
+  JingleFTInfo *jftinf = _info_lookup(args);
+  SessionContent *sc;
+  guint others;
+
+  if (jftinf == NULL)
+    return;
+
+  sc = sessioncontent_find_by_app(jftinf->jft);
+  if (sc == NULL) {
+    scr_LogPrint(LPRINT_LOGNORM, "Jingle File Transfer: %s is not in"
+                 " progress", jftinf->jft->name);
+    return;
+  }
+
+  others = g_slist_length(sc->session->content) - 1;
+  scr_LogPrint(LPRINT_LOGNORM, "Jingle File Transfer: cancelling %s", 
+               jftinf->jft->name);
+  if (others > 0)
+    scr_LogPrint(LPRINT_LOGNORM, "Jingle File Transfer: and the %u other"
+                 " file%s of its session", others, (others>1) ? "s" : "");
+
+  session_terminate(sc->session, "cancel");
+}
+
 static void do_sendfile(char *arg)
 {
-  char **args = split_arg(arg, 3, 0);
+  char **args = split_arg(arg, JINGLE_FT_ARGS, 0);
 
   if (!g_strcmp0(args[0], "send"))
     _jft_send(args, NULL);
@@ -516,6 +1608,10 @@ static void do_sendfile(char *arg)
     _jft_flush(args);
   else if (!g_strcmp0(args[0], "retry"))
     _jft_retry(args);
+  else if (!g_strcmp0(args[0], "cancel"))
+    _jft_cancel(args);
+  else if (!g_strcmp0(args[0], "stats"))
+    _jft_stats(args);
   else
     scr_LogPrint(LPRINT_LOGNORM, "/jft: %s is not a correct option.", args[0]);
 
@@ -524,13 +1620,24 @@ static void do_sendfile(char *arg)
 
 static void _free(JingleFT *jft)
 {
+  _flush_stop(jft);
   g_free(jft->hash);
   g_free(jft->name);
+  g_free(jft->path);
+  g_free(jft->tmpname);
+  g_free(jft->copy);
+  jingle_ft_dedup_search_free(jft->search);
   g_free(jft->desc);
   if (jft->outfile != NULL)
     g_io_channel_unref(jft->outfile);
-  if (jft->dir == JINGLE_FT_INCOMING)
-    g_checksum_free(jft->md5);
+  jingle_ft_prefetch_free(jft->prefetch);
+  if (jft->mapped != NULL)
+    g_mapped_file_unref(jft->mapped);
+  jingle_ft_hash_free(jft->hasher);
+  jingle_ft_compress_free(jft->zlib);
+  jingle_ft_delta_free(jft->rsync);
+  if (jft->holes != NULL)
+    g_array_free(jft->holes, TRUE);
   g_free(jft);
 }
 
@@ -560,8 +1667,23 @@ static void tomessage(gconstpointer data, LmMessageNode *node)
                                  NULL);
   g_free(size);
   
-  if (jft->hash != NULL)
-    lm_message_node_set_attribute(node2, "hash", jft->hash);
+  // Tell which hash we will send once the file is read, or give
+  // it if we already know it
+  if (jft->hash != NULL) {
+    gchar *b64 = jingle_ft_hash_hex_to_base64(jft->hash);
+    LmMessageNode *hash = lm_message_node_add_child(node2, "hash", b64);
+    lm_message_node_set_attributes(hash, "xmlns", NS_HASHES,
+                                   "algo", jingle_ft_hash_type_to_name(jft->hashtype),
+                                   NULL);
+    g_free(b64);
+    if (jft->hashtype == G_CHECKSUM_MD5)
+      lm_message_node_set_attribute(node2, "hash", jft->hash);
+  } else if (jft->dir == JINGLE_FT_OUTGOING) {
+    LmMessageNode *used = lm_message_node_add_child(node2, "hash-used", NULL);
+    lm_message_node_set_attributes(used, "xmlns", NS_HASHES,
+                                   "algo", jingle_ft_hash_type_to_name(jft->hashtype),
+                                   NULL);
+  }
 
   if (jft->date)
     if (!to_iso8601(date, jft->date))
@@ -570,10 +1692,99 @@ static void tomessage(gconstpointer data, LmMessageNode *node)
   if (jft->desc != NULL)
     lm_message_node_add_child(node2, "desc", jft->desc);
 
+  // Offer to deflate the data, or take the offer
+  if (jft->compress) {
+    LmMessageNode *compress = lm_message_node_add_child(node2, "compress",
+                                                        NULL);
+    lm_message_node_set_attributes(compress,
+                                   "xmlns", NS_JINGLE_APP_FT_COMPRESS,
+                                   "algo", JINGLE_FT_COMPRESS_ALGO,
+                                   NULL);
+  }
+
+  // Offer to send the holes as such, or take the offer
+  if (jft->sparse) {
+    LmMessageNode *sparse = lm_message_node_add_child(node2, "sparse", NULL);
+    lm_message_node_set_attribute(sparse, "xmlns", NS_JINGLE_APP_FT_SPARSE);
+  }
+
+  // Offer to send only what changed, or give the signature of the
+  // version we have to agree
+  if (jft->dir == JINGLE_FT_OUTGOING && jft->delta) {
+    LmMessageNode *delta = lm_message_node_add_child(node2, "delta", NULL);
+    lm_message_node_set_attribute(delta, "xmlns", NS_JINGLE_APP_FT_DELTA);
+  } else if (jft->dir == JINGLE_FT_INCOMING && jft->delta) {
+    _add_signature(jft, node, node2);
+  }
+
+  // Ask the sender for what we miss only (XEP-0234 range)
+  if (jft->dir == JINGLE_FT_INCOMING && jft->offset > 0) {
+    gchar *offset = g_strdup_printf("%" G_GUINT64_FORMAT, jft->offset);
+    LmMessageNode *range = lm_message_node_add_child(node2, "range", NULL);
+    lm_message_node_set_attribute(range, "offset", offset);
+    g_free(offset);
+  }
+
   //if (jft->data != 0)
 }
 
-static void send_hash(const gchar *sid, const gchar *to, const gchar *hash)
+/**
+ * @brief Give the sender the signature of the version of the file we
+ *        have, computed by _sign
+ */
+static void _add_signature(JingleFT *jft, LmMessageNode *content,
+                           LmMessageNode *file)
+{
+  LmMessageNode *delta;
+  const gchar *signature;
+  gchar *block;
+  guint size;
+
+  signature = jft->rsync != NULL ?
+              jingle_ft_delta_get_signature(jft->rsync, &size) : NULL;
+
+  // The old version could not be read, or the other files of the
+  // session-accept took all the room: the data is then sent as is
+  if (signature == NULL || _signatures_size(content) + strlen(signature) >
+                           JINGLE_FT_DELTA_ACCEPT_MAX) {
+    jingle_ft_delta_free(jft->rsync);
+    jft->rsync = NULL;
+    jft->delta = FALSE;
+    return;
+  }
+
+  block = g_strdup_printf("%u", size);
+  delta = lm_message_node_add_child(file, "delta", signature);
+  lm_message_node_set_attributes(delta, "xmlns", NS_JINGLE_APP_FT_DELTA,
+                                 "block", block, NULL);
+  g_free(block);
+}
+
+/**
+ * @brief Bytes of the signatures the other contents of the message give
+ */
+static gsize _signatures_size(LmMessageNode *content)
+{
+  LmMessageNode *other, *delta;
+  const gchar *signature;
+  gsize size = 0;
+
+  if (content->parent == NULL)
+    return 0;
+
+  for (other = content->parent->children; other; other = other->next) {
+    if (other == content ||
+        (delta = _find_ext(other, "delta", NS_JINGLE_APP_FT_DELTA)) == NULL)
+      continue;
+    signature = lm_message_node_get_value(delta);
+    if (signature != NULL)
+      size += strlen(signature);
+  }
+  return size;
+}
+
+static void send_hash(const gchar *sid, const gchar *to, const gchar *name,
+                      GChecksumType type, const gchar *hash)
 {
   JingleAckHandle *ackhandle;
   GError *err = NULL;
@@ -590,9 +1801,12 @@ static void send_hash(const gchar *sid, const gchar *to, const gchar *hash)
                                  NULL);
   lm_message_node_add_child(node, "hash", hash);
   node = lm_message_node_get_child(node, "hash");
-  lm_message_node_set_attribute(node, "xmlns", NS_JINGLE_APP_FT_INFO);
+  lm_message_node_set_attributes(node, "xmlns", NS_JINGLE_APP_FT_INFO,
+                                 "name", name,
+                                 "algo", jingle_ft_hash_type_to_name(type),
+                                 NULL);
   
-  ackhandle = g_new0(JingleAckHandle, 1);
+  ackhandle = jingle_ack_handle_new();
   ackhandle->callback = NULL;
   ackhandle->user_data = NULL;
   
@@ -612,10 +1826,9 @@ static void send_hash(const gchar *sid, const gchar *to, const gchar *hash)
 static void send(session_content *sc)
 {
   JingleFT *jft;
-  gchar buf[JINGLE_FT_SIZE_READ];
-  gsize read;
+  const gchar *data;
+  gsize read, want = 0;
   GIOStatus status;
-  int count = 0;
   GError *err = NULL;
 
   JingleSession *sess = session_find_by_sid(sc->sid, sc->from);
@@ -632,52 +1845,318 @@ static void send(session_content *sc)
   if (jft->dir != JINGLE_FT_OUTGOING)
     return;
 
-  do {
-    count++;
-    status = g_io_channel_read_chars(jft->outfile, (gchar*)buf,
-                                     JINGLE_FT_SIZE_READ, &read, &err);
-  } while (status == G_IO_STATUS_AGAIN && count < 10);
+  // The transport asks for more, what we gave it before went through
+  jingle_ft_stats_acked(&jft->stats);
 
-  if (status == G_IO_STATUS_AGAIN) {
-    // TODO: something better
-    scr_LogPrint(LPRINT_LOGNORM, "Jingle File Transfer: file unavailable");
+  // The worker is far behind, let the transport wait rather than the
+  // main loop. _hash_caught_up calls us again.
+  if (jft->hasher != NULL && jingle_ft_hash_is_behind(jft->hasher)) {
+    jingle_ft_hash_when_caught_up(jft->hasher, _hash_caught_up, jft);
     return;
   }
 
+  // Read what the transport is ready to send in one go
+  if (sc2->transfuncs->window != NULL)
+    want = MIN(sc2->transfuncs->window(sc2->transport),
+               JINGLE_FT_SIZE_READ_MAX);
+  if (want == 0)
+    want = JINGLE_FT_SIZE_READ;
+
+  // Workers read the file, the main loop never waits for the disk.
+  // A mapped file is handed to the transport in place.
+  if (jft->prefetch == NULL) {
+    if (jft->mapped != NULL)
+      jft->prefetch = jingle_ft_prefetch_new_mapped(jft->mapped, jft->offset,
+                                                    _prefetch_ready, jft);
+    else
+      jft->prefetch = jingle_ft_prefetch_new_channel(jft->outfile, jft->offset,
+                                                     _prefetch_ready, jft);
+  }
+
+  status = jingle_ft_prefetch_peek(jft->prefetch, want, &data, &read, &err);
+
+  // _prefetch_ready calls us again once the data is there
+  jingle_ft_stats_read_wait(&jft->stats, status == G_IO_STATUS_AGAIN);
+  if (status == G_IO_STATUS_AGAIN)
+    return;
+
   if (status == G_IO_STATUS_ERROR || err != NULL) {
-    jft->state = JINGLE_FT_ERROR;
+    _set_state(jft, JINGLE_FT_ERROR);
     scr_LogPrint(LPRINT_LOGNORM, "Jingle File Transfer: %s", err->message);
     g_error_free(err);
     return;
   }
   
   if (status == G_IO_STATUS_NORMAL) {
+    JingleFTPrefetch *prefetch = jft->prefetch;
+    GByteArray *diff = NULL;
+    gboolean hole = FALSE;
+
+    // Only what the older version of the receiver lacks. The encoder
+    // may take up to a block more, from the mapping. A hole is skipped
+    // at once in a mapping, a channel reads its zeros.
+    if (jft->delta || jft->sparse) {
+      guint64 end;
+      diff = g_byte_array_new();
+      hole = _in_hole(jft, jft->transmit, &end);
+      if (hole && jft->mapped != NULL)
+        read = end - jft->transmit;
+      else
+        read = MIN(read, end - jft->transmit);
+      if (hole)
+        jingle_ft_delta_hole(diff, read);
+      else if (jft->rsync != NULL && jft->mapped != NULL)
+        read = jingle_ft_delta_encode(jft->rsync,
+                                      g_mapped_file_get_contents(jft->mapped),
+                                      jft->size, jft->transmit, read, diff);
+      else
+        jingle_ft_delta_literal(diff, data, read);
+    }
     jft->transmit += read;
-    g_checksum_update(jft->md5, (guchar*)buf, read);
+    // A mapping outlives the prefetcher as long as we hold it,
+    // the slices of a channel do not
+    if (jft->hasher != NULL && hole)
+      jingle_ft_hash_update_zeros(jft->hasher, read);
+    else if (jft->hasher != NULL && jft->mapped != NULL)
+      jingle_ft_hash_update_full(jft->hasher, data, read,
+                                 g_mapped_file_ref(jft->mapped),
+                                 (GDestroyNotify)g_mapped_file_unref);
+    else if (jft->hasher != NULL)
+      jingle_ft_hash_update(jft->hasher, data, read);
+    // data stays valid until released, even if the transport
+    // asks for more data meanwhile
+    jingle_ft_prefetch_consume(prefetch, read);
+    // The transport may ask for more before handle_app_data returns
+    jingle_ft_stats_sent(&jft->stats, read);
+    if (diff != NULL) {
+      data = (const gchar *)diff->data;
+      read = diff->len;
+    }
+    if (jft->compress) {
+      gchar *packed;
+      gsize packedlen;
+      if (!_deflate(jft, data, read, FALSE, &packed, &packedlen)) {
+        jingle_ft_prefetch_release(prefetch);
+        if (diff != NULL)
+          g_byte_array_free(diff, TRUE);
+        return;
+      }
+      jingle_ft_prefetch_release(prefetch);
+      if (diff != NULL)
+        g_byte_array_free(diff, TRUE);
+      jingle_ft_stats_progress(&jft->stats, JINGLE_FT_STAGE_WIRE, packedlen);
+      // Call a handle in jingle who will call the trans
+      handle_app_data(sc->sid, sc->from, sc->name, packed, packedlen);
+      g_free(packed);
+      return;
+    }
+    jingle_ft_stats_progress(&jft->stats, JINGLE_FT_STAGE_WIRE, read);
     // Call a handle in jingle who will call the trans
-    handle_app_data(sc->sid, sc->from, sc->name, buf, read);
+    handle_app_data(sc->sid, sc->from, sc->name, data, read);
+    jingle_ft_prefetch_release(prefetch);
+    if (diff != NULL)
+      g_byte_array_free(diff, TRUE);
   }
   
+  if (status == G_IO_STATUS_EOF && jft->compress) {
+    // The end of the deflate stream is sent like a chunk, the transport
+    // asks for more once it is through and gets the end of the data
+    gchar *packed;
+    gsize packedlen;
+    if (!_deflate(jft, NULL, 0, TRUE, &packed, &packedlen))
+      return;
+    jingle_ft_compress_free(jft->zlib);
+    jft->zlib = NULL;
+    jft->compress = FALSE;
+    jingle_ft_stats_progress(&jft->stats, JINGLE_FT_STAGE_WIRE, packedlen);
+    handle_app_data(sc->sid, sc->from, sc->name, packed, packedlen);
+    g_free(packed);
+    return;
+  }
+
   if (status == G_IO_STATUS_EOF) {
     handle_app_data(sc->sid, sc->from, sc->name, NULL, 0);
     scr_LogPrint(LPRINT_LOGNORM, "Jingle File Transfer: transfer finish (%s)",
                  jft->name);
-    jft->hash = g_strdup(g_checksum_get_string(jft->md5));
-    jft->state = JINGLE_FT_ENDING;
+    jingle_ft_stats_finish(&jft->stats);
+    _set_state(jft, JINGLE_FT_ENDING);
     // Call a function to say state is ended
     session_changestate_sessioncontent(sess, sc2->name, 
                                        JINGLE_SESSION_STATE_ENDED);
-    // Send the hash
-    send_hash(sess->sid, sess->to, jft->hash);
-    g_checksum_free(jft->md5);
-    
-    if (!session_remove_sessioncontent(sess, sc2->name)) {
-      jingle_send_session_terminate(sess, "success");
-      session_delete(sess);
+    jingle_ft_prefetch_free(jft->prefetch);
+    jft->prefetch = NULL;
+    if (jft->mapped != NULL) {
+      g_mapped_file_unref(jft->mapped);
+      jft->mapped = NULL;
+    }
+
+    // The worker may still be hashing the last chunks, the hash is
+    // sent and the next file started once it is done. The index may
+    // have given us the hash instead.
+    if (jft->hasher != NULL) {
+      jft->digesting = g_get_monotonic_time();
+      jingle_ft_hash_finish(jft->hasher, _sent_hashed, jft);
+      return;
+    }
+    _stats_collect(jft);
+    send_hash(sess->sid, sess->recipient, sc2->name, jft->hashtype, jft->hash);
+    _next(sess, sc2->name, TRUE);
+  }
+}
+
+/**
+ * @brief The digest of the file we sent is known, give it to the
+ *        receiver before we go on with the session
+ */
+static void _sent_hashed(gpointer data)
+{
+  JingleFT *jft = (JingleFT *)data;
+  SessionContent *sc = sessioncontent_find_by_app(jft);
+  JingleSession *sess;
+
+  jft->hash = g_strdup(jingle_ft_hash_get_string(jft->hasher));
+  jft->stats.hash_wait += g_get_monotonic_time() - jft->digesting;
+  jft->digesting = 0;
+  _stats_collect(jft);
+  jingle_ft_hash_free(jft->hasher);
+  jft->hasher = NULL;
+
+  // The session was terminated meanwhile
+  if (sc == NULL || (sess = session_find_by_sessioncontent(sc)) == NULL)
+    return;
+
+  send_hash(sess->sid, sess->recipient, sc->name, jft->hashtype, jft->hash);
+  _next(sess, sc->name, TRUE);
+}
+
+/**
+ * @brief Whether pos is in a hole of the file we send
+ * @param end Set to where that hole ends, or else to where the next
+ *            one starts
+ */
+static gboolean _in_hole(JingleFT *jft, guint64 pos, guint64 *end)
+{
+  JingleFTHole *h;
+
+  *end = jft->size;
+  if (jft->holes == NULL)
+    return FALSE;
+
+  // The file is sent in order, we are done with the holes behind
+  while (jft->hole < jft->holes->len &&
+         g_array_index(jft->holes, JingleFTHole, jft->hole).end <= pos)
+    jft->hole++;
+  if (jft->hole == jft->holes->len)
+    return FALSE;
+
+  h = &g_array_index(jft->holes, JingleFTHole, jft->hole);
+  *end = MIN(h->start <= pos ? h->end : h->start, jft->size);
+  return h->start <= pos;
+}
+
+/**
+ * @brief Deflate a chunk of the file we send
+ * @return FALSE if it failed, the transfer is then in error
+ */
+static gboolean _deflate(JingleFT *jft, const gchar *data, gsize len,
+                         gboolean last, gchar **packed, gsize *packedlen)
+{
+  GError *err = NULL;
+
+  if (jft->zlib == NULL)
+    jft->zlib = jingle_ft_compress_new(FALSE, jingle_ft_compress_level());
+  if (jft->zlib != NULL &&
+      jingle_ft_compress_data(jft->zlib, data, len, last, packed, packedlen,
+                              &err))
+    return TRUE;
+
+  scr_LogPrint(LPRINT_LOGNORM, "Jingle File Transfer: %s %s",
+               err ? err->message : "cannot compress", jft->name);
+  if (err != NULL)
+    g_error_free(err);
+  _set_state(jft, JINGLE_FT_ERROR);
+  return FALSE;
+}
+
+/**
+ * @brief How many files of a session we are sending right now
+ */
+static guint _active(JingleSession *sess)
+{
+  GSList *el;
+  guint count = 0;
+
+  for (el = sess->content; el; el = el->next) {
+    SessionContent *sc = (SessionContent *)el->data;
+    JingleFT *jft = (JingleFT *)sc->description;
+    if (sc->appfuncs == &funcs && jft->dir == JINGLE_FT_OUTGOING &&
+        jft->state == JINGLE_FT_STARTING)
+      count++;
+  }
+  return count;
+}
+
+static guint _parallel(void)
+{
+  if (settings_opt_get("jingle_ft_parallel") == NULL)
+    return JINGLE_FT_PARALLEL;
+  return MAX(settings_opt_get_int("jingle_ft_parallel"), 1);
+}
+
+/**
+ * @brief We are done with a file of the session: end the session with
+ *        the last one, or else start a file that was waiting
+ * @param sent The file was entirely sent
+ */
+static void _next(JingleSession *sess, const gchar *name, gboolean sent)
+{
+  GSList *el;
+
+  if (!session_remove_sessioncontent(sess, name)) {
+    jingle_send_session_terminate(sess, sent ? "success"
+                                             : "failed-application");
+    session_delete(sess);
+    return;
+  }
+
+  for (el = sess->content; el; el = el->next) {
+    SessionContent *sc = (SessionContent *)el->data;
+    if (sc->appfuncs == &funcs && ((JingleFT *)sc->description)->queued) {
+      // May get here again, and change the session, before returning
+      start(&sc->handle);
+      return;
     }
   }
 }
 
+/**
+ * @brief The prefetcher has data again, go on sending
+ */
+static void _prefetch_ready(gpointer data)
+{
+  SessionContent *sc = sessioncontent_find_by_app(data);
+
+  // The content is gone meanwhile
+  if (sc == NULL)
+    return;
+
+  send(&sc->handle);
+}
+
+/**
+ * @brief The worker hashed most of what we read, go on sending
+ */
+static void _hash_caught_up(gpointer data)
+{
+  SessionContent *sc = sessioncontent_find_by_app(data);
+
+  // The content is gone meanwhile
+  if (sc == NULL)
+    return;
+
+  send(&sc->handle);
+}
+
 static void start(session_content *sc)
 {
   JingleFT *jft;
@@ -691,8 +2170,25 @@ static void start(session_content *sc)
   SessionContent *sc2 = session_find_sessioncontent(sess, sc->name);
 
   jft = (JingleFT*)sc2->description;
-  jft->state = JINGLE_FT_STARTING;
-  jft->md5 = g_checksum_new(G_CHECKSUM_MD5);
+
+  if (jft->dir == JINGLE_FT_OUTGOING) {
+    // The files of a session are sent a few at a time
+    if (_active(sess) >= _parallel()) {
+      jft->queued = TRUE;
+      return;
+    }
+    jft->queued = FALSE;
+
+    if (jft->mapped == NULL && jft->outfile == NULL && !_open(jft)) {
+      _next(sess, sc2->name, FALSE);
+      return;
+    }
+  }
+
+  _set_state(jft, JINGLE_FT_STARTING);
+  // A range may have had the beginning of the file hashed already
+  if (jft->hasher == NULL && jft->hash == NULL)
+    jft->hasher = jingle_ft_hash_new(jft->hashtype);
   
   scr_LogPrint(LPRINT_LOGNORM, "Jingle File Transfer: Transfer start (%s)",
                jft->name);
@@ -700,29 +2196,42 @@ static void start(session_content *sc)
   sc2->appfuncs->send(sc);
 }
 
-static gboolean _check_hash(const gchar *hash1, GChecksum *md5)
-{
-  const gchar *hash2;
-  
-  if (!hash1 || !md5)
-    return FALSE;
-
-  hash2 = g_checksum_get_string(md5);
-  
-  if (g_ascii_strncasecmp(hash1, hash2, 32))
-    return FALSE;
-  
-  return TRUE;
-}
-
 // When we got a session-terminate
 static void stop(gconstpointer data)
 {
   JingleFT *jft = (JingleFT*)data;
   GError *err = NULL;
   GIOStatus status;
+  gboolean written = TRUE;
+  // What we received could not be written: nothing to resume from
+  gboolean failed = (jft->dir == JINGLE_FT_INCOMING &&
+                     jft->state == JINGLE_FT_ERROR && jft->outfile != NULL);
+
+  _flush_stop(jft);
+  jingle_ft_stats_finish(&jft->stats);
+  _stats_collect(jft);
+  jingle_ft_dedup_search_free(jft->search);
+  jft->search = NULL;
+  jingle_ft_prefetch_free(jft->prefetch);
+  jft->prefetch = NULL;
+  jingle_ft_compress_free(jft->zlib);
+  jft->zlib = NULL;
+  jingle_ft_delta_free(jft->rsync);
+  jft->rsync = NULL;
+  if (jft->holes != NULL)
+    g_array_free(jft->holes, TRUE);
+  jft->holes = NULL;
+
+  // Declined or cancelled before any data went through
+  if (jft->state == JINGLE_FT_PENDING) {
+    _set_state(jft, jft->queued ? JINGLE_FT_ERROR : JINGLE_FT_REJECT);
+    jft->queued = FALSE;
+    return;
+  }
 
   if (jft->outfile != NULL) {
+    // Write out what is left before telling the user the file is there
+    written = _flush(jft, _sync_policy() != JINGLE_FT_SYNC_NEVER);
     status = g_io_channel_shutdown(jft->outfile, TRUE, &err);
     if (status != G_IO_STATUS_NORMAL || err != NULL) {
       scr_LogPrint(LPRINT_LOGNORM, "Jingle File Transfer: %s",
@@ -730,9 +2239,24 @@ static void stop(gconstpointer data)
       g_error_free(err);
     }
   }
+
+  if (failed) {
+    _checkpoint_remove(jft);
+    g_unlink(jft->tmpname);
+    scr_LogPrint(LPRINT_LOGNORM, "Jingle File Transfer: %s could not be"
+                 " written, removed %s", jft->name, jft->tmpname);
+    return;
+  }
   
+  if (!written) {
+    _set_state(jft, JINGLE_FT_ERROR);
+    return;
+  }
+
   if (jft->transmit < jft->size) {
-    jft->state = JINGLE_FT_ERROR;
+    // Everything is written out, the next attempt can start here
+    _checkpoint_save(jft);
+    _set_state(jft, JINGLE_FT_ERROR);
     if (jft->dir == JINGLE_FT_INCOMING)
       scr_LogPrint(LPRINT_LOGNORM, "JFT: session have been closed before we"
                    "receive all the file: %s", jft->name);
@@ -742,22 +2266,180 @@ static void stop(gconstpointer data)
     return;
   }
   
-  jft->state = JINGLE_FT_ENDING;
-
-  if (jft->hash != NULL && jft->md5 != NULL) {
-    if (_check_hash(jft->hash, jft->md5) == FALSE) {
-      scr_LogPrint(LPRINT_LOGNORM, "Jingle File Transfer: File corrupt (%s)",
-                   jft->name);
-    } else {
-      scr_LogPrint(LPRINT_LOGNORM, "Jingle File Transfer: Transfer finished (%s)"
-                   " and verified", jft->name);
+  _set_state(jft, JINGLE_FT_ENDING);
+  _checkpoint_remove(jft);
+
+  // Nothing was sent, we already had it
+  if (jft->copy != NULL) {
+    if (!_link_copy(jft)) {
+      _set_state(jft, JINGLE_FT_ERROR);
+      return;
     }
+    scr_LogPrint(LPRINT_LOGNORM, "Jingle File Transfer: %s was already in"
+                 " %s", jft->name, jft->copy);
+    return;
+  }
+
+  // The file we sent was checked by the receiver, if at all
+  if (jft->dir == JINGLE_FT_OUTGOING) {
+    scr_LogPrint(LPRINT_LOGNORM, "Jingle File Transfer: Transfer finished (%s)",
+                 jft->name);
+    return;
+  }
+
+  // The file gets its name once the worker has checked it, /jft info
+  // tells meanwhile that it is being checked
+  if (jft->hash != NULL && jft->hasher != NULL) {
+    jft->digesting = g_get_monotonic_time();
+    jingle_ft_hash_finish(jft->hasher, _received_hashed, jft);
+    return;
+  }
+  _received(jft, FALSE);
+}
+
+/**
+ * @brief The digest of the file we received is known, check it
+ */
+static void _received_hashed(gpointer data)
+{
+  JingleFT *jft = (JingleFT *)data;
+
+  jft->stats.hash_wait += g_get_monotonic_time() - jft->digesting;
+  jft->digesting = 0;
+  _stats_collect(jft);
+  if (g_ascii_strcasecmp(jft->hash, jingle_ft_hash_get_string(jft->hasher))) {
+    jft->corrupt = TRUE;
+    scr_LogPrint(LPRINT_LOGNORM, "Jingle File Transfer: File corrupt (%s),"
+                 " left in %s", jft->name, jft->tmpname);
+    return;
+  }
+  jft->stats.bytes[JINGLE_FT_STAGE_VERIFIED] = jft->size;
+  _received(jft, TRUE);
+}
+
+/**
+ * @brief Give the complete file we received its name
+ */
+static void _received(JingleFT *jft, gboolean verified)
+{
+  if (!_publish(jft)) {
+    _set_state(jft, JINGLE_FT_ERROR);
+    return;
+  }
+
+  // So that it is not received again
+  if (verified)
+    jingle_ft_dedup_add(jft->name, 0, jft->hashtype, jft->hash);
+
+  if (verified) {
+    scr_LogPrint(LPRINT_LOGNORM, "Jingle File Transfer: Transfer finished (%s)"
+                 " and verified", jft->name);
   } else {
     scr_LogPrint(LPRINT_LOGNORM, "Jingle File Transfer: Transfer finished (%s)"
                  " but not verified", jft->name);
   }
 }
 
+/**
+ * @brief Give the file we received its name, now that it is complete
+ *
+ * Until then, other programs never see a partial file under that name.
+ */
+static gboolean _publish(JingleFT *jft)
+{
+  // Nothing was written for an empty file
+  if (jft->size == 0 && !g_file_test(jft->tmpname, G_FILE_TEST_EXISTS))
+    g_file_set_contents(jft->tmpname, "", 0, NULL);
+
+  if (g_rename(jft->tmpname, jft->name) != 0) {
+    scr_LogPrint(LPRINT_LOGNORM, "Jingle File Transfer: cannot rename %s to"
+                 " %s", jft->tmpname, jft->name);
+    return FALSE;
+  }
+  return TRUE;
+}
+
+/**
+ * @brief Name the file we already had like the one offered, a clone or
+ *        a hard link taking no space
+ */
+static gboolean _link_copy(JingleFT *jft)
+{
+  gboolean named;
+
+  // What an earlier attempt received is of no use
+  g_unlink(jft->tmpname);
+  if (!g_strcmp0(jft->copy, jft->name))
+    return TRUE;
+
+  // A clone shares the blocks but not the inode: changing one of the
+  // files does not change the other
+  if (!jingle_ft_dedup_clone(jft->copy, jft->tmpname) &&
+      link(jft->copy, jft->tmpname) != 0) {
+    scr_LogPrint(LPRINT_LOGNORM, "Jingle File Transfer: cannot link %s to"
+                 " %s", jft->copy, jft->tmpname);
+    return FALSE;
+  }
+
+  // Unlike what we received, it does not replace a file of that name
+  named = link(jft->tmpname, jft->name) == 0;
+  if (!named)
+    scr_LogPrint(LPRINT_LOGNORM, "Jingle File Transfer: cannot link %s to"
+                 " %s", jft->tmpname, jft->name);
+  g_unlink(jft->tmpname);
+  return named;
+}
+
+/**
+ * @brief Take path for the file offered, unless it would replace
+ *        another file of that name
+ */
+static void _take_copy(JingleFT *jft, gchar *path)
+{
+  if (path != NULL && g_strcmp0(path, jft->name) &&
+      g_file_test(jft->name, G_FILE_TEST_EXISTS)) {
+    g_free(path);
+    return;
+  }
+  if (path == NULL)
+    return;
+  jft->copy = path;
+  jft->offset = jft->transmit = jft->size;
+}
+
+/**
+ * @brief The files of jingle_ft_dir were hashed, the session-accept
+ *        can tell whether we need the file
+ */
+static void _dedup_found(gpointer data, gchar *path)
+{
+  JingleFT *jft = (JingleFT *)data;
+
+  jft->search = NULL;
+  _take_copy(jft, path);
+  _sign(jft);
+  session_app_ready(jft);
+}
+
+/**
+ * @brief Have the signature of the version we have computed, if we
+ *        have one and nothing else of the file
+ */
+static void _sign(JingleFT *jft)
+{
+  if (jft->delta && jft->rsync == NULL && jft->copy == NULL &&
+      jft->offset == 0)
+    jft->rsync = jingle_ft_delta_new_decoder(jft->name, _signed, jft);
+
+  // The data is then sent as is
+  jft->delta = jft->rsync != NULL;
+}
+
+static void _signed(gpointer data)
+{
+  session_app_ready(data);
+}
+
 static gchar *_convert_size(guint64 size)
 {
   gchar *strsize;
@@ -774,38 +2456,111 @@ static gchar *_convert_size(guint64 size)
   return strsize;
 }
 
+/**
+ * @brief Microseconds as "1.25s", "3:07" or "1:02:07"
+ */
+static gchar *_convert_time(gint64 usec)
+{
+  gint64 sec = usec / G_USEC_PER_SEC;
+
+  if (sec < 60)
+    return g_strdup_printf("%.2fs", usec / (gdouble)G_USEC_PER_SEC);
+  if (sec < 3600)
+    return g_strdup_printf("%" G_GINT64_FORMAT ":%02" G_GINT64_FORMAT,
+                           sec / 60, sec % 60);
+  return g_strdup_printf("%" G_GINT64_FORMAT ":%02" G_GINT64_FORMAT
+                         ":%02" G_GINT64_FORMAT, sec / 3600,
+                         (sec / 60) % 60, sec % 60);
+}
+
 static gchar* info(gconstpointer data)
 {
   JingleFT *jft = (JingleFT *)data;
   gchar *info, *strsize = _convert_size(jft->size);
-  info = g_strdup_printf("JFT: Receive %s (%s)", jft->name, strsize);
+  if (jft->copy != NULL)
+    info = g_strdup_printf("JFT: Receive %s (%s), already in %s", jft->name,
+                           strsize, jft->copy);
+  else
+    info = g_strdup_printf("JFT: Receive %s (%s)", jft->name, strsize);
 
   g_free(strsize);
 
   return info;
 }
 
+/**
+ * @brief Whether the session-accept can say what we need of the file
+ */
+static gboolean ready(gconstpointer data)
+{
+  const JingleFT *jft = (const JingleFT *)data;
+
+  return jft->search == NULL &&
+         (jft->rsync == NULL || !jingle_ft_delta_is_signing(jft->rsync));
+}
+
 static void jingle_ft_init(void)
 {
   jingle_register_app(NS_JINGLE_APP_FT, &funcs, JINGLE_TRANSPORT_STREAMING);
   xmpp_add_feature(NS_JINGLE_APP_FT);
+  xmpp_add_feature(NS_HASHES);
+  xmpp_add_feature(NS_JINGLE_APP_FT_COMPRESS);
+  xmpp_add_feature(NS_JINGLE_APP_FT_DELTA);
+  xmpp_add_feature(NS_JINGLE_APP_FT_SPARSE);
   jft_cid = compl_new_category(0);
   if (jft_cid) {
     compl_add_category_word(jft_cid, "send");
     //compl_add_category_word(jft_cid, "request");
     compl_add_category_word(jft_cid, "info");
     compl_add_category_word(jft_cid, "flush");
+    compl_add_category_word(jft_cid, "retry");
+    compl_add_category_word(jft_cid, "cancel");
+    compl_add_category_word(jft_cid, "stats");
   }
   /* Add command */
   cmd_add("jft", "Manage file transfer", jft_cid, 0, do_sendfile, NULL);
 }
 
+/**
+ * @brief End the sessions still using one of our transfers
+ *
+ * Their contents keep the JingleFT as app data: a reaper tick, an ack
+ * or a session-terminate arriving later would use it once freed.
+ * Terminating them stops the transports and the scheduler and drops
+ * the contents, so nothing refers to the transfers anymore.
+ */
+static void _terminate_all(void)
+{
+  SessionContent *sc;
+  GList *el;
+
+  for (el = info_queue.head; el; el = el->next)
+    while ((sc = sessioncontent_find_by_app(((JingleFTInfo *)el->data)->jft))
+           != NULL)
+      session_terminate(session_find_by_sessioncontent(sc), "cancel");
+}
+
 static void jingle_ft_uninit(void)
 {
-  g_slist_free(info_list);
+  // Nothing may call us back once we are unloaded
+  _terminate_all();
+  while (!g_queue_is_empty(&info_queue))
+    _info_remove(g_queue_peek_head(&info_queue));
+  jingle_ft_prefetch_uninit();
+  jingle_ft_hash_uninit();
+  jingle_ft_delta_uninit();
+  jingle_ft_dedup_uninit();
+
+  if (info_table != NULL)
+    g_hash_table_destroy(info_table);
+  info_table = NULL;
+  xmpp_del_feature(NS_JINGLE_APP_FT_SPARSE);
+  xmpp_del_feature(NS_JINGLE_APP_FT_DELTA);
+  xmpp_del_feature(NS_JINGLE_APP_FT_COMPRESS);
+  xmpp_del_feature(NS_HASHES);
   xmpp_del_feature(NS_JINGLE_APP_FT);
   jingle_unregister_app(NS_JINGLE_APP_FT);
-  cmd_del("file");
+  cmd_del("jft");
   if (jft_cid)
     compl_del_category(jft_cid);
 }
@@ -7,11 +7,51 @@
  * \author Nicolas Cornu
  * \version 0.1
  */
+
+#include "prefetch.h"
+#include "hash.h"
+#include "stats.h"
+#include "compress.h"
+#include "dedup.h"
+#include "delta.h"
+#include "sparse.h"
  
 #define NS_JINGLE_APP_FT      "urn:xmpp:jingle:apps:file-transfer:1"
 #define NS_JINGLE_APP_FT_INFO "urn:xmpp:jingle:apps:file-transfer:info:1"
 #define NS_SI_FT              "http://jabber.org/protocol/si/profile/file-transfer"
-#define JINGLE_FT_SIZE_READ 2048
+/* Bytes read at once when the transport has no preference, and at most */
+#define JINGLE_FT_SIZE_READ     2048
+#define JINGLE_FT_SIZE_READ_MAX 1048576
+
+/* Default size, in KiB, of the write-behind buffer of a received file
+ * (jingle_ft_write_buffer), and the bounds we accept for it */
+#define JINGLE_FT_WRITE_BUFFER     1024
+#define JINGLE_FT_WRITE_BUFFER_MIN 4
+#define JINGLE_FT_WRITE_BUFFER_MAX 65536
+
+/* Seconds between two flushes of a partially filled write buffer */
+#define JINGLE_FT_FLUSH_INTERVAL 2
+
+/* Suffix of the file, next to a file we receive, recording how much
+ * of it we have in case the transfer must be resumed */
+#define JINGLE_FT_CHECKPOINT ".jft"
+
+/* Suffix of the file we receive until it is complete and checked */
+#define JINGLE_FT_PARTIAL ".part"
+
+/* Files offered in a single session at most, which keeps the
+ * session-initiate within the stanza size servers accept */
+#define JINGLE_FT_SESSION_FILES 100
+
+/* Files of a session sent at the same time (jingle_ft_parallel) */
+#define JINGLE_FT_PARALLEL 4
+
+/* Arguments of /jft, a send takes all but the first */
+#define JINGLE_FT_ARGS 33
+
+/* Finished transfers kept for /jft info (jingle_ft_history),
+ * the oldest go first. 0 keeps them all until /jft flush. */
+#define JINGLE_FT_HISTORY 100
 
 /**
  * \enum JingleFTType
@@ -43,6 +83,16 @@ typedef enum {
   JINGLE_FT_ERROR /*!< And error occured during the transfer */
 } JingleFTState;
 
+/**
+ * \enum JingleFTSync
+ * \brief when received data is forced to disk (jingle_ft_sync)
+ */
+typedef enum {
+  JINGLE_FT_SYNC_NEVER, /*!< Leave it to the kernel ("never", the default) */
+  JINGLE_FT_SYNC_END, /*!< fdatasync once the file is complete ("end") */
+  JINGLE_FT_SYNC_FLUSH /*!< fdatasync each time the buffer is written ("flush") */
+} JingleFTSync;
+
 /**
  * \struct JingleFT
  * \brief represent the file transfer himself
@@ -54,15 +104,30 @@ typedef struct {
   time_t date;
 
   /**
-   * MD5 hash of the file, optional 
+   * hash of the file in hexadecimal, optional 
    */
   gchar *hash;
 
+  /**
+   * The algorithm of hash, announced by the sender
+   */
+  GChecksumType hashtype;
+
   /**
    * the name of the file that the sender wishes to send
    */
   gchar *name;
 
+  /**
+   * Where the file we send is on the disk
+   */
+  gchar *path;
+
+  /**
+   * Where we write the file we receive, it gets its name once done
+   */
+  gchar *tmpname;
+
   /**
    * the size, in bytes, of the data to be sent 
    */
@@ -72,11 +137,50 @@ typedef struct {
    * Data already send/receive 
    */
   guint64 transmit;
+
+  /**
+   * Where the transfer starts, if the receiver already has the
+   * beginning of the file
+   */
+  guint64 offset;
+
+  /**
+   * transmit when the checkpoint was last written
+   */
+  guint64 checkpoint;
   
   /**
    * descriptor to the output file
    */
   GIOChannel *outfile;
+
+  /**
+   * The file we send, mapped in memory. outfile is only used
+   * when the file could not be mapped.
+   */
+  GMappedFile *mapped;
+
+  /**
+   * Reads the file we send ahead of the transport
+   */
+  JingleFTPrefetch *prefetch;
+
+  /**
+   * A file we already have with the content offered, we take it
+   * instead of receiving it
+   */
+  gchar *copy;
+
+  /**
+   * Hashes the files of jingle_ft_dir the index does not know, looking
+   * for copy before the session-accept is sent
+   */
+  JingleFTDedupSearch *search;
+
+  /**
+   * Accepted, but waiting for other files of the session to be sent
+   */
+  gboolean queued;
   
   /**
    * Is it an offer or a request ?
@@ -99,9 +203,62 @@ typedef struct {
   gchar *desc;
   
   /**
-   * Where we compute the hash
+   * Where we compute the hash, NULL if we cannot use hashtype
+   */
+  JingleFTHash *hasher;
+
+  /**
+   * When we asked hasher for the digest, 0 once we have it
+   */
+  gint64 digesting;
+
+  /**
+   * The file we received does not match its hash
+   */
+  gboolean corrupt;
+
+  /**
+   * Timer writing out the buffer of outfile when data stops coming
+   */
+  guint flush_source;
+
+  /**
+   * The data is deflated: offered, then agreed on by the session-accept
+   */
+  gboolean compress;
+
+  /**
+   * What (de)compresses the data once the transfer started
+   */
+  JingleFTCompress *zlib;
+
+  /**
+   * Only what changed is sent: offered, then agreed on by a
+   * session-accept giving the signature of the older version
+   */
+  gboolean delta;
+
+  /**
+   * What reads the older version and rebuilds the file from the data
+   * we receive, or encodes the file we send against its signature
+   */
+  JingleFTDelta *rsync;
+
+  /**
+   * Holes are not sent: offered, then agreed on by the session-accept
    */
-  GChecksum *md5;
+  gboolean sparse;
+
+  /**
+   * The holes of the file we send, and the first we are not past
+   */
+  GArray *holes;
+  guint hole;
+
+  /**
+   * Counters and timings, for /jft info and /jft stats
+   */
+  JingleFTStats stats;
   
 } JingleFT;
 
@@ -114,7 +271,7 @@ typedef struct {
  */
 typedef struct {
   /**
-   * An index. Not use now, but will in the futur to cancel a transfer.
+   * An index, to designate the transfer in /jft commands.
    */
   gint index;
   
@@ -122,5 +279,10 @@ typedef struct {
    * The link to the JingleFT in the session.
    */
   JingleFT *jft;
+
+  /**
+   * Its link in the queue of all the transfers, oldest first
+   */
+  GList *link;
 } JingleFTInfo;
 #endif
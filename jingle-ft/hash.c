@@ -0,0 +1,656 @@
+/*
+ * hash.c
+ *
+ * Copyright (C) 2026 mcabber-jingle contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+#include <glib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "hash.h"
+
+/*
+ * The main loop queues the data it reads or receives, a worker feeds
+ * it to the checksum in order. Only one job per file is queued or
+ * running at a time, so different files are hashed in parallel but
+ * the chunks of one file never are.
+ * A chunk may also be a part of a file on disk, which the worker reads
+ * itself, when a transfer is resumed.
+ * The main loop never waits for the digest: once the last chunk is
+ * hashed, the worker has it called back from the main loop. Nor does
+ * it wait for the backlog to shrink: the sender stops reading until
+ * the worker has it resumed from the main loop, the receiver hashes
+ * from the file instead.
+ * A running job holds a reference, the hash is freed by whoever drops
+ * the last one, so freeing never waits for the worker either.
+ */
+
+typedef struct {
+  const gchar *data;
+  gsize len;
+  /* What keeps data valid until it is hashed */
+  gpointer owner;
+  GDestroyNotify destroy;
+  /* Bytes we copied for this chunk, which count in the backlog */
+  gsize held;
+  /* Or the file to read flen bytes from, at start, if fd >= 0, or
+   * flen zeros if there is neither data nor file */
+  gint fd;
+  guint64 start;
+  guint64 flen;
+  /* Which file fd is, so that a part following this one is added to it */
+  dev_t dev;
+  ino_t ino;
+} HashChunk;
+
+struct _JingleFTHash {
+  GMutex lock;
+  GCond cond;
+
+  /* One for the owner, one for the job while it is queued or running */
+  gint ref;
+
+  GChecksumType type;
+  GChecksum *checksum;
+
+  /* Chunks not hashed yet, oldest first, and the memory we hold
+   * for them */
+  GQueue chunks;
+  gsize backlog;
+
+  gboolean busy;
+
+  /* A part of a file could not be read, the digest cannot match */
+  gboolean failed;
+
+  /* Bytes hashed so far, and the time the workers took */
+  guint64 hashed;
+  gint64 time;
+
+  /* Hexadecimal digest, once no more data may come */
+  gchar *digest;
+
+  /* What to call once the queue is empty, and the idle source doing
+   * it. No more data may come once done is set. */
+  JingleFTHashDone done;
+  gpointer done_data;
+  guint idle;
+
+  /* What to call once the backlog is half hashed, and the idle source
+   * doing it */
+  JingleFTHashCaughtUp caughtup;
+  gpointer caughtup_data;
+  guint caughtup_idle;
+
+  /* Set when freed, a worker reading a file gives up */
+  gint cancelled;
+};
+
+/* Names from the XEP-0300 registry, the preferred ones first */
+static const struct {
+  const gchar *name;
+  GChecksumType type;
+} hash_algos[] = {
+  {"sha-256", G_CHECKSUM_SHA256},
+#if GLIB_CHECK_VERSION(2, 36, 0)
+  {"sha-512", G_CHECKSUM_SHA512},
+#endif
+  {"sha-1",   G_CHECKSUM_SHA1},
+  {"md5",     G_CHECKSUM_MD5},
+  {NULL, 0}
+};
+
+static GThreadPool *pool = NULL;
+
+static void hash_job(gpointer data, gpointer user_data);
+static void hash_push(JingleFTHash *h, HashChunk *chunk);
+static gboolean hash_notify(gpointer data);
+static gboolean hash_caughtup(gpointer data);
+static void hash_destroy(JingleFTHash *h);
+
+
+/**
+ * @brief Find the checksum type of a XEP-0300 algorithm name
+ * @return FALSE if we do not support it
+ */
+gboolean jingle_ft_hash_type_from_name(const gchar *name,
+                                       GChecksumType *type)
+{
+  int i;
+
+  if (name == NULL)
+    return FALSE;
+
+  for (i = 0; hash_algos[i].name != NULL; i++) {
+    if (!g_ascii_strcasecmp(name, hash_algos[i].name)) {
+      *type = hash_algos[i].type;
+      return TRUE;
+    }
+  }
+  return FALSE;
+}
+
+const gchar *jingle_ft_hash_type_to_name(GChecksumType type)
+{
+  int i;
+
+  for (i = 0; hash_algos[i].name != NULL; i++)
+    if (hash_algos[i].type == type)
+      return hash_algos[i].name;
+  return NULL;
+}
+
+/**
+ * @brief Check that hex is a hexadecimal digest of the given type
+ */
+gboolean jingle_ft_hash_is_valid(GChecksumType type, const gchar *hex)
+{
+  gsize i, len = g_checksum_type_get_length(type) * 2;
+
+  if (hex == NULL || strlen(hex) != len)
+    return FALSE;
+
+  for (i = 0; i < len; i++)
+    if (!g_ascii_isxdigit(hex[i]))
+      return FALSE;
+  return TRUE;
+}
+
+/**
+ * @brief XEP-0300 carries digests in base64, we keep them in hexadecimal
+ * @return a newly allocated string
+ */
+gchar *jingle_ft_hash_hex_to_base64(const gchar *hex)
+{
+  gsize i, len = strlen(hex) / 2;
+  guchar *raw = g_malloc(len);
+  gchar *b64;
+
+  for (i = 0; i < len; i++)
+    raw[i] = g_ascii_xdigit_value(hex[2*i]) << 4 |
+             g_ascii_xdigit_value(hex[2*i+1]);
+
+  b64 = g_base64_encode(raw, len);
+  g_free(raw);
+  return b64;
+}
+
+/**
+ * @return a newly allocated string, or NULL if b64 is not a digest
+ *         of the given type
+ */
+gchar *jingle_ft_hash_base64_to_hex(GChecksumType type, const gchar *b64)
+{
+  static const gchar digits[] = "0123456789abcdef";
+  guchar *raw;
+  gsize i, len = 0;
+  gchar *hex = NULL;
+
+  if (b64 == NULL)
+    return NULL;
+
+  raw = g_base64_decode(b64, &len);
+  if (raw != NULL && len == (gsize)g_checksum_type_get_length(type)) {
+    hex = g_malloc(len * 2 + 1);
+    for (i = 0; i < len; i++) {
+      hex[2*i]   = digits[raw[i] >> 4];
+      hex[2*i+1] = digits[raw[i] & 0xf];
+    }
+    hex[len * 2] = '\0';
+  }
+  g_free(raw);
+  return hex;
+}
+
+JingleFTHash *jingle_ft_hash_new(GChecksumType type)
+{
+  JingleFTHash *h = g_new0(JingleFTHash, 1);
+
+  if (pool == NULL)
+    pool = g_thread_pool_new(hash_job, NULL, JINGLE_FT_HASH_THREADS,
+                             FALSE, NULL);
+
+  g_mutex_init(&h->lock);
+  g_cond_init(&h->cond);
+  g_queue_init(&h->chunks);
+  h->ref = 1;
+  h->type = type;
+  h->checksum = g_checksum_new(type);
+  return h;
+}
+
+GChecksumType jingle_ft_hash_get_type(JingleFTHash *h)
+{
+  return h->type;
+}
+
+static void hash_chunk_free(HashChunk *chunk)
+{
+  if (chunk->destroy != NULL)
+    chunk->destroy(chunk->owner);
+  if (chunk->fd >= 0)
+    close(chunk->fd);
+  g_free(chunk);
+}
+
+/**
+ * Feed [start, start + len) of a file to the checksum.
+ */
+static gboolean hash_read(JingleFTHash *h, gint fd, guint64 start,
+                          guint64 len)
+{
+  gchar *buf = g_malloc(JINGLE_FT_HASH_READ);
+  ssize_t r;
+
+  while (len > 0 && !g_atomic_int_get(&h->cancelled)) {
+    r = pread(fd, buf, MIN(len, JINGLE_FT_HASH_READ), start);
+    if (r < 0 && errno == EINTR)
+      continue;
+    if (r <= 0)
+      break;
+    g_checksum_update(h->checksum, (const guchar *)buf, r);
+    start += r;
+    len -= r;
+  }
+  g_free(buf);
+  return len == 0;
+}
+
+/**
+ * Feed len zeros to the checksum, for the holes of a sparse file.
+ */
+static void hash_zeros(GChecksum *checksum, guint64 len)
+{
+  static const guchar zeros[JINGLE_FT_HASH_READ];
+
+  while (len > 0) {
+    g_checksum_update(checksum, zeros, MIN(len, JINGLE_FT_HASH_READ));
+    len -= MIN(len, JINGLE_FT_HASH_READ);
+  }
+}
+
+/**
+ * Run by a worker: hash what was queued until nothing is left.
+ */
+static void hash_job(gpointer data, gpointer user_data)
+{
+  JingleFTHash *h = (JingleFTHash *)data;
+  HashChunk *chunk;
+  gint64 start;
+
+  g_mutex_lock(&h->lock);
+  while ((chunk = g_queue_pop_head(&h->chunks)) != NULL) {
+    g_mutex_unlock(&h->lock);
+
+    start = g_get_monotonic_time();
+    if (chunk->data != NULL)
+      g_checksum_update(h->checksum, (const guchar *)chunk->data, chunk->len);
+    else if (chunk->fd < 0)
+      hash_zeros(h->checksum, chunk->flen);
+    else if (!hash_read(h, chunk->fd, chunk->start, chunk->flen))
+      h->failed = TRUE;
+
+    g_mutex_lock(&h->lock);
+    h->time += g_get_monotonic_time() - start;
+    h->hashed += (chunk->data != NULL) ? chunk->len : chunk->flen;
+    h->backlog -= chunk->held;
+    if (h->caughtup != NULL && h->caughtup_idle == 0 &&
+        h->backlog < JINGLE_FT_HASH_BACKLOG / 2)
+      h->caughtup_idle = g_idle_add(hash_caughtup, h);
+    g_mutex_unlock(&h->lock);
+
+    hash_chunk_free(chunk);
+
+    g_mutex_lock(&h->lock);
+  }
+  h->busy = FALSE;
+  if (h->done != NULL && h->idle == 0)
+    h->idle = g_idle_add(hash_notify, h);
+  g_cond_broadcast(&h->cond);
+  // The owner freed it meanwhile, we are the last one holding it
+  if (--h->ref == 0) {
+    g_mutex_unlock(&h->lock);
+    hash_destroy(h);
+    return;
+  }
+  g_mutex_unlock(&h->lock);
+}
+
+/**
+ * @brief Hash len bytes of data once a worker gets to it
+ *
+ * data must stay valid until destroy is called on owner, which
+ * may happen in any thread.
+ */
+void jingle_ft_hash_update_full(JingleFTHash *h, const gchar *data, gsize len,
+                                gpointer owner, GDestroyNotify destroy)
+{
+  HashChunk *chunk;
+
+  if (len == 0 || h->done != NULL || h->digest != NULL) {
+    if (destroy != NULL)
+      destroy(owner);
+    return;
+  }
+
+  chunk = g_new0(HashChunk, 1);
+  chunk->data = data;
+  chunk->len = len;
+  chunk->owner = owner;
+  chunk->destroy = destroy;
+  // Not a copy, but it keeps the pages of a mapping in memory
+  chunk->held = len;
+  chunk->fd = -1;
+
+  hash_push(h, chunk);
+}
+
+static void hash_push(JingleFTHash *h, HashChunk *chunk)
+{
+  // Callers check jingle_ft_hash_is_behind first, a slow disk or CPU
+  // does not pile up the whole file in memory
+  g_mutex_lock(&h->lock);
+  g_queue_push_tail(&h->chunks, chunk);
+  h->backlog += chunk->held;
+  if (!h->busy) {
+    h->busy = TRUE;
+    h->ref++;
+    g_thread_pool_push(pool, h, NULL);
+  }
+  g_mutex_unlock(&h->lock);
+}
+
+/**
+ * @brief Hash a copy of data, for buffers that do not outlive the call
+ */
+void jingle_ft_hash_update(JingleFTHash *h, const gchar *data, gsize len)
+{
+  HashChunk *chunk;
+
+  if (len == 0 || h->done != NULL || h->digest != NULL)
+    return;
+
+  chunk = g_new0(HashChunk, 1);
+  chunk->data = chunk->owner = g_memdup(data, len);
+  chunk->len = chunk->held = len;
+  chunk->destroy = g_free;
+  chunk->fd = -1;
+
+  hash_push(h, chunk);
+}
+
+/**
+ * @brief Hash len bytes of a file from start, read by the worker
+ *
+ * fd is duplicated, the caller may close it or keep using it, as
+ * long as it does not change that part of the file. A part following
+ * the last one queued is read with it.
+ */
+void jingle_ft_hash_update_fd(JingleFTHash *h, gint fd, guint64 start,
+                              guint64 len)
+{
+  HashChunk *chunk, *last;
+  struct stat fileinfo;
+
+  if (len == 0 || h->done != NULL || h->digest != NULL)
+    return;
+
+  if (fstat(fd, &fileinfo) != 0) {
+    h->failed = TRUE;
+    return;
+  }
+
+  // The worker has not taken the last chunk yet, it may still grow
+  g_mutex_lock(&h->lock);
+  last = g_queue_peek_tail(&h->chunks);
+  if (last != NULL && last->fd >= 0 && last->dev == fileinfo.st_dev &&
+      last->ino == fileinfo.st_ino && last->start + last->flen == start) {
+    last->flen += len;
+    g_mutex_unlock(&h->lock);
+    return;
+  }
+  g_mutex_unlock(&h->lock);
+
+  chunk = g_new0(HashChunk, 1);
+  chunk->fd = dup(fd);
+  chunk->start = start;
+  chunk->flen = len;
+  chunk->dev = fileinfo.st_dev;
+  chunk->ino = fileinfo.st_ino;
+
+  if (chunk->fd < 0) {
+    h->failed = TRUE;
+    g_free(chunk);
+    return;
+  }
+  hash_push(h, chunk);
+}
+
+/**
+ * @brief Whether the worker is too far behind to be given more data
+ *
+ * The caller may then hash the data from the file, once it is there,
+ * or wait for jingle_ft_hash_when_caught_up.
+ */
+gboolean jingle_ft_hash_is_behind(JingleFTHash *h)
+{
+  gboolean behind;
+
+  g_mutex_lock(&h->lock);
+  behind = h->backlog >= JINGLE_FT_HASH_BACKLOG;
+  g_mutex_unlock(&h->lock);
+  return behind;
+}
+
+/**
+ * @brief Have caughtup called from the main loop once the worker is
+ *        no longer behind
+ *
+ * It replaces the one given before, if it was not called yet, and is
+ * not called if the hash is freed first.
+ */
+void jingle_ft_hash_when_caught_up(JingleFTHash *h,
+                                   JingleFTHashCaughtUp caughtup,
+                                   gpointer user_data)
+{
+  g_mutex_lock(&h->lock);
+  h->caughtup = caughtup;
+  h->caughtup_data = user_data;
+  // The worker may be done with it already
+  if (h->caughtup_idle == 0 && h->backlog < JINGLE_FT_HASH_BACKLOG / 2)
+    h->caughtup_idle = g_idle_add(hash_caughtup, h);
+  g_mutex_unlock(&h->lock);
+}
+
+/**
+ * Run in the main loop once the backlog is half hashed.
+ */
+static gboolean hash_caughtup(gpointer data)
+{
+  JingleFTHash *h = (JingleFTHash *)data;
+  JingleFTHashCaughtUp caughtup;
+
+  g_mutex_lock(&h->lock);
+  h->caughtup_idle = 0;
+  caughtup = h->caughtup;
+  h->caughtup = NULL;
+  g_mutex_unlock(&h->lock);
+
+  // caughtup may free the hash
+  caughtup(h->caughtup_data);
+  return FALSE;
+}
+
+/**
+ * @brief Hash len zeros, where a sparse file has a hole
+ */
+void jingle_ft_hash_update_zeros(JingleFTHash *h, guint64 len)
+{
+  HashChunk *chunk;
+
+  if (len == 0 || h->done != NULL || h->digest != NULL)
+    return;
+
+  chunk = g_new0(HashChunk, 1);
+  chunk->fd = -1;
+  chunk->flen = len;
+
+  hash_push(h, chunk);
+}
+
+static void hash_wait(JingleFTHash *h)
+{
+  g_mutex_lock(&h->lock);
+  while (h->busy)
+    g_cond_wait(&h->cond, &h->lock);
+  g_mutex_unlock(&h->lock);
+}
+
+/**
+ * Run in the main loop once the last chunk is hashed.
+ */
+static gboolean hash_notify(gpointer data)
+{
+  JingleFTHash *h = (JingleFTHash *)data;
+
+  g_mutex_lock(&h->lock);
+  h->idle = 0;
+  g_mutex_unlock(&h->lock);
+
+  // done may free the hash
+  jingle_ft_hash_get_string(h);
+  h->done(h->done_data);
+  return FALSE;
+}
+
+/**
+ * @brief No more data will come, call done from the main loop once
+ *        the digest is known
+ *
+ * done is not called if the hash is freed first.
+ */
+void jingle_ft_hash_finish(JingleFTHash *h, JingleFTHashDone done,
+                           gpointer user_data)
+{
+  g_mutex_lock(&h->lock);
+  h->done = done;
+  h->done_data = user_data;
+  if (!h->busy && h->idle == 0)
+    h->idle = g_idle_add(hash_notify, h);
+  g_mutex_unlock(&h->lock);
+}
+
+/**
+ * @brief Whether the digest is known, without waiting for it
+ */
+gboolean jingle_ft_hash_is_finished(JingleFTHash *h)
+{
+  return h->digest != NULL;
+}
+
+/**
+ * @brief Wait for the queued data to be hashed and give the digest
+ *
+ * Does not wait once the digest was given to jingle_ft_hash_finish's
+ * callback. The hash cannot be updated anymore afterwards.
+ */
+const gchar *jingle_ft_hash_get_string(JingleFTHash *h)
+{
+  if (h->digest == NULL) {
+    hash_wait(h);
+    if (h->failed)
+      h->digest = g_strdup("");
+    else
+      h->digest = g_strdup(g_checksum_get_string(h->checksum));
+  }
+  return h->digest;
+}
+
+/**
+ * @brief How many bytes the workers hashed so far, and in how long
+ */
+void jingle_ft_hash_get_stats(JingleFTHash *h, guint64 *hashed, gint64 *usec)
+{
+  g_mutex_lock(&h->lock);
+  *hashed = h->hashed;
+  *usec = h->time;
+  g_mutex_unlock(&h->lock);
+}
+
+static void hash_destroy(JingleFTHash *h)
+{
+  g_checksum_free(h->checksum);
+  g_free(h->digest);
+  g_cond_clear(&h->cond);
+  g_mutex_clear(&h->lock);
+  g_free(h);
+}
+
+/**
+ * @brief Free the hash, once the worker is done with it if it is
+ *        hashing a chunk
+ *
+ * Neither done nor caughtup is called anymore. A part of a file being
+ * read is not read to its end.
+ */
+void jingle_ft_hash_free(JingleFTHash *h)
+{
+  HashChunk *chunk;
+  gboolean last;
+
+  if (h == NULL)
+    return;
+
+  // Drop what is still queued, the worker stops with the chunk it has.
+  // It adds no source once the callbacks are gone.
+  g_atomic_int_set(&h->cancelled, 1);
+  g_mutex_lock(&h->lock);
+  while ((chunk = g_queue_pop_head(&h->chunks)) != NULL) {
+    h->backlog -= chunk->held;
+    hash_chunk_free(chunk);
+  }
+  h->done = NULL;
+  h->caughtup = NULL;
+  if (h->idle != 0)
+    g_source_remove(h->idle);
+  if (h->caughtup_idle != 0)
+    g_source_remove(h->caughtup_idle);
+  h->idle = h->caughtup_idle = 0;
+  last = --h->ref == 0;
+  g_mutex_unlock(&h->lock);
+
+  if (last)
+    hash_destroy(h);
+}
+
+/**
+ * @brief Stop the workers, every hash must have been freed
+ *
+ * Waits for the workers to finish with the hashes freed while they
+ * were hashing them.
+ */
+void jingle_ft_hash_uninit(void)
+{
+  if (pool != NULL) {
+    g_thread_pool_free(pool, FALSE, TRUE);
+    pool = NULL;
+  }
+}
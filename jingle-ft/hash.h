@@ -0,0 +1,62 @@
+#ifndef __JINGLEFT_HASH_H__
+#define __JINGLEFT_HASH_H__ 1
+
+/**
+ * \file hash.h
+ * \brief Hash a transfered file on a worker thread, alongside the I/O
+ */
+
+#include <glib.h>
+
+#define NS_HASHES "urn:xmpp:hashes:1"
+
+/* Algorithm we use for the files we send (jingle_ft_hash) */
+#define JINGLE_FT_HASH_DEFAULT "sha-256"
+
+/* Bytes of one file held and waiting to be hashed before the sender
+ * stops reading, and the receiver hashes from the file, until the
+ * worker catches up */
+#define JINGLE_FT_HASH_BACKLOG 16777216
+
+/* Worker threads shared by all the transfers */
+#define JINGLE_FT_HASH_THREADS 2
+
+/* Bytes read at once when hashing a part of a file on disk */
+#define JINGLE_FT_HASH_READ 262144
+
+typedef struct _JingleFTHash JingleFTHash;
+
+/* Called in the main loop once the digest is known */
+typedef void (*JingleFTHashDone)(gpointer user_data);
+
+/* Called in the main loop once the worker is no longer behind */
+typedef void (*JingleFTHashCaughtUp)(gpointer user_data);
+
+gboolean jingle_ft_hash_type_from_name(const gchar *name,
+                                       GChecksumType *type);
+const gchar *jingle_ft_hash_type_to_name(GChecksumType type);
+gboolean jingle_ft_hash_is_valid(GChecksumType type, const gchar *hex);
+gchar *jingle_ft_hash_hex_to_base64(const gchar *hex);
+gchar *jingle_ft_hash_base64_to_hex(GChecksumType type, const gchar *b64);
+
+JingleFTHash *jingle_ft_hash_new(GChecksumType type);
+GChecksumType jingle_ft_hash_get_type(JingleFTHash *h);
+void jingle_ft_hash_update(JingleFTHash *h, const gchar *data, gsize len);
+void jingle_ft_hash_update_full(JingleFTHash *h, const gchar *data, gsize len,
+                                gpointer owner, GDestroyNotify destroy);
+void jingle_ft_hash_update_fd(JingleFTHash *h, gint fd, guint64 start,
+                              guint64 len);
+void jingle_ft_hash_update_zeros(JingleFTHash *h, guint64 len);
+gboolean jingle_ft_hash_is_behind(JingleFTHash *h);
+void jingle_ft_hash_when_caught_up(JingleFTHash *h,
+                                   JingleFTHashCaughtUp caughtup,
+                                   gpointer user_data);
+void jingle_ft_hash_finish(JingleFTHash *h, JingleFTHashDone done,
+                           gpointer user_data);
+gboolean jingle_ft_hash_is_finished(JingleFTHash *h);
+const gchar *jingle_ft_hash_get_string(JingleFTHash *h);
+void jingle_ft_hash_get_stats(JingleFTHash *h, guint64 *hashed, gint64 *usec);
+void jingle_ft_hash_free(JingleFTHash *h);
+void jingle_ft_hash_uninit(void);
+
+#endif
@@ -0,0 +1,474 @@
+/*
+ * prefetch.c
+ *
+ * Copyright (C) 2026 mcabber-jingle contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+#include <glib.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "prefetch.h"
+
+/*
+ * A mapped file is read in place: workers only fault its pages in,
+ * ahead of the transport, so that the main loop never waits on the disk.
+ * A channel is read by workers into slices queued for the main loop.
+ * Only one job per file is queued or running at a time, so reads stay
+ * sequential.
+ */
+
+typedef struct {
+  gchar *data;
+  gsize len;
+  gsize used;
+} PrefetchSlice;
+
+struct _JingleFTPrefetch {
+  GMutex lock;
+
+  /* Held by the owner, by a queued or running job, by a pending
+   * notification and by each caller of jingle_ft_prefetch_consume */
+  guint ref;
+
+  /* Where the data comes from, a mapping or a channel */
+  GMappedFile *mapped;
+  const gchar *map;
+  gsize maplen;
+  GIOChannel *channel;
+
+  /* Mapping: [pos, ready) is in memory and not given out yet */
+  gsize pos;
+  gsize ready;
+
+  /* Channel: slices read and not consumed yet, oldest first */
+  GQueue slices;
+
+  /* Consumed slices, freed once no caller holds them */
+  GSList *spent;
+  guint holds;
+
+  /* Bytes the workers read or faulted in, and the time they took */
+  guint64 read;
+  gint64 time;
+
+  gboolean busy;
+  gboolean eof;
+  GError *error;
+  gboolean cancelled;
+
+  /* The owner is waiting for data, and the idle source telling it */
+  gboolean waiting;
+  guint idle;
+  JingleFTPrefetchReady ready_cb;
+  gpointer user_data;
+};
+
+static GThreadPool *pool = NULL;
+
+static void prefetch_job(gpointer data, gpointer user_data);
+
+
+static void prefetch_slice_free(PrefetchSlice *slice)
+{
+  g_free(slice->data);
+  g_free(slice);
+}
+
+static void prefetch_destroy(JingleFTPrefetch *pf)
+{
+  PrefetchSlice *slice;
+  GSList *el;
+
+  while ((slice = g_queue_pop_head(&pf->slices)) != NULL)
+    prefetch_slice_free(slice);
+  for (el = pf->spent; el; el = el->next)
+    prefetch_slice_free(el->data);
+  g_slist_free(pf->spent);
+
+  if (pf->error != NULL)
+    g_error_free(pf->error);
+  if (pf->mapped != NULL)
+    g_mapped_file_unref(pf->mapped);
+  if (pf->channel != NULL)
+    g_io_channel_unref(pf->channel);
+
+  g_mutex_clear(&pf->lock);
+  g_free(pf);
+}
+
+static void prefetch_unref(JingleFTPrefetch *pf)
+{
+  guint ref;
+
+  g_mutex_lock(&pf->lock);
+  ref = --pf->ref;
+  g_mutex_unlock(&pf->lock);
+
+  if (ref == 0)
+    prefetch_destroy(pf);
+}
+
+/**
+ * Queue a job if we are not far enough ahead.
+ * Must be called with the lock held.
+ */
+static void prefetch_kick(JingleFTPrefetch *pf)
+{
+  if (pf->busy || pf->eof || pf->error != NULL || pf->cancelled)
+    return;
+
+  if (pf->mapped != NULL) {
+    if (pf->ready >= pf->maplen || pf->ready - pf->pos >=
+        JINGLE_FT_PREFETCH_CHUNK * JINGLE_FT_PREFETCH_AHEAD)
+      return;
+  } else if (pf->slices.length >= JINGLE_FT_PREFETCH_AHEAD) {
+    return;
+  }
+
+  pf->busy = TRUE;
+  pf->ref++;
+  g_thread_pool_push(pool, pf, NULL);
+}
+
+static JingleFTPrefetch *prefetch_new(JingleFTPrefetchReady ready,
+                                      gpointer user_data)
+{
+  JingleFTPrefetch *pf = g_new0(JingleFTPrefetch, 1);
+
+  if (pool == NULL)
+    pool = g_thread_pool_new(prefetch_job, NULL, JINGLE_FT_PREFETCH_THREADS,
+                             FALSE, NULL);
+
+  g_mutex_init(&pf->lock);
+  g_queue_init(&pf->slices);
+  pf->ref = 1;
+  pf->ready_cb = ready;
+  pf->user_data = user_data;
+  return pf;
+}
+
+/**
+ * @brief Prefetch a mapped file, which is kept mapped as long as needed
+ * @param offset Where to start in the file
+ */
+JingleFTPrefetch *jingle_ft_prefetch_new_mapped(GMappedFile *file,
+                                                guint64 offset,
+                                                JingleFTPrefetchReady ready,
+                                                gpointer user_data)
+{
+  JingleFTPrefetch *pf = prefetch_new(ready, user_data);
+
+  pf->mapped = g_mapped_file_ref(file);
+  pf->map    = g_mapped_file_get_contents(file);
+  pf->maplen = g_mapped_file_get_length(file);
+  pf->pos    = MIN(offset, pf->maplen);
+  pf->ready  = pf->pos;
+
+  if (pf->maplen > 0)
+    madvise((gpointer)pf->map, pf->maplen, MADV_SEQUENTIAL);
+
+  g_mutex_lock(&pf->lock);
+  prefetch_kick(pf);
+  g_mutex_unlock(&pf->lock);
+  return pf;
+}
+
+/**
+ * @brief Prefetch a blocking channel, which only workers read from now
+ * @param offset Where to start in the file
+ */
+JingleFTPrefetch *jingle_ft_prefetch_new_channel(GIOChannel *channel,
+                                                 guint64 offset,
+                                                 JingleFTPrefetchReady ready,
+                                                 gpointer user_data)
+{
+  JingleFTPrefetch *pf = prefetch_new(ready, user_data);
+  GError *err = NULL;
+
+  pf->channel = g_io_channel_ref(channel);
+
+  // The first read fails with the error if we cannot seek
+  if (offset > 0 &&
+      g_io_channel_seek_position(channel, offset, G_SEEK_SET, &err) !=
+      G_IO_STATUS_NORMAL)
+    pf->error = err ? err : g_error_new(G_IO_CHANNEL_ERROR,
+                                        G_IO_CHANNEL_ERROR_FAILED,
+                                        "cannot seek");
+
+  g_mutex_lock(&pf->lock);
+  prefetch_kick(pf);
+  g_mutex_unlock(&pf->lock);
+  return pf;
+}
+
+/**
+ * Bring the pages of [start, end) in memory.
+ */
+static void prefetch_fault(const gchar *map, gsize start, gsize end)
+{
+  gsize pagesize = sysconf(_SC_PAGESIZE);
+  gsize first = start - start % pagesize, off;
+  volatile gchar sink;
+
+  // Let the kernel read the whole slice at once, then wait for it here
+  madvise((gpointer)(map + first), end - first, MADV_WILLNEED);
+  for (off = first; off < end; off += pagesize)
+    sink = map[off];
+  (void)sink;
+}
+
+/**
+ * Read a full slice, a short read does not mean the file is over.
+ */
+static GIOStatus prefetch_read(GIOChannel *channel, PrefetchSlice **slice,
+                               GError **err)
+{
+  PrefetchSlice *s = g_new0(PrefetchSlice, 1);
+  GIOStatus status = G_IO_STATUS_NORMAL;
+  gsize read;
+  gint again = 0;
+
+  s->data = g_malloc(JINGLE_FT_PREFETCH_CHUNK);
+  while (s->len < JINGLE_FT_PREFETCH_CHUNK) {
+    read = 0;
+    status = g_io_channel_read_chars(channel, s->data + s->len,
+                                     JINGLE_FT_PREFETCH_CHUNK - s->len,
+                                     &read, err);
+    s->len += read;
+    if (status == G_IO_STATUS_AGAIN && ++again < 10)
+      continue;
+    if (status == G_IO_STATUS_AGAIN) {
+      g_set_error(err, G_IO_CHANNEL_ERROR, G_IO_CHANNEL_ERROR_FAILED,
+                  "file unavailable");
+      status = G_IO_STATUS_ERROR;
+    }
+    if (status != G_IO_STATUS_NORMAL)
+      break;
+  }
+
+  if (s->len == 0) {
+    prefetch_slice_free(s);
+    s = NULL;
+  }
+  *slice = s;
+  return status;
+}
+
+static gboolean prefetch_notify(gpointer data)
+{
+  JingleFTPrefetch *pf = (JingleFTPrefetch *)data;
+  gboolean cancelled;
+
+  g_mutex_lock(&pf->lock);
+  pf->idle = 0;
+  cancelled = pf->cancelled;
+  g_mutex_unlock(&pf->lock);
+
+  if (!cancelled)
+    pf->ready_cb(pf->user_data);
+
+  prefetch_unref(pf);
+  return FALSE;
+}
+
+/**
+ * Run by a worker: read or fault in the next slice.
+ */
+static void prefetch_job(gpointer data, gpointer user_data)
+{
+  JingleFTPrefetch *pf = (JingleFTPrefetch *)data;
+  PrefetchSlice *slice = NULL;
+  GError *err = NULL;
+  GIOStatus status = G_IO_STATUS_NORMAL;
+  gsize start, end;
+  gint64 began;
+
+  g_mutex_lock(&pf->lock);
+  start = pf->ready;
+  end = MIN(start + JINGLE_FT_PREFETCH_CHUNK, pf->maplen);
+  if (pf->cancelled) {
+    pf->busy = FALSE;
+    g_mutex_unlock(&pf->lock);
+    prefetch_unref(pf);
+    return;
+  }
+  g_mutex_unlock(&pf->lock);
+
+  began = g_get_monotonic_time();
+  if (pf->mapped != NULL)
+    prefetch_fault(pf->map, start, end);
+  else
+    status = prefetch_read(pf->channel, &slice, &err);
+
+  g_mutex_lock(&pf->lock);
+  pf->busy = FALSE;
+  pf->time += g_get_monotonic_time() - began;
+  if (pf->mapped != NULL) {
+    pf->read += end - start;
+    pf->ready = MAX(pf->ready, end);
+  } else if (slice != NULL) {
+    pf->read += slice->len;
+    g_queue_push_tail(&pf->slices, slice);
+  }
+  if (status == G_IO_STATUS_EOF)
+    pf->eof = TRUE;
+  if (err != NULL)
+    pf->error = err;
+
+  if (pf->waiting && !pf->cancelled) {
+    pf->waiting = FALSE;
+    pf->ref++;
+    pf->idle = g_idle_add(prefetch_notify, pf);
+  }
+  prefetch_kick(pf);
+  g_mutex_unlock(&pf->lock);
+
+  prefetch_unref(pf);
+}
+
+/**
+ * @brief Get up to want bytes of the data following what was consumed
+ * @return G_IO_STATUS_NORMAL with data and len set, G_IO_STATUS_EOF,
+ *         G_IO_STATUS_ERROR with err set, or G_IO_STATUS_AGAIN if
+ *         nothing is ready yet: the ready callback will be called
+ *         once something is.
+ *
+ * The data remains valid until it is consumed, or until the
+ * matching jingle_ft_prefetch_release if it was.
+ */
+GIOStatus jingle_ft_prefetch_peek(JingleFTPrefetch *pf, gsize want,
+                                  const gchar **data, gsize *len,
+                                  GError **err)
+{
+  PrefetchSlice *slice;
+  GIOStatus status;
+
+  g_mutex_lock(&pf->lock);
+  if (pf->mapped != NULL && pf->ready > pf->pos) {
+    *data = pf->map + pf->pos;
+    *len = MIN(want, pf->ready - pf->pos);
+    status = G_IO_STATUS_NORMAL;
+  } else if (pf->mapped == NULL &&
+             (slice = g_queue_peek_head(&pf->slices)) != NULL) {
+    *data = slice->data + slice->used;
+    *len = MIN(want, slice->len - slice->used);
+    status = G_IO_STATUS_NORMAL;
+  } else if (pf->error != NULL) {
+    if (err != NULL)
+      *err = g_error_copy(pf->error);
+    status = G_IO_STATUS_ERROR;
+  } else if (pf->eof || (pf->mapped != NULL && pf->pos >= pf->maplen)) {
+    status = G_IO_STATUS_EOF;
+  } else {
+    pf->waiting = TRUE;
+    status = G_IO_STATUS_AGAIN;
+  }
+  prefetch_kick(pf);
+  g_mutex_unlock(&pf->lock);
+
+  return status;
+}
+
+/**
+ * @brief Mark len bytes as given to the transport
+ *
+ * The data stays valid until jingle_ft_prefetch_release is called,
+ * even if the prefetcher is freed meanwhile. In a mapping, len may go
+ * past what jingle_ft_prefetch_peek gave.
+ */
+void jingle_ft_prefetch_consume(JingleFTPrefetch *pf, gsize len)
+{
+  PrefetchSlice *slice;
+
+  g_mutex_lock(&pf->lock);
+  pf->ref++;
+  pf->holds++;
+  if (pf->mapped != NULL) {
+    // The caller faulted in what it took past the ready part
+    pf->pos += len;
+    pf->ready = MAX(pf->ready, pf->pos);
+  } else if ((slice = g_queue_peek_head(&pf->slices)) != NULL) {
+    slice->used += len;
+    if (slice->used >= slice->len)
+      pf->spent = g_slist_prepend(pf->spent, g_queue_pop_head(&pf->slices));
+  }
+  prefetch_kick(pf);
+  g_mutex_unlock(&pf->lock);
+}
+
+void jingle_ft_prefetch_release(JingleFTPrefetch *pf)
+{
+  GSList *spent = NULL, *el;
+
+  g_mutex_lock(&pf->lock);
+  if (--pf->holds == 0) {
+    spent = pf->spent;
+    pf->spent = NULL;
+  }
+  g_mutex_unlock(&pf->lock);
+
+  for (el = spent; el; el = el->next)
+    prefetch_slice_free(el->data);
+  g_slist_free(spent);
+
+  prefetch_unref(pf);
+}
+
+/**
+ * @brief How many bytes the workers read so far, and in how long
+ */
+void jingle_ft_prefetch_get_stats(JingleFTPrefetch *pf, guint64 *read,
+                                  gint64 *usec)
+{
+  g_mutex_lock(&pf->lock);
+  *read = pf->read;
+  *usec = pf->time;
+  g_mutex_unlock(&pf->lock);
+}
+
+/**
+ * @brief Stop prefetching, the ready callback will not be called again
+ */
+void jingle_ft_prefetch_free(JingleFTPrefetch *pf)
+{
+  if (pf == NULL)
+    return;
+
+  g_mutex_lock(&pf->lock);
+  pf->cancelled = TRUE;
+  if (pf->idle != 0) {
+    g_source_remove(pf->idle);
+    pf->idle = 0;
+    pf->ref--; // the notification will never drop its reference
+  }
+  g_mutex_unlock(&pf->lock);
+
+  prefetch_unref(pf);
+}
+
+/**
+ * @brief Wait for the running jobs, every prefetcher must be freed
+ */
+void jingle_ft_prefetch_uninit(void)
+{
+  if (pool != NULL) {
+    g_thread_pool_free(pool, FALSE, TRUE);
+    pool = NULL;
+  }
+}
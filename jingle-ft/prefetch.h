@@ -0,0 +1,46 @@
+#ifndef __JINGLEFT_PREFETCH_H__
+#define __JINGLEFT_PREFETCH_H__ 1
+
+/**
+ * \file prefetch.h
+ * \brief Read the file we send ahead of the transport, off the main loop
+ */
+
+#include <glib.h>
+
+/* Size of the slices read, or faulted in, by a worker at once */
+#define JINGLE_FT_PREFETCH_CHUNK 262144
+
+/* How many slices we keep ready ahead of the transport */
+#define JINGLE_FT_PREFETCH_AHEAD 4
+
+/* Worker threads shared by all the transfers */
+#define JINGLE_FT_PREFETCH_THREADS 2
+
+/**
+ * \brief Called in the main loop when data is ready after a
+ *        jingle_ft_prefetch_peek returned G_IO_STATUS_AGAIN
+ */
+typedef void (*JingleFTPrefetchReady) (gpointer user_data);
+
+typedef struct _JingleFTPrefetch JingleFTPrefetch;
+
+JingleFTPrefetch *jingle_ft_prefetch_new_mapped(GMappedFile *file,
+                                                guint64 offset,
+                                                JingleFTPrefetchReady ready,
+                                                gpointer user_data);
+JingleFTPrefetch *jingle_ft_prefetch_new_channel(GIOChannel *channel,
+                                                 guint64 offset,
+                                                 JingleFTPrefetchReady ready,
+                                                 gpointer user_data);
+GIOStatus jingle_ft_prefetch_peek(JingleFTPrefetch *pf, gsize want,
+                                  const gchar **data, gsize *len,
+                                  GError **err);
+void jingle_ft_prefetch_consume(JingleFTPrefetch *pf, gsize len);
+void jingle_ft_prefetch_release(JingleFTPrefetch *pf);
+void jingle_ft_prefetch_get_stats(JingleFTPrefetch *pf, guint64 *read,
+                                  gint64 *usec);
+void jingle_ft_prefetch_free(JingleFTPrefetch *pf);
+void jingle_ft_prefetch_uninit(void);
+
+#endif
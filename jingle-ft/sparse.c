@@ -0,0 +1,138 @@
+/*
+ * sparse.c
+ *
+ * Copyright (C) 2026 mcabber-jingle contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+/* For SEEK_DATA, SEEK_HOLE and fallocate */
+#define _GNU_SOURCE
+
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <mcabber/settings.h>
+
+#include "sparse.h"
+
+/*
+ * The sender finds the holes of its file and describes them in the
+ * format of delta.c instead of sending their zeros. The receiver makes
+ * holes there in the file it writes. Both still give the zeros to the
+ * hash, which covers what the file reads as.
+ */
+
+/**
+ * @return FALSE if jingle_ft_sparse is set to 0
+ */
+gboolean jingle_ft_sparse_enabled(void)
+{
+  return settings_opt_get("jingle_ft_sparse") == NULL
+         || settings_opt_get_int("jingle_ft_sparse") != 0;
+}
+
+/**
+ * @brief Whether a file may have holes, from its stat alone
+ *
+ * A file taking less room than its size has holes, or is compressed
+ * by the file system. It is only looked for holes once sent.
+ */
+gboolean jingle_ft_sparse_maybe(const struct stat *fileinfo)
+{
+  return (guint64)fileinfo->st_blocks * 512 < (guint64)fileinfo->st_size;
+}
+
+/**
+ * @brief The holes of a file, in order
+ * @return a GArray of JingleFTHole, NULL if the file has none or if
+ *         the system cannot tell
+ */
+GArray *jingle_ft_sparse_holes(const gchar *path, guint64 size)
+{
+#if defined(SEEK_DATA) && defined(SEEK_HOLE)
+  GArray *holes;
+  JingleFTHole hole;
+  off_t pos = 0, data, end;
+  gint fd = g_open(path, O_RDONLY, 0);
+
+  if (fd < 0)
+    return NULL;
+
+  // File systems without holes say the whole file is data
+  holes = g_array_new(FALSE, FALSE, sizeof(JingleFTHole));
+  while ((guint64)pos < size) {
+    data = lseek(fd, pos, SEEK_DATA);
+    // Only a hole is left
+    if (data < 0 && errno == ENXIO)
+      data = size;
+    if (data < 0)
+      break;
+    data = MIN((guint64)data, size);
+    if ((guint64)(data - pos) >= JINGLE_FT_SPARSE_HOLE) {
+      hole.start = pos;
+      hole.end = data;
+      g_array_append_val(holes, hole);
+    }
+    if ((guint64)data >= size)
+      break;
+    end = lseek(fd, data, SEEK_HOLE);
+    if (end <= data)
+      break;
+    pos = end;
+  }
+  close(fd);
+
+  if (holes->len == 0) {
+    g_array_free(holes, TRUE);
+    return NULL;
+  }
+  return holes;
+#else
+  return NULL;
+#endif
+}
+
+/**
+ * @brief Make [offset, offset + len) of a file a hole, or write zeros
+ *        there if the file system cannot
+ */
+gboolean jingle_ft_sparse_punch(gint fd, guint64 offset, guint64 len)
+{
+  static const gchar zeros[JINGLE_FT_SPARSE_ZEROS];
+  ssize_t r;
+
+#ifdef FALLOC_FL_PUNCH_HOLE
+  if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset,
+                len) == 0)
+    return TRUE;
+#endif
+
+  while (len > 0) {
+    r = pwrite(fd, zeros, MIN(len, sizeof(zeros)), offset);
+    if (r < 0 && errno == EINTR)
+      continue;
+    if (r <= 0)
+      return FALSE;
+    offset += r;
+    len -= r;
+  }
+  return TRUE;
+}
@@ -0,0 +1,37 @@
+#ifndef __JINGLEFT_SPARSE_H__
+#define __JINGLEFT_SPARSE_H__ 1
+
+/**
+ * \file sparse.h
+ * \brief Send the holes of a sparse file as such, not as zeros
+ */
+
+#include <glib.h>
+#include <sys/stat.h>
+
+/* Our own extension of the description, and the disco feature telling
+ * that we understand it */
+#define NS_JINGLE_APP_FT_SPARSE "http://mcabber.com/protocol/jingle-ft/sparse"
+
+/* Holes shorter than that are sent as zeros: the receiver writes out
+ * its buffer before making each hole */
+#define JINGLE_FT_SPARSE_HOLE 65536
+
+/* Bytes of zeros written at once where holes cannot be made */
+#define JINGLE_FT_SPARSE_ZEROS 65536
+
+/**
+ * \struct JingleFTHole
+ * \brief [start, end) of a file reads as zeros and takes no space
+ */
+typedef struct {
+  guint64 start;
+  guint64 end;
+} JingleFTHole;
+
+gboolean jingle_ft_sparse_enabled(void);
+gboolean jingle_ft_sparse_maybe(const struct stat *fileinfo);
+GArray *jingle_ft_sparse_holes(const gchar *path, guint64 size);
+gboolean jingle_ft_sparse_punch(gint fd, guint64 offset, guint64 len);
+
+#endif
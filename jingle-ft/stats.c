@@ -0,0 +1,296 @@
+/*
+ * stats.c
+ *
+ * Copyright (C) 2026 mcabber-jingle contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+#include <glib.h>
+#include <string.h>
+
+#include "stats.h"
+
+/*
+ * Everything here runs in the main loop. The workers keep their own
+ * counters, which the owner copies in before showing them.
+ *
+ * A chunk handed to the transport is "in flight" until the transport
+ * asks for more data: that is its round trip, whether the transport
+ * waited for an ack (IBB) or for the socket to drain (SOCKS5).
+ */
+
+static const gchar *stage_names[] = {
+  "read",
+  "sent",
+  "wire",
+  "acked",
+  "received",
+  "written",
+  "hashed",
+  "verified"
+};
+
+/**
+ * Bytes that made it to the peer, or from it.
+ */
+static guint64 stats_moved(const JingleFTStats *st)
+{
+  return st->bytes[JINGLE_FT_STAGE_ACKED] + st->bytes[JINGLE_FT_STAGE_RECEIVED];
+}
+
+static gint64 stats_end(const JingleFTStats *st)
+{
+  return st->finished ? st->finished : g_get_monotonic_time();
+}
+
+void jingle_ft_stats_init(JingleFTStats *st, guint state)
+{
+  memset(st, 0, sizeof(JingleFTStats));
+  st->created = st->state_since = g_get_monotonic_time();
+  st->state = state;
+}
+
+/**
+ * @brief The transfer goes to another state
+ */
+void jingle_ft_stats_state(JingleFTStats *st, guint state)
+{
+  gint64 now = g_get_monotonic_time();
+
+  if (state == st->state)
+    return;
+  if (st->state < JINGLE_FT_STATS_STATES)
+    st->state_time[st->state] += now - st->state_since;
+  st->state = state;
+  st->state_since = now;
+}
+
+/**
+ * @brief Time spent in a state so far
+ */
+gint64 jingle_ft_stats_state_time(const JingleFTStats *st, guint state)
+{
+  gint64 t;
+
+  if (state >= JINGLE_FT_STATS_STATES)
+    return 0;
+  t = st->state_time[state];
+  if (state == st->state)
+    t += stats_end(st) - st->state_since;
+  return t;
+}
+
+/**
+ * @brief len more bytes went through a stage
+ */
+void jingle_ft_stats_progress(JingleFTStats *st, JingleFTStage stage,
+                              guint64 len)
+{
+  gint64 now;
+
+  if (len == 0)
+    return;
+  st->bytes[stage] += len;
+  if (stage != JINGLE_FT_STAGE_ACKED && stage != JINGLE_FT_STAGE_RECEIVED)
+    return;
+
+  now = g_get_monotonic_time();
+  if (st->started == 0) {
+    st->started = st->window_start = now;
+    st->window_bytes = 0;
+  }
+  if (now - st->window_start >= JINGLE_FT_STATS_WINDOW) {
+    st->rate = (stats_moved(st) - st->window_bytes) * 1e6 /
+               (now - st->window_start);
+    st->window_start = now;
+    st->window_bytes = stats_moved(st);
+  }
+}
+
+/**
+ * @brief A chunk was handed to the transport
+ *
+ * Call it before handing it: the transport may ask for more before
+ * it returns.
+ */
+void jingle_ft_stats_sent(JingleFTStats *st, gsize len)
+{
+  jingle_ft_stats_acked(st);
+  jingle_ft_stats_progress(st, JINGLE_FT_STAGE_SENT, len);
+  st->inflight = len;
+  st->inflight_since = g_get_monotonic_time();
+}
+
+/**
+ * @brief The transport asks for more, so the chunk in flight is through
+ */
+void jingle_ft_stats_acked(JingleFTStats *st)
+{
+  gint64 rtt;
+  guint b = 0;
+
+  if (st->inflight_since == 0)
+    return;
+
+  rtt = g_get_monotonic_time() - st->inflight_since;
+  if (rtt >= 1000)
+    b = MIN(g_bit_storage(rtt / 1000), JINGLE_FT_STATS_BUCKETS - 1);
+  st->rtt[b]++;
+  st->rtt_count++;
+  st->rtt_total += rtt;
+  st->rtt_max = MAX(st->rtt_max, rtt);
+
+  st->inflight_since = 0;
+  jingle_ft_stats_progress(st, JINGLE_FT_STAGE_ACKED, st->inflight);
+  st->inflight = 0;
+}
+
+/**
+ * @brief We wait for the prefetch workers, or they gave us data
+ */
+void jingle_ft_stats_read_wait(JingleFTStats *st, gboolean waiting)
+{
+  gint64 now = g_get_monotonic_time();
+
+  if (waiting && st->read_since == 0) {
+    st->read_since = now;
+  } else if (!waiting && st->read_since != 0) {
+    st->read_wait += now - st->read_since;
+    st->read_since = 0;
+  }
+}
+
+/**
+ * @brief No more data will move, the clock stops
+ */
+void jingle_ft_stats_finish(JingleFTStats *st)
+{
+  jingle_ft_stats_acked(st);
+  jingle_ft_stats_read_wait(st, FALSE);
+  if (st->finished == 0)
+    st->finished = g_get_monotonic_time();
+}
+
+/**
+ * @brief Bytes per second over the last few seconds
+ */
+gdouble jingle_ft_stats_rate(const JingleFTStats *st)
+{
+  gint64 elapsed;
+
+  if (st->started == 0 || st->finished != 0)
+    return 0;
+
+  // A stalled transfer shows it as soon as the window is over
+  elapsed = g_get_monotonic_time() - st->window_start;
+  if (elapsed >= JINGLE_FT_STATS_WINDOW || st->rate == 0)
+    return elapsed ? (stats_moved(st) - st->window_bytes) * 1e6 / elapsed : 0;
+  return st->rate;
+}
+
+/**
+ * @brief Bytes per second of a stage since the transfer started
+ */
+gdouble jingle_ft_stats_average(const JingleFTStats *st, JingleFTStage stage)
+{
+  gint64 elapsed;
+
+  if (st->started == 0)
+    return 0;
+  elapsed = stats_end(st) - st->started;
+  return elapsed ? st->bytes[stage] * 1e6 / elapsed : 0;
+}
+
+/**
+ * @brief Seconds until left more bytes are through, -1 if unknown
+ */
+gint64 jingle_ft_stats_eta(const JingleFTStats *st, guint64 left)
+{
+  gdouble rate = jingle_ft_stats_rate(st);
+
+  if (rate < 1)
+    rate = jingle_ft_stats_average(st, st->bytes[JINGLE_FT_STAGE_RECEIVED] ?
+                                       JINGLE_FT_STAGE_RECEIVED :
+                                       JINGLE_FT_STAGE_ACKED);
+  if (rate < 1)
+    return -1;
+  return (gint64)(left / rate);
+}
+
+/**
+ * @brief The round trips as "<1ms:3 <2ms:12 ... >=1024ms:0"
+ * @return a newly allocated string
+ */
+gchar *jingle_ft_stats_histogram(const JingleFTStats *st)
+{
+  GString *str = g_string_new(NULL);
+  guint b;
+
+  for (b = 0; b < JINGLE_FT_STATS_BUCKETS; b++) {
+    if (b + 1 < JINGLE_FT_STATS_BUCKETS)
+      g_string_append_printf(str, "%s<%ums:%" G_GUINT64_FORMAT,
+                             b ? " " : "", 1u << b, st->rtt[b]);
+    else
+      g_string_append_printf(str, " >=%ums:%" G_GUINT64_FORMAT,
+                             1u << (b - 1), st->rtt[b]);
+  }
+  return g_string_free(str, FALSE);
+}
+
+/**
+ * @brief Every counter as space separated key=value, times in
+ *        microseconds and rates in bytes per second
+ * @return a newly allocated string
+ */
+gchar *jingle_ft_stats_dump(const JingleFTStats *st,
+                            const gchar **statenames)
+{
+  GString *str = g_string_new(NULL);
+  guint i;
+
+  g_string_append_printf(str, "age=%" G_GINT64_FORMAT " active=%"
+                         G_GINT64_FORMAT, stats_end(st) - st->created,
+                         st->started ? stats_end(st) - st->started : 0);
+  for (i = 0; i < JINGLE_FT_STATS_STATES; i++)
+    g_string_append_printf(str, " time_%s=%" G_GINT64_FORMAT,
+                           statenames[i], jingle_ft_stats_state_time(st, i));
+  for (i = 0; i < JINGLE_FT_STAGES; i++)
+    g_string_append_printf(str, " %s=%" G_GUINT64_FORMAT, stage_names[i],
+                           st->bytes[i]);
+  g_string_append_printf(str, " read_time=%" G_GINT64_FORMAT
+                         " hash_time=%" G_GINT64_FORMAT
+                         " read_wait=%" G_GINT64_FORMAT
+                         " hash_wait=%" G_GINT64_FORMAT
+                         " write_time=%" G_GINT64_FORMAT,
+                         st->read_time, st->hash_time, st->read_wait,
+                         st->hash_wait, st->write_time);
+  g_string_append_printf(str, " rate=%.0f average=%.0f",
+                         jingle_ft_stats_rate(st),
+                         stats_moved(st) && st->started ?
+                         stats_moved(st) * 1e6 /
+                         MAX(stats_end(st) - st->started, 1) : 0.0);
+  g_string_append_printf(str, " rtt_count=%" G_GUINT64_FORMAT
+                         " rtt_avg=%" G_GINT64_FORMAT
+                         " rtt_max=%" G_GINT64_FORMAT " rtt=",
+                         st->rtt_count, st->rtt_count ?
+                         st->rtt_total / (gint64)st->rtt_count : 0,
+                         st->rtt_max);
+  for (i = 0; i < JINGLE_FT_STATS_BUCKETS; i++)
+    g_string_append_printf(str, "%s%" G_GUINT64_FORMAT, i ? "," : "",
+                           st->rtt[i]);
+  return g_string_free(str, FALSE);
+}
@@ -0,0 +1,121 @@
+#ifndef __JINGLEFT_STATS_H__
+#define __JINGLEFT_STATS_H__ 1
+
+/**
+ * \file stats.h
+ * \brief Counters and timings of a transfer, to find what slows it down
+ */
+
+#include <glib.h>
+
+/* One per JingleFTState */
+#define JINGLE_FT_STATS_STATES 5
+
+/* Round trips below 1 ms, then below 2, 4, 8... ms, the last bucket
+ * holding all the slower ones */
+#define JINGLE_FT_STATS_BUCKETS 12
+
+/* Microseconds over which the current rate is measured */
+#define JINGLE_FT_STATS_WINDOW 2000000
+
+/**
+ * \enum JingleFTStage
+ * \brief where the bytes of a file went through
+ */
+typedef enum {
+  JINGLE_FT_STAGE_READ, /*!< Read from the disk by the prefetch workers */
+  JINGLE_FT_STAGE_SENT, /*!< Handed to the transport */
+  JINGLE_FT_STAGE_WIRE, /*!< The same once compressed, or as received */
+  JINGLE_FT_STAGE_ACKED, /*!< The transport asked for more after them */
+  JINGLE_FT_STAGE_RECEIVED, /*!< Given to us by the transport */
+  JINGLE_FT_STAGE_WRITTEN, /*!< Out of our write buffer */
+  JINGLE_FT_STAGE_HASHED, /*!< Fed to the checksum by the workers */
+  JINGLE_FT_STAGE_VERIFIED, /*!< Part of a file whose hash matched */
+  JINGLE_FT_STAGES
+} JingleFTStage;
+
+/**
+ * \struct JingleFTStats
+ * \brief What a transfer did, and when. Times are monotonic, in
+ *        microseconds
+ */
+typedef struct {
+  /**
+   * When the transfer was created, first moved data, and ended
+   */
+  gint64 created;
+  gint64 started;
+  gint64 finished;
+
+  /**
+   * Time spent in each state, but the current one since state_since
+   */
+  guint state;
+  gint64 state_since;
+  gint64 state_time[JINGLE_FT_STATS_STATES];
+
+  /**
+   * Bytes of this attempt at each stage. A resumed beginning is only
+   * counted as hashed, when it is read back from the disk
+   */
+  guint64 bytes[JINGLE_FT_STAGES];
+
+  /**
+   * Time the workers spent reading the disk and hashing
+   */
+  gint64 read_time;
+  gint64 hash_time;
+
+  /**
+   * Time the main loop spent waiting for the disk, for the hash
+   * workers, and writing
+   */
+  gint64 read_wait;
+  gint64 hash_wait;
+  gint64 write_time;
+
+  /**
+   * When we started waiting for the prefetch workers, or 0
+   */
+  gint64 read_since;
+
+  /**
+   * The chunk the transport has not asked past yet, and since when
+   */
+  gsize inflight;
+  gint64 inflight_since;
+
+  /**
+   * Round trips of the chunks through the transport
+   */
+  guint64 rtt[JINGLE_FT_STATS_BUCKETS];
+  guint64 rtt_count;
+  gint64 rtt_total;
+  gint64 rtt_max;
+
+  /**
+   * Progress at the start of the current and previous windows, and
+   * the rate measured over the previous one, in bytes per second
+   */
+  gint64 window_start;
+  guint64 window_bytes;
+  gdouble rate;
+} JingleFTStats;
+
+void jingle_ft_stats_init(JingleFTStats *st, guint state);
+void jingle_ft_stats_state(JingleFTStats *st, guint state);
+void jingle_ft_stats_progress(JingleFTStats *st, JingleFTStage stage,
+                              guint64 len);
+void jingle_ft_stats_sent(JingleFTStats *st, gsize len);
+void jingle_ft_stats_acked(JingleFTStats *st);
+void jingle_ft_stats_read_wait(JingleFTStats *st, gboolean waiting);
+void jingle_ft_stats_finish(JingleFTStats *st);
+gint64 jingle_ft_stats_state_time(const JingleFTStats *st, guint state);
+gdouble jingle_ft_stats_rate(const JingleFTStats *st);
+gdouble jingle_ft_stats_average(const JingleFTStats *st, JingleFTStage stage);
+gint64 jingle_ft_stats_eta(const JingleFTStats *st, guint64 left);
+gchar *jingle_ft_stats_histogram(const JingleFTStats *st);
+gchar *jingle_ft_stats_dump(const JingleFTStats *st,
+                            const gchar **statenames);
+
+#endif
@@ -45,13 +45,17 @@ static JingleHandleStatus handle(JingleAction action, gconstpointer data,
                                  LmMessageNode *node, GError **err);
 static void tomessage(gconstpointer data, LmMessageNode *node);
 static gconstpointer new(void);
-static void send(session_content *sc, gconstpointer data, gchar *buf, gsize size);
+static void send(session_content *sc, gconstpointer data, const gchar *buf, gsize size);
 static void init(session_content *sc, gconstpointer data);
 static void end(session_content *sc, gconstpointer data);
 static gchar *info(gconstpointer data);
+static void stop(gconstpointer data);
+static gsize window(gconstpointer data);
 
-static void _send_internal(session_content *sc, const gchar *to, gchar *buf,
-                           gsize size, const gchar *sid, gint64 *seq);
+static void _send_internal(JingleIBB *jibb, const gchar *to, const gchar *buf,
+                           gsize size);
+static void _consume(JingleIBB *jibb, gsize size);
+static void _drain(JingleIBB *jibb, const gchar *to);
                            
 static void jingle_ibb_init(void);
 static void jingle_ibb_uninit(void);
@@ -70,7 +74,9 @@ static JingleTransportFuncs funcs = {
   .send           = send,
   .init           = init,
   .end            = end,
-  .info           = info
+  .info           = info,
+  .stop           = stop,
+  .window         = window
 };
 
 module_info_t  info_jingle_ibb = {
@@ -152,7 +158,7 @@ LmHandlerResult jingle_ibb_handle_iq(LmMessageHandler *handler,
                                  gpointer user_data)
 {
   const gchar *data64;
-  JingleIBB *jibb = g_new0(JingleIBB, 1), *jibb2;
+  JingleIBB *jibb2;
   gsize len;
   guchar *data;
   
@@ -177,14 +183,12 @@ LmHandlerResult jingle_ibb_handle_iq(LmMessageHandler *handler,
 
   jingle_ack_iq(message);
   
-  jibb->sid = g_strdup(lm_message_node_get_attribute(dnode, "sid"));
-  jibb->seq = g_ascii_strtoll(lm_message_node_get_attribute(dnode, "seq"), NULL, 10);
-  
   data64 = lm_message_node_get_value(dnode);
   
   data = g_base64_decode(data64, &len);
 
   handle_trans_data(jibb2, (const gchar *)data, (guint)len);
+  g_free(data);
   
   return LM_HANDLER_RESULT_REMOVE_MESSAGE;
 }
@@ -241,32 +245,34 @@ static void jingle_ibb_handle_ack_iq_send(JingleAckType type, LmMessage *mess,
                                           gpointer data)
 {
   // TODO: check the sub type (error ??)
-  session_content *sc = (session_content *)data;
+  JingleIBB *jibb = (JingleIBB *)data;
+  session_content *sc = jibb->sc;
+
+  jibb->ack = NULL;
   
   JingleSession *sess = session_find_by_sid(sc->sid, sc->from);
   
   // If there is no more session, maybe it's finish
   if (sess == NULL)
     return;
-  
-  SessionContent *sc2 = session_find_sessioncontent(sess, sc->name);
 
-  JingleIBB *jibb = (JingleIBB *)sc2->transport;
+  // The last blocks go one after the other
+  if (jibb->ending) {
+    _drain(jibb, sess->recipient);
+    return;
+  }
 
   // We look if there is enough data staying
-  if (jibb->dataleft > jibb->blocksize) {
-    gchar *buf = g_memdup(jibb->buf, jibb->blocksize);
-    jibb->dataleft-=jibb->blocksize;
-    g_memmove(jibb->buf, jibb->buf+jibb->blocksize, jibb->dataleft);
-    _send_internal(sc, sess->to, buf, jibb->blocksize, jibb->sid, &jibb->seq);
-    g_free(buf);
+  if (jibb->dataleft >= jibb->blocksize) {
+    _send_internal(jibb, sess->recipient, jibb->buf, jibb->blocksize);
+    _consume(jibb, jibb->blocksize);
   } else { // ask for more data
     handle_trans_next(sc);
   }
 }
 
-static void _send_internal(session_content *sc, const gchar *to, gchar *buf,
-                           gsize size, const gchar *sid, gint64 *seq)
+static void _send_internal(JingleIBB *jibb, const gchar *to, const gchar *buf,
+                           gsize size)
 {
   JingleAckHandle *ackhandle;
   LmMessage *r = lm_message_new_with_sub_type(to, LM_MESSAGE_TYPE_IQ,
@@ -274,44 +280,73 @@ static void _send_internal(session_content *sc, const gchar *to, gchar *buf,
   LmMessageNode *node = lm_message_get_node(r);
 
   gchar *base64 = g_base64_encode((const guchar *)buf, size);
-  gchar *strseq = g_strdup_printf("%" G_GINT64_FORMAT, *seq);
+  gchar *strseq = g_strdup_printf("%" G_GINT64_FORMAT, jibb->seq);
 
   node = lm_message_node_add_child(node, "data", NULL);
   lm_message_node_set_attributes(node, "xmlns", NS_TRANSPORT_IBB,
-                                 "sid", sid,
+                                 "sid", jibb->sid,
                                  "seq", strseq,
                                  NULL);
   lm_message_node_set_value(node, base64);
 
-  ackhandle = g_new0(JingleAckHandle, 1);
+  ackhandle = jingle_ack_handle_new();
   ackhandle->callback = jingle_ibb_handle_ack_iq_send;
-  ackhandle->user_data = (gpointer)sc;
+  ackhandle->user_data = (gpointer)jibb;
+  jibb->ack = ackhandle;
 
   lm_connection_send_with_reply(lconnection, r,
                                 jingle_new_ack_handler(ackhandle), NULL);
   lm_message_unref(r);
 
   // The next packet will be seq++
-  ++(*seq);
+  ++jibb->seq;
 
   g_free(base64);
   g_free(strseq);
 }
 
-static void send(session_content *sc, gconstpointer data, gchar *buf,
-                     gsize size)
+/**
+ * Keep data we cannot send yet at the end of our buffer.
+ */
+static void _keep(JingleIBB *jibb, const gchar *buf, gsize size)
 {
-  JingleIBB *jibb = (JingleIBB*)data;
-  
-  if (jibb->size_buf >= size + jibb->dataleft) {
-    g_memmove(jibb->buf + jibb->dataleft, buf, size);
-    jibb->dataleft+=size;
-  } else {
+  if (size == 0)
+    return;
+
+  if (jibb->size_buf < size + jibb->dataleft) {
     jibb->size_buf = size + jibb->dataleft;
     jibb->buf = g_realloc(jibb->buf, jibb->size_buf);
-    g_memmove(jibb->buf + jibb->dataleft, buf, size);
-    jibb->dataleft = jibb->size_buf;
   }
+  memcpy(jibb->buf + jibb->dataleft, buf, size);
+  jibb->dataleft += size;
+}
+
+/**
+ * Drop the first size bytes of our buffer, they were sent.
+ */
+static void _consume(JingleIBB *jibb, gsize size)
+{
+  jibb->dataleft -= size;
+  g_memmove(jibb->buf, jibb->buf + size, jibb->dataleft);
+}
+
+static void send(session_content *sc, gconstpointer data, const gchar *buf,
+                     gsize size)
+{
+  JingleIBB *jibb = (JingleIBB*)data;
+  JingleSession *sess;
+
+  jibb->sc = sc;
+
+  // Nothing kept from before, the block is encoded straight from buf
+  if (jibb->dataleft == 0 && size >= jibb->blocksize) {
+    sess = session_find_by_sid(sc->sid, sc->from);
+    _send_internal(jibb, sess->recipient, buf, jibb->blocksize);
+    _keep(jibb, buf + jibb->blocksize, size - jibb->blocksize);
+    return;
+  }
+
+  _keep(jibb, buf, size);
 
   // We need more data
   if (jibb->dataleft < jibb->blocksize) {
@@ -320,20 +355,9 @@ static void send(session_content *sc, gconstpointer data, gchar *buf,
   }
 
   // It's enough
-  {
-    JingleSession *sess = session_find_by_sid(sc->sid, sc->from);
-    
-    gchar *buffer = g_memdup(jibb->buf, jibb->blocksize);
-  
-    jibb->dataleft-=jibb->blocksize;
-  
-    g_memmove(jibb->buf, jibb->buf+jibb->blocksize, jibb->dataleft);
-  
-    _send_internal(sc, sess->to, buffer, jibb->blocksize, jibb->sid,
-                   &jibb->seq);
-  
-    g_free(buffer);
-  }
+  sess = session_find_by_sid(sc->sid, sc->from);
+  _send_internal(jibb, sess->recipient, jibb->buf, jibb->blocksize);
+  _consume(jibb, jibb->blocksize);
 }
 
 static void init(session_content *sc, gconstpointer data)
@@ -341,17 +365,68 @@ static void init(session_content *sc, gconstpointer data)
   return;
 }
 
+/**
+ * Send what is left of our buffer once the app has nothing more, a
+ * block per ack, and free it once it is empty.
+ */
+static void _drain(JingleIBB *jibb, const gchar *to)
+{
+  gsize size = MIN(jibb->dataleft, jibb->blocksize);
+
+  if (size > 0) {
+    _send_internal(jibb, to, jibb->buf, size);
+    _consume(jibb, size);
+    return;
+  }
+
+  g_free(jibb->buf);
+  jibb->buf = NULL;
+  jibb->size_buf = 0;
+}
+
 static void end(session_content *sc, gconstpointer data)
 {
   JingleIBB *jibb = (JingleIBB*)data;
   JingleSession *sess = session_find_by_sid(sc->sid, sc->from);
   
-  if (jibb->dataleft > 0) {
-    _send_internal(sc, sess->to, jibb->buf, jibb->dataleft, jibb->sid,
-                   &jibb->seq);
+  jibb->sc = sc;
+  jibb->ending = TRUE;
+
+  // The data may have waited in the scheduler and come at once, it
+  // still goes in blocks. The ack of the one in flight sends the next.
+  if (jibb->ack == NULL && sess != NULL)
+    _drain(jibb, sess->recipient);
+}
+
+/**
+ * We ask for just what is missing to fill the next block, so that
+ * most blocks are sent straight from the app's data.
+ */
+static gsize window(gconstpointer data)
+{
+  const JingleIBB *jibb = (const JingleIBB*)data;
+
+  if (jibb->dataleft >= jibb->blocksize)
+    return jibb->blocksize;
+  return jibb->blocksize - jibb->dataleft;
+}
+
+static void stop(gconstpointer data)
+{
+  JingleIBB *jibb = (JingleIBB*)data;
+
+  // The block in flight may be acked once we are gone
+  if (jibb->ack != NULL) {
+    jibb->ack->callback = NULL;
+    jibb->ack->user_data = NULL;
   }
-  
+
+  if (JingleIBBs != NULL && g_hash_table_lookup(JingleIBBs, jibb->sid) == jibb)
+    g_hash_table_steal(JingleIBBs, jibb->sid);
+
   g_free(jibb->buf);
+  g_free(jibb->sid);
+  g_free(jibb);
 }
 
 static void jingle_ibb_unregister_lm_handlers(void)
@@ -20,6 +20,15 @@ typedef struct {
   gint dataleft;
   
   gint64 seq;
+
+  /* The content we send data for */
+  session_content *sc;
+
+  /* Ack of the block in flight, if any */
+  JingleAckHandle *ack;
+
+  /* The app has nothing more, buf is sent a block at a time */
+  gboolean ending;
   
 } JingleIBB;
 
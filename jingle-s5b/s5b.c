@@ -48,10 +48,12 @@ static JingleHandleStatus handle(JingleAction action, gconstpointer data,
                                  LmMessageNode *node, GError **err);
 static void tomessage(gconstpointer data, LmMessageNode *node);
 static gconstpointer new(void);
-static void _send(session_content *sc, gconstpointer data, gchar *buf, gsize size);
+static void _send(session_content *sc, gconstpointer data, const gchar *buf, gsize size);
 static void init(session_content *sc, gconstpointer data);
 static void end(session_content *sc, gconstpointer data);
 static gchar *info(gconstpointer data);
+static void stop(gconstpointer data);
+static gsize window(gconstpointer data);
 
 static void connect_candidate(JingleS5B *js5b, S5BCandidate *cand);
 static void connect_next_candidate(JingleS5B *js5b, S5BCandidate *cand);
@@ -77,7 +79,9 @@ static JingleTransportFuncs funcs = {
   .send           = _send,
   .init           = init,
   .end            = end,
-  .info           = info
+  .info           = info,
+  .stop           = stop,
+  .window         = window
 };
 
 module_info_t  info_jingle_s5b = {
@@ -390,6 +394,7 @@ cleancontinue:
     g_socket_listener_accept_async(js5b->listener, NULL, handle_listener_accept, NULL);
   } else {
       g_object_unref(js5b->listener);
+      js5b->listener = NULL;
   }
 
   // Then, we start connecting to the other entity's candidates, if any.
@@ -410,7 +415,39 @@ static void free_after_connection(JingleS5B *js5b)
 {
   g_socket_listener_close(js5b->listener);
   g_object_unref(js5b->listener);
+  js5b->listener = NULL;
   g_object_unref(js5b->client);
+  js5b->client = NULL;
+}
+
+static void free_candidates(GSList *candidates)
+{
+  GSList *el;
+
+  for (el = candidates; el; el = el->next) {
+    S5BCandidate *cand = (S5BCandidate *)el->data;
+    g_free((gchar *)cand->cid);
+    g_free((gchar *)cand->jid);
+    if (cand->host != NULL)
+      g_object_unref(cand->host);
+    g_free(cand);
+  }
+  g_slist_free(candidates);
+}
+
+/**
+ * @brief Free what stop left: the candidates, the client and the struct
+ */
+static void free_js5b(JingleS5B *js5b)
+{
+  free_candidates(js5b->candidates);
+  free_candidates(js5b->ourcandidates);
+  if (js5b->client != NULL)
+    g_object_unref(js5b->client);
+  if (js5b->cancelconnect != NULL)
+    g_object_unref(js5b->cancelconnect);
+  g_free((gchar *)js5b->sid);
+  g_free(js5b);
 }
 
 /**
@@ -426,8 +463,8 @@ static gboolean connect_cancel_timeout(gpointer data)
   GPtrArray *args = (GPtrArray *)data;
   JingleS5B *js5b = g_ptr_array_index(args, 0);
   //S5BCandidate *cand = g_ptr_array_index(args, 1);
-  g_ptr_array_unref(args);
 
+  js5b->connect_timeout = 0;
   g_cancellable_cancel(js5b->cancelconnect);
   // we need to send a candidate-error in case we cannot connect.
   return FALSE;
@@ -437,7 +474,6 @@ static void connect_candidate(JingleS5B *js5b, S5BCandidate *cand)
 {
   GSocketAddress *saddr;
   GPtrArray *args;
-  guint eventid;
 
   args = g_ptr_array_sized_new(2);
   g_ptr_array_add(args, js5b);
@@ -446,8 +482,10 @@ static void connect_candidate(JingleS5B *js5b, S5BCandidate *cand)
   saddr = g_inet_socket_address_new(cand->host, cand->port);
   js5b->cancelconnect = g_cancellable_new();
 
-  eventid = g_timeout_add_seconds(5, connect_cancel_timeout, g_ptr_array_ref(args));
-  g_ptr_array_add(args, GUINT_TO_POINTER(eventid));
+  js5b->connect_timeout = g_timeout_add_seconds_full(G_PRIORITY_DEFAULT, 5,
+                            connect_cancel_timeout, g_ptr_array_ref(args),
+                            (GDestroyNotify)g_ptr_array_unref);
+  js5b->connecting = TRUE;
   g_socket_client_connect_async(js5b->client, G_SOCKET_CONNECTABLE(saddr),
                                 js5b->cancelconnect, handle_client_connect, args);
   g_object_unref(saddr);
@@ -481,6 +519,46 @@ static void end(session_content *sc, gconstpointer data) {
   return;
 }
 
+static gsize window(gconstpointer data)
+{
+  return JINGLE_S5B_WINDOW;
+}
+
+/**
+ * @brief Close our listening sockets and the established connection,
+ *        then free the transport
+ * 
+ * An ongoing connection attempt is cancelled. Its callback still
+ * references the struct, it is freed there in that case.
+ */
+static void stop(gconstpointer data)
+{
+  JingleS5B *js5b = (JingleS5B *)data;
+
+  js5b->stopped = TRUE;
+  if (js5b->connect_timeout != 0) {
+    g_source_remove(js5b->connect_timeout);
+    js5b->connect_timeout = 0;
+  }
+  if (js5b->cancelconnect != NULL)
+    g_cancellable_cancel(js5b->cancelconnect);
+
+  if (js5b->listener != NULL) {
+    g_socket_listener_close(js5b->listener);
+    g_object_unref(js5b->listener);
+    js5b->listener = NULL;
+  }
+
+  if (js5b->connection != NULL) {
+    g_io_stream_close(G_IO_STREAM(js5b->connection), NULL, NULL);
+    g_object_unref(js5b->connection);
+    js5b->connection = NULL;
+  }
+
+  if (!js5b->connecting)
+    free_js5b(js5b);
+}
+
 /**
  * @brief Handle incoming connections
  */
@@ -512,14 +590,25 @@ handle_client_connect(GObject *_client, GAsyncResult *res, gpointer data)
   g_ptr_array_unref(args);
 
   conn = g_socket_client_connect_finish(G_SOCKET_CLIENT(_client), res, &err);
+  js5b->connecting = FALSE;
+
+  // the time limit was not reached, it does not need to cancel us anymore
+  if (js5b->connect_timeout != 0) {
+    g_source_remove(js5b->connect_timeout);
+    js5b->connect_timeout = 0;
+  }
+
+  // stop was called meanwhile, we are the last one to use js5b
+  if (js5b->stopped) {
+    if (conn != NULL)
+      g_object_unref(conn);
+    if (err != NULL)
+      g_error_free(err);
+    free_js5b(js5b);
+    return;
+  }
 
   if (!g_error_matches(err, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
-    // if we did not received a CANCELLED error, then the time limit was not
-    // reached and we need to clean up the GSource and unref args a second time.
-    guint eventid = GPOINTER_TO_UINT(g_ptr_array_index(args, 2));
-    GSource *s = g_main_context_find_source_by_id(NULL, eventid);
-    g_source_destroy(s);
-    g_ptr_array_unref(args);
     connect_next_candidate(js5b, cand);
     return;
   }
@@ -541,7 +630,7 @@ handle_client_connect(GObject *_client, GAsyncResult *res, gpointer data)
   // TODO: send transport-info activated IQ
 }
 
-static void _send(session_content *sc, gconstpointer data, gchar *buf, gsize size)
+static void _send(session_content *sc, gconstpointer data, const gchar *buf, gsize size)
 {
   return;
 }
@@ -6,6 +6,9 @@
 
 #define NS_JINGLE_TRANSPORT_SOCKS5 "urn:xmpp:jingle:transports:s5b:1"
 
+/* Bytes we take at once from an app, a stream needs no small blocks */
+#define JINGLE_S5B_WINDOW 262144
+
 
 typedef enum {
   JINGLE_S5B_DIRECT,
@@ -28,6 +31,15 @@ typedef struct {
 
   GCancellable *cancelconnect;
 
+  /* The source cancelling the connection attempt after 5 seconds */
+  guint connect_timeout;
+
+  /* A connection attempt is running: its callback still uses us */
+  gboolean connecting;
+
+  /* The content is gone, free us once the attempt is over */
+  gboolean stopped;
+
   GSocketListener *listener;
 
   GSocketClient *client;
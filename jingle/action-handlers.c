@@ -50,6 +50,7 @@ void handle_session_initiate(JingleNode *jn)
   const gchar *xmlns;
   JingleAppFuncs *appfuncs;
   JingleTransportFuncs *transfuncs;
+  guint shown = 0;
 
   // Make sure the request come from an user in our roster
   disp = jidtodisp(lm_message_get_from(jn->message));
@@ -137,10 +138,20 @@ void handle_session_initiate(JingleNode *jn)
   scr_LogPrint(LPRINT_LOGNORM, "%s", sbuf);
   g_free(sbuf);
 
-  for (child = sess->content; child; child = child->next) {
+  for (child = sess->content; child; child = child->next, shown++) {
     SessionContent *sc = (SessionContent *)child->data;
-    gchar *app_info = sc->appfuncs->info(sc->description);
-    gchar *trans_info = sc->transfuncs->info(sc->transport);
+    gchar *app_info, *trans_info;
+
+    // A whole directory may come at once
+    if (shown == JINGLE_INVITATION_LINES && child->next != NULL) {
+      sbuf = g_strdup_printf("and %u more", g_slist_length(child));
+      scr_WriteIncomingMessage(disp, sbuf, 0, HBB_PREFIX_INFO, 0);
+      scr_LogPrint(LPRINT_LOGNORM, "%s", sbuf);
+      g_free(sbuf);
+      break;
+    }
+    app_info = sc->appfuncs->info(sc->description);
+    trans_info = sc->transfuncs->info(sc->transport);
     sbuf = g_strdup_printf("%s using %s", app_info, trans_info);
     scr_WriteIncomingMessage(disp, sbuf, 0, HBB_PREFIX_INFO, 0);
     scr_LogPrint(LPRINT_LOGNORM, "%s", sbuf);
@@ -156,9 +167,10 @@ void handle_session_initiate(JingleNode *jn)
 
     id = evs_new(desc, NULL, 0, evscallback_jingle, sess, NULL);
     g_free(desc);
-    if (id)
+    if (id) {
+      sess->evid = jingle_arena_strdup(sess->arena, id);
       sbuf = g_strdup_printf("Please use /event %s accept|reject", id);
-    else
+    } else
       sbuf = g_strdup_printf("Unable to create a new event!");
     scr_WriteIncomingMessage(disp, sbuf, 0, HBB_PREFIX_INFO, 0);
     scr_LogPrint(LPRINT_LOGNORM, "%s", sbuf);
@@ -196,7 +208,8 @@ void handle_session_info(JingleNode *jn)
       continue;
 
     if (sc->appfuncs->handle(JINGLE_SESSION_INFO, sc->description,
-                             jn->node->children, NULL)) {
+                             jn->node->children, NULL)
+        == JINGLE_STATUS_HANDLED) {
       jingle_ack_iq(jn->message);
       return;
     }
@@ -214,7 +227,6 @@ void handle_session_accept(JingleNode *jn)
   JingleSession *sess;
   JingleContent *jc;
   SessionContent *sc;
-  session_content *sc2 = g_new0(session_content, 1);
   GError *err = NULL;
   GSList *el;
   const gchar *from = lm_message_get_from(jn->message);
@@ -235,39 +247,59 @@ void handle_session_accept(JingleNode *jn)
 
   jingle_ack_iq(jn->message);
 
-  sc2->sid  = sess->sid;
-  sc2->from = (sess->origin == JINGLE_SESSION_INCOMING) ? sess->from : sess->to;
-
   for (el = jn->content; el; el = el->next) {
     jc = (JingleContent*)el->data;
-    sc2->name = jc->name;
     sc = session_find_sessioncontent(sess, jc->name);
     if (sc == NULL) continue;
+    // The responder may have changed the description, e.g. with a range
+    if (sc->appfuncs->handle != NULL &&
+        sc->appfuncs->handle(JINGLE_SESSION_ACCEPT, sc->description,
+                             jc->description, &err)
+        == JINGLE_STATUS_HANDLE_ERROR) {
+      scr_log_print(LPRINT_DEBUG, "jingle: cannot accept %s (%s)", jc->name,
+                    err ? err->message : "");
+      if (err != NULL) {
+        g_error_free(err);
+        err = NULL;
+      }
+      if (!session_remove_sessioncontent(sess, jc->name)) {
+        jingle_send_session_terminate(sess, "failed-application");
+        session_delete(sess);
+        return;
+      }
+      continue;
+    }
     session_changestate_sessioncontent(sess, jc->name,
                                        JINGLE_SESSION_STATE_ACTIVE);
     sc->transfuncs->handle(JINGLE_SESSION_ACCEPT, sc->transport, jc->transport, NULL);
-    sc->transfuncs->init(sc2, sc->transport);
+    sc->transfuncs->init(&sc->handle, sc->transport);
   }
 }
 
 void handle_transport_initialize(int correct, session_content *sc2)
 {
   JingleSession *sess = session_find_by_sid(sc2->sid, sc2->from);
-  SessionContent *sc = session_find_sessioncontent(sess, sc2->name);
+  SessionContent *sc;
+
+  if (sess == NULL)
+    return;
+
+  sc = session_find_sessioncontent(sess, sc2->name);
+  if (sc == NULL)
+    return;
 
   if(!correct) {
     scr_log_print(LPRINT_DEBUG, "Delete %s!", sc->name);
     session_remove_sessioncontent(sess, sc->name);
-    gfree(sc2);
     return;
   }
-  sc->appfuncs->start(sc2);
+  sc->appfuncs->start(&sc->handle);
 }
 
 void handle_session_terminate(JingleNode *jn)
 {
   JingleSession *sess;
-  GSList *el;
+  GSList *el, *next;
   SessionContent *sc;
 
   if ((sess = session_find(jn)) == NULL) {
@@ -275,7 +307,8 @@ void handle_session_terminate(JingleNode *jn)
     return;
   }
 
-  for (el = sess->content; el; el = el->next) {
+  for (el = sess->content; el; el = next) {
+    next = el->next; // the content and its link are freed below
     sc = (SessionContent*)el->data;
     if (!g_strcmp0(lm_message_get_from(jn->message),
                    (sess->origin == JINGLE_SESSION_INCOMING) ? sess->from : sess->to))
@@ -4,6 +4,9 @@
 #include <glib.h>
 #include <loudmouth/loudmouth.h>
 
+/* Contents of an invitation described to the user, one line each */
+#define JINGLE_INVITATION_LINES 10
+
 void handle_content_accept(JingleNode *jn);
 void handle_content_add(JingleNode *jn);
 void handle_content_reject(JingleNode *jn);
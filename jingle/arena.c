@@ -0,0 +1,137 @@
+/*
+ * arena.c
+ *
+ * Copyright (C) 2026 mcabber-jingle contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+#include <glib.h>
+#include <string.h>
+
+#include <jingle/arena.h>
+
+/* Every allocation is aligned on this boundary */
+#define ARENA_ALIGN (2 * sizeof(gpointer))
+#define ARENA_ROUND(size) (((size) + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1))
+
+typedef struct _JingleArenaBlock JingleArenaBlock;
+
+struct _JingleArenaBlock {
+  JingleArenaBlock *next;
+  gsize size;
+  gsize used;
+};
+
+struct _JingleArena {
+  /* The block we allocate from, followed by the older ones */
+  JingleArenaBlock *blocks;
+
+  /* Size of the blocks we add when the current one is full */
+  gsize block_size;
+
+  /* Total size of the blocks, headers included */
+  gsize total;
+};
+
+#define ARENA_HEADER ARENA_ROUND(sizeof(struct _JingleArena))
+#define BLOCK_HEADER ARENA_ROUND(sizeof(JingleArenaBlock))
+#define BLOCK_DATA(block) ((gchar *)(block) + BLOCK_HEADER)
+
+
+/**
+ * @param block_size The size of the first block and of the following ones
+ * @return           A new arena, to be freed with #jingle_arena_free
+ * 
+ * The arena and its first block are allocated at once.
+ */
+JingleArena *jingle_arena_new(gsize block_size)
+{
+  JingleArena *arena;
+
+  block_size = ARENA_ROUND(block_size);
+  arena = g_malloc(ARENA_HEADER + BLOCK_HEADER + block_size);
+  arena->block_size = block_size;
+  arena->total = ARENA_HEADER + BLOCK_HEADER + block_size;
+  arena->blocks = (JingleArenaBlock *)((gchar *)arena + ARENA_HEADER);
+  arena->blocks->next = NULL;
+  arena->blocks->size = block_size;
+  arena->blocks->used = 0;
+
+  return arena;
+}
+
+/**
+ * @return size bytes of zeroed memory, owned by the arena
+ */
+gpointer jingle_arena_alloc0(JingleArena *arena, gsize size)
+{
+  JingleArenaBlock *block = arena->blocks;
+  gpointer mem;
+
+  size = ARENA_ROUND(size);
+  if (block->size - block->used < size) {
+    gsize bsize = MAX(size, arena->block_size);
+    block = g_malloc(BLOCK_HEADER + bsize);
+    block->size = bsize;
+    block->used = 0;
+    block->next = arena->blocks;
+    arena->blocks = block;
+    arena->total += BLOCK_HEADER + bsize;
+  }
+
+  mem = BLOCK_DATA(block) + block->used;
+  block->used += size;
+
+  return memset(mem, 0, size);
+}
+
+gchar *jingle_arena_strdup(JingleArena *arena, const gchar *str)
+{
+  gsize len;
+
+  if (str == NULL)
+    return NULL;
+
+  len = strlen(str) + 1;
+  return memcpy(jingle_arena_alloc0(arena, len), str, len);
+}
+
+/**
+ * @return The number of bytes the arena took from the heap
+ */
+gsize jingle_arena_size(const JingleArena *arena)
+{
+  return arena->total;
+}
+
+/**
+ * Release the arena and everything allocated from it.
+ */
+void jingle_arena_free(JingleArena *arena)
+{
+  JingleArenaBlock *block, *next, *first;
+
+  if (arena == NULL)
+    return;
+
+  first = (JingleArenaBlock *)((gchar *)arena + ARENA_HEADER);
+  for (block = arena->blocks; block != first; block = next) {
+    next = block->next;
+    g_free(block);
+  }
+  g_free(arena);
+}
@@ -0,0 +1,29 @@
+/**
+ * @file arena.h
+ * @brief arena.c header file
+ */
+
+#ifndef __JINGLE_ARENA_H__
+#define __JINGLE_ARENA_H__ 1
+
+#include <glib.h>
+
+/**
+ * @brief A bump allocator
+ * 
+ * Memory taken from an arena cannot be freed piece by piece, everything
+ * is released at once by #jingle_arena_free. Use it for groups of small
+ * objects sharing the same lifetime.
+ */
+typedef struct _JingleArena JingleArena;
+
+#define jingle_arena_new0(arena, type) \
+  ((type *) jingle_arena_alloc0((arena), sizeof(type)))
+
+JingleArena *jingle_arena_new(gsize block_size);
+gpointer jingle_arena_alloc0(JingleArena *arena, gsize size);
+gchar *jingle_arena_strdup(JingleArena *arena, const gchar *str);
+gsize jingle_arena_size(const JingleArena *arena);
+void jingle_arena_free(JingleArena *arena);
+
+#endif
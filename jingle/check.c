@@ -29,7 +29,8 @@
 #include <jingle/jingle.h>
 #include <jingle/register.h>
 
-static JingleContent *check_content(LmMessageNode *node, GError **err);
+static JingleContent *check_content(JingleArena *arena, LmMessageNode *node,
+                                    GError **err);
 gint index_in_array(const gchar *str, const gchar **array);
 
 
@@ -105,9 +106,10 @@ gboolean check_jingle(LmMessage *message, LmMessageNode *node,
   return TRUE;
 }
 
-static JingleContent *check_content(LmMessageNode *node, GError **err)
+static JingleContent *check_content(JingleArena *arena, LmMessageNode *node,
+                                    GError **err)
 {
-  JingleContent *cn = g_new0(JingleContent, 1);
+  JingleContent *cn = jingle_arena_new0(arena, JingleContent);
   const gchar *creatorstr, *sendersstr;
   gint tmp, tmp2;
 
@@ -119,7 +121,6 @@ static JingleContent *check_content(LmMessageNode *node, GError **err)
   if (cn->name == NULL) {
     g_set_error(err, JINGLE_CHECK_ERROR, JINGLE_CHECK_ERROR_MISSING,
                 "the name attribute of the content element is missing");
-    g_free(cn);
     return NULL;
   }
   
@@ -141,7 +142,6 @@ static JingleContent *check_content(LmMessageNode *node, GError **err)
     if (tmp2 < 0) {
       g_set_error(err, JINGLE_CHECK_ERROR, JINGLE_CHECK_ERROR_BADVALUE,
                   "the senders attribute is invalid");
-      g_free(cn);
       return NULL;
     }
     cn->senders = (JingleSenders)tmp2;
@@ -152,7 +152,6 @@ static JingleContent *check_content(LmMessageNode *node, GError **err)
   if (cn->description == NULL || cn->transport == NULL) {
      g_set_error(err, JINGLE_CHECK_ERROR, JINGLE_CHECK_ERROR_MISSING,
                  "a child element of content is missing");
-     g_free(cn);
      return NULL;
    }
 
@@ -170,18 +169,23 @@ gboolean check_contents(JingleNode *jn, GError **err)
 {
   LmMessageNode *child = NULL;
   JingleContent *cn;
+  GSList *link, *last = NULL;
 
+  // the links come from the arena, a failure only has to forget them
   for (child = jn->node->children; child; child = child->next) {
     if (!g_strcmp0(child->name, "content")) {
-      cn = check_content(child, err);
+      cn = check_content(jn->arena, child, err);
       if(cn == NULL) {
-        if(jn->content != NULL) {
-          g_slist_foreach(jn->content, (GFunc)g_free, NULL);
-          g_slist_free(jn->content);
-        }
+        jn->content = NULL;
         return FALSE;
       }
-      jn->content = g_slist_append(jn->content, cn);
+      link = jingle_arena_new0(jn->arena, GSList);
+      link->data = cn;
+      if (last == NULL)
+        jn->content = link;
+      else
+        last->next = link;
+      last = link;
     }
   }
   return TRUE;
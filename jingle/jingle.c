@@ -22,6 +22,7 @@
 #include <config.h>
 
 #include <glib.h>
+#include <string.h>
 #include <loudmouth/loudmouth.h>
 
 #include <mcabber/xmpp.h>
@@ -38,6 +39,7 @@
 #include <jingle/register.h>
 #include <jingle/send.h>
 #include <jingle/sessions.h>
+#include <jingle/sched.h>
 
 static void  jingle_register_lm_handlers(void);
 static void  jingle_unregister_lm_handlers(void);
@@ -49,10 +51,14 @@ static void  jingle_init(void);
 static void  jingle_uninit(void);
 
 static LmMessageHandler* jingle_iq_handler = NULL;
-static GSList *ack_handlers = NULL;
+static GQueue ack_wheel[JINGLE_ACK_WHEEL_SLOTS];
+static GQueue ack_pool = G_QUEUE_INIT;
+static guint ack_pending = 0;
+static gint64 ack_wheel_tick = 0;
 static guint ack_timeout_checker = 0;
 static guint connect_hid = 0;
 static guint disconn_hid = 0;
+static GHashTable *action_index = NULL;
 
 
 /**
@@ -102,7 +108,7 @@ LmHandlerResult jingle_handle_iq(LmMessageHandler *handler,
   if (iqtype != LM_MESSAGE_SUB_TYPE_SET)
     return LM_HANDLER_RESULT_ALLOW_MORE_HANDLERS;
 
-  JingleNode *jn = g_new0(JingleNode, 1);
+  JingleNode *jn;
   GError *error = NULL;
   LmMessageNode *root = lm_message_get_node(message);
   LmMessageNode *jnode = lm_message_node_get_child(root, "jingle");
@@ -116,6 +122,7 @@ LmHandlerResult jingle_handle_iq(LmMessageHandler *handler,
     return LM_HANDLER_RESULT_REMOVE_MESSAGE;
   }
 
+  jn = jingle_new_jinglenode();
   check_jingle(message, jnode, jn, &error);
   if (error != NULL) {
     if (error->domain == JINGLE_CHECK_ERROR) {
@@ -137,6 +144,7 @@ LmHandlerResult jingle_handle_iq(LmMessageHandler *handler,
     return LM_HANDLER_RESULT_REMOVE_MESSAGE;
   }
 
+  session_touch(session_find(jn));
   jingle_action_list[jn->action].handler(jn);
   jingle_free_jinglenode(jn);
   return LM_HANDLER_RESULT_REMOVE_MESSAGE;
@@ -161,32 +169,89 @@ LmHandlerResult jingle_handle_ack_iq(LmMessageHandler *handler,
   return LM_HANDLER_RESULT_REMOVE_MESSAGE;
 }
 
+static gint64 jingle_ack_now(void)
+{
+  return g_get_monotonic_time() / 1000;
+}
+
+static void jingle_ack_unlink(JingleAckHandle *ah)
+{
+  if (ah->_queue == NULL)
+    return;
+
+  g_queue_unlink(ah->_queue, &ah->_link);
+  if (ah->_queue >= ack_wheel && ah->_queue < ack_wheel + JINGLE_ACK_WHEEL_SLOTS)
+    --ack_pending;
+  ah->_queue = NULL;
+}
+
+/**
+ * Expire the handlers of every slot between the last tick we
+ * processed and now. Handlers whose deadline is more than one turn
+ * of the wheel away stay in their slot until a later turn.
+ */
 gboolean jingle_ack_timeout_checker(gpointer user_data)
 {
-  GSList *el, *prev;
-  time_t now = time(NULL);
+  GQueue expired = G_QUEUE_INIT;
+  GList *link, *next;
+  JingleAckHandle *ah;
+  gint64 now = jingle_ack_now();
+  gint64 tick = now / JINGLE_ACK_WHEEL_TICK;
+  guint turns = 0;
+
+  for (; ack_wheel_tick < tick && turns < JINGLE_ACK_WHEEL_SLOTS; turns++) {
+    GQueue *slot = &ack_wheel[++ack_wheel_tick % JINGLE_ACK_WHEEL_SLOTS];
+
+    for (link = slot->head; link; link = next) {
+      next = link->next;
+      ah = link->data;
+      if (ah->_deadline > now)
+        continue;
+
+      jingle_ack_unlink(ah);
+      g_queue_push_tail_link(&expired, &ah->_link);
+      ah->_queue = &expired;
+    }
+  }
+  ack_wheel_tick = tick;
 
-  el = prev = ack_handlers;
-  while(el) {
-    JingleAckHandle *ah = el->data;
+  // A callback may free another expired handler, so pop them one by one
+  while ((link = g_queue_peek_head_link(&expired)) != NULL) {
+    ah = link->data;
+    g_queue_unlink(&expired, link);
+    ah->_queue = NULL;
 
-    if (ah->timeout != 0 && ah->_inserted + ah->timeout <= now) {
-      if (ah->callback != NULL) {
-        ah->callback(JINGLE_ACK_TIMEOUT, NULL, ah->user_data);
-      }
+    // Too late: loudmouth must not call us if the reply arrives now
+    lm_message_handler_invalidate(ah->_handler);
+    if (ah->callback != NULL)
+      ah->callback(JINGLE_ACK_TIMEOUT, NULL, ah->user_data);
 
-      jingle_ack_handler_free(ah);
-      if (ack_handlers == NULL)
-        break;
+    jingle_ack_handler_free(ah);
+  }
 
-      el = prev;
-    }
-    prev = el;
-    el = el->next;
+  if (ack_pending == 0) {
+    ack_timeout_checker = 0;
+    return FALSE;
   }
   return TRUE;
 }
 
+/**
+ * @return A zeroed JingleAckHandle, taken from the pool if possible
+ */
+JingleAckHandle *jingle_ack_handle_new(void)
+{
+  GList *link = g_queue_pop_head_link(&ack_pool);
+  JingleAckHandle *ah;
+
+  if (link == NULL)
+    return g_new0(JingleAckHandle, 1);
+
+  ah = link->data;
+  memset(ah, 0, sizeof(JingleAckHandle));
+  return ah;
+}
+
 /**
  * @param ah A JingleAckHandle struct
  * @return   The LmMessageHandler to use when sending a message
@@ -194,24 +259,53 @@ gboolean jingle_ack_timeout_checker(gpointer user_data)
  * 
  * jingle_new_ack_handler allow to easily create new LmMessageHandler to
  * be called back when a message we sent was acknowledged by its recipient.
+ * If ah->timeout is not 0, the handler is put in a timer wheel; it can be
+ * inserted and removed in constant time.
  */
 LmMessageHandler *jingle_new_ack_handler(JingleAckHandle *ah)
 {
-  if(ack_timeout_checker == 0)
-      ack_timeout_checker = g_timeout_add_seconds(3, jingle_ack_timeout_checker, NULL);
-  
-  ah->_inserted = time(NULL);
+  gint64 now, tick;
+
   ah->_handler = lm_message_handler_new(jingle_handle_ack_iq,
                                         (gpointer) ah, NULL);
-  ack_handlers = g_slist_append(ack_handlers, ah);
+  ah->_link.data = ah;
+
+  if (ah->timeout == 0)
+    return ah->_handler;
+
+  now = jingle_ack_now();
+  if (ack_pending == 0)
+    ack_wheel_tick = now / JINGLE_ACK_WHEEL_TICK;
+
+  ah->_deadline = now + (gint64)ah->timeout * 1000;
+  // Rounded up: once the wheel reaches this slot, the deadline is past,
+  // otherwise the handler would wait there for a whole turn more
+  tick = (ah->_deadline + JINGLE_ACK_WHEEL_TICK - 1) / JINGLE_ACK_WHEEL_TICK;
+  tick = MAX(tick, ack_wheel_tick + 1);
+  ah->_queue = &ack_wheel[tick % JINGLE_ACK_WHEEL_SLOTS];
+  g_queue_push_tail_link(ah->_queue, &ah->_link);
+  ++ack_pending;
+
+  if (ack_timeout_checker == 0)
+    ack_timeout_checker = g_timeout_add(JINGLE_ACK_WHEEL_TICK,
+                                        jingle_ack_timeout_checker, NULL);
   return ah->_handler;
 }
 
 void jingle_ack_handler_free(JingleAckHandle *ah)
 {
+  jingle_ack_unlink(ah);
   lm_message_handler_unref(ah->_handler);
-  ack_handlers = g_slist_remove(ack_handlers, ah);
-  g_free(ah);
+  if (ah->destroy != NULL)
+    ah->destroy(ah->user_data);
+
+  if (ack_pool.length >= JINGLE_ACK_POOL_MAX) {
+    g_free(ah);
+    return;
+  }
+  ah->_link.data = ah;
+  g_queue_push_head_link(&ack_pool, &ah->_link);
+  ah->_queue = &ack_pool;
 }
 
 /**
@@ -221,39 +315,44 @@ gboolean evscallback_jingle(guint evcontext, const gchar *arg,
                             gpointer userdata)
 {
   JingleSession *js = (JingleSession*)userdata;
+  GSList *el;
 
-  /*
-  if (G_UNLIKELY(!jn)) {
-    scr_LogPrint(LPRINT_LOGNORM, "Error in evs callback.");
+  // The session is being freed and dropped its event itself
+  if (js->evid == NULL)
     return FALSE;
-  }
-  */
+  // Whatever happens, the event is gone once we return
+  js->evid = NULL;
 
   if (evcontext == EVS_CONTEXT_TIMEOUT) {
     scr_LogPrint(LPRINT_LOGNORM, "Jingle event from %s timed out, cancelled.",
                  js->from);
+    session_terminate(js, "timeout");
     return FALSE;
   }
   if (evcontext == EVS_CONTEXT_CANCEL) {
     scr_LogPrint(LPRINT_LOGNORM, "Jingle event from %s cancelled.",
                  js->from);
+    session_terminate(js, "cancel");
     return FALSE;
   }
   if (!(evcontext == EVS_CONTEXT_ACCEPT || evcontext == EVS_CONTEXT_REJECT)) {
     scr_LogPrint(LPRINT_LOGNORM, "Jingle event from %s cancelled.",
                  js->from);
+    session_terminate(js, "cancel");
     return FALSE;
   }
   
   if (evcontext == EVS_CONTEXT_ACCEPT) {
     scr_LogPrint(LPRINT_LOGNORM, "Jingle event from %s accepted.",
                  js->from);
-    jingle_send_session_accept(js);
+    for (el = js->content; el; el = el->next)
+      ((SessionContent*)el->data)->state = JINGLE_SESSION_STATE_ACTIVE;
+    session_touch(js);
+    session_accept(js);
   } else {
     scr_LogPrint(LPRINT_LOGNORM, "Jingle event from %s cancelled.",
                  js->from);
-    jingle_send_session_terminate(js, "decline");
-    
+    session_terminate(js, "decline");
   }
 
   return FALSE;
@@ -381,11 +480,35 @@ gchar *jingle_find_compatible_res(const gchar *jid, const gchar *ns[])
 JingleAction jingle_action_from_str(const gchar *string)
 {
   guint i, actstrlen = sizeof(jingle_action_list)/sizeof(jingle_action_list[0]);
-  for (i = 0; i < actstrlen; i++)
-    if (!g_strcmp0(jingle_action_list[i].name, string))
-      return (JingleAction) i;
 
-  return JINGLE_UNKNOWN_ACTION;
+  if (string == NULL)
+    return JINGLE_UNKNOWN_ACTION;
+
+  // JINGLE_UNKNOWN_ACTION is 0, so a failed lookup returns it
+  if (action_index == NULL) {
+    action_index = g_hash_table_new(g_str_hash, g_str_equal);
+    for (i = 1; i < actstrlen; i++)
+      g_hash_table_insert(action_index, (gpointer) jingle_action_list[i].name,
+                          GINT_TO_POINTER(i));
+  }
+
+  return (JingleAction) GPOINTER_TO_INT(g_hash_table_lookup(action_index,
+                                                            string));
+}
+
+/**
+ * @brief Create an empty JingleNode
+ * 
+ * The JingleNode is the first object of a new arena, the parsing of
+ * the IQ (see check.c) allocates everything else from the same arena.
+ */
+JingleNode *jingle_new_jinglenode(void)
+{
+  JingleArena *arena = jingle_arena_new(JINGLE_NODE_ARENA_SIZE);
+  JingleNode *jn = jingle_arena_new0(arena, JingleNode);
+
+  jn->arena = arena;
+  return jn;
 }
 
 /**
@@ -393,14 +516,13 @@ JingleAction jingle_action_from_str(const gchar *string)
  * 
  * Since the JingleNode contains only pointers to the attributes
  * and nodes of the LmMessage, we only have to unref the LmMessage
- * and free() the struct itself to destroy it.
+ * and release the arena to destroy it.
  */
 void jingle_free_jinglenode(JingleNode *jn)
 {
-  g_slist_foreach(jn->content, (GFunc)g_free, NULL);
-  g_slist_free(jn->content);
-  lm_message_unref(jn->message);
-  g_free(jn);
+  if (jn->message != NULL)
+    lm_message_unref(jn->message);
+  jingle_arena_free(jn->arena);
 }
 
 /**
@@ -451,6 +573,7 @@ static void jingle_init(void)
   disconn_hid = hk_add_handler(jingle_disconn_hh, HOOK_PRE_DISCONNECT,
       G_PRIORITY_DEFAULT_IDLE, NULL);
   jingle_register_lm_handlers();
+  jingle_sched_init();
 }
 
 static void jingle_uninit(void)
@@ -464,9 +587,36 @@ static void jingle_uninit(void)
   lm_message_handler_invalidate(jingle_iq_handler);
   lm_message_handler_unref(jingle_iq_handler);
 
+  if (action_index != NULL) {
+    g_hash_table_destroy(action_index);
+    action_index = NULL;
+  }
+
+  session_reaper_stop();
+  jingle_sched_uninit();
+
   if (ack_timeout_checker != 0) {
     GSource *s = g_main_context_find_source_by_id(NULL, ack_timeout_checker);
     g_source_destroy(s);
+    ack_timeout_checker = 0;
+  }
+
+  // Forget pending handlers, their callbacks may live in unloaded modules
+  {
+    guint i;
+    GList *link;
+    for (i = 0; i < JINGLE_ACK_WHEEL_SLOTS; i++)
+      while ((link = g_queue_pop_head_link(&ack_wheel[i])) != NULL) {
+        JingleAckHandle *ah = link->data;
+        lm_message_handler_invalidate(ah->_handler);
+        lm_message_handler_unref(ah->_handler);
+        if (ah->destroy != NULL)
+          ah->destroy(ah->user_data);
+        g_free(ah);
+      }
+    ack_pending = 0;
+    while ((link = g_queue_pop_head_link(&ack_pool)) != NULL)
+      g_free(link->data);
   }
 }
 
@@ -476,6 +626,7 @@ void handle_trans_data(gconstpointer data, const gchar *data2, guint len)
   if (sc == NULL) {
     return;  
   }
+  session_touch(sc->session);
   sc->appfuncs->handle_data(sc->description, data2, len);
 }
 
@@ -487,10 +638,10 @@ void handle_trans_next(session_content *sc2) {
   }
   
   SessionContent *sc = session_find_sessioncontent(sess, sc2->name);
+  if (sc == NULL)
+    return;
   
-  // TODO: size!
-  sc->appfuncs->send(sc2);
-  g_free(sc2);
+  sc->appfuncs->send(&sc->handle);
 }
 
 gchar *jingle_generate_sid(void)
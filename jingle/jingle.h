@@ -10,12 +10,17 @@
 #include <glib.h>
 #include <loudmouth/loudmouth.h>
 
+#include <jingle/arena.h>
+
 
 /** Jingle namespace */
 #define NS_JINGLE "urn:xmpp:jingle:1"
 /** Jingle Errors namespace */
 #define NS_JINGLE_ERRORS "urn:xmpp:jingle:errors:1"
 
+/** Size of the arena blocks used to parse an incoming jingle IQ */
+#define JINGLE_NODE_ARENA_SIZE 1024
+
 /**
  * @enum JingleAction
  * @brief Jingle actions constants
@@ -58,6 +63,13 @@ typedef enum {
  * It should be destroyed as soon as it is not needed using #jingle_free_jinglenode
  */
 typedef struct {
+  /**
+   * @brief Arena holding this struct, the JingleContent and the links of
+   * the content list
+   */
+  JingleArena *arena;
+
+
   /**
    * @brief Pointer to the original LmMessage
    */
@@ -97,6 +109,9 @@ typedef struct {
 
   /**
    * @brief Linked list of JingleContent.
+   * 
+   * The links belong to the arena: read it, but never change it with
+   * the g_slist_* functions.
    */
   GSList *content;
 
@@ -169,6 +184,18 @@ typedef enum {
 
 typedef void (*JingleAckCallback) (JingleAckType type, LmMessage *, gpointer);
 
+/** Resolution of the ack timer wheel, in milliseconds: timeouts are
+ *  given in seconds, a finer tick would only wake us up more often */
+#define JINGLE_ACK_WHEEL_TICK  1000
+/** Number of slots in the ack timer wheel (one turn = 256 seconds) */
+#define JINGLE_ACK_WHEEL_SLOTS 256
+/** Maximum number of unused JingleAckHandle kept for reuse */
+#define JINGLE_ACK_POOL_MAX    256
+
+/**
+ * Should be created with #jingle_ack_handle_new and is given back
+ * by #jingle_ack_handler_free.
+ */
 typedef struct {
   /**
    * function to be called when we receive a response to the IQ
@@ -180,6 +207,12 @@ typedef struct {
    */
   gpointer *user_data;
 
+  /**
+   * if not NULL, called on user_data once the handle is freed,
+   * whether callback was called or not
+   */
+  GDestroyNotify destroy;
+
   /** 
    * if no response was received after timeout seconds, callback
    * will be called with JINGLE_ACK_TIMEOUT as type
@@ -189,10 +222,25 @@ typedef struct {
   /**
    * @private
    * 
-   * date at which the handler was inserted using 
-   * jingle_new_ack_handler
+   * date, in milliseconds of the monotonic clock, at which the
+   * handler will time out
+   */
+  gint64 _deadline;
+
+  /**
+   * @private
+   * 
+   * link of the handle in its slot of the timer wheel (or in the
+   * pool of free handles), so that it can be removed in O(1)
+   */
+  GList _link;
+
+  /**
+   * @private
+   * 
+   * the queue _link currently belongs to, or NULL
    */
-  time_t _inserted;
+  GQueue *_queue;
   
   /**
    * @private
@@ -212,6 +260,7 @@ typedef struct {
 LmHandlerResult jingle_handle_ack_iq(LmMessageHandler *handler,
                                      LmConnection *connection, 
                                      LmMessage *message, gpointer user_data);
+JingleAckHandle *jingle_ack_handle_new(void);
 LmMessageHandler *jingle_new_ack_handler(JingleAckHandle *ri);
 void jingle_ack_handler_free(JingleAckHandle *ah);
 
@@ -224,6 +273,7 @@ gchar *jingle_find_compatible_res(const gchar *jid, const gchar *ns[]);
 
 void jingle_ack_iq(LmMessage *m);
 
+JingleNode *jingle_new_jinglenode(void);
 void jingle_free_jinglenode(JingleNode *jn);
 
 JingleAction jingle_action_from_str(const gchar* string);
@@ -31,6 +31,8 @@ typedef struct {
   gchar *xmlns;
   JingleAppFuncs *funcs;
   JingleTransportType transtype;
+  /* Transports of type transtype, best priority first */
+  GSList *ranked;
 } AppHandlerEntry;
 
 typedef struct {
@@ -38,6 +40,10 @@ typedef struct {
   JingleTransportFuncs *funcs;
   JingleTransportType transtype;
   JingleTransportPriority priority;
+  /* Bit of this transport in a forbid mask */
+  guint32 bit;
+  /* Registration order, among transports of the same priority */
+  guint serial;
 } TransportHandlerEntry;
 
 
@@ -48,6 +54,42 @@ static TransportHandlerEntry *jingle_find_transport(const gchar *xmlns);
 GSList *jingle_app_handlers = NULL;
 GSList *jingle_transport_handlers = NULL;
 
+/* Index of the entries above by namespace */
+static GHashTable *jingle_app_index = NULL;
+static GHashTable *jingle_transport_index = NULL;
+
+/* Bits of the forbid mask already given to a transport */
+static guint32 jingle_transport_bits = 0;
+
+/* Transports registered so far */
+static guint jingle_transport_serial = 0;
+
+
+/**
+ * Order transports by decreasing priority. Equal priorities keep
+ * their registration order.
+ */
+static gint jingle_transport_rank_cmp(gconstpointer a, gconstpointer b)
+{
+  const TransportHandlerEntry *ta = a, *tb = b;
+  gint cmp = (tb->priority > ta->priority) - (tb->priority < ta->priority);
+
+  if (cmp != 0)
+    return cmp;
+  return (ta->serial > tb->serial) - (ta->serial < tb->serial);
+}
+
+/**
+ * Add a transport to the list of an app if it can carry it. 0 is not
+ * a valid priority, such a transport is never chosen.
+ */
+static void jingle_rank_transport(AppHandlerEntry *app,
+                                  TransportHandlerEntry *trans)
+{
+  if (trans->transtype == app->transtype && trans->priority > 0)
+    app->ranked = g_slist_insert_sorted(app->ranked, trans,
+                                        jingle_transport_rank_cmp);
+}
 
 /**
  * Register a new supported application.
@@ -60,16 +102,28 @@ void jingle_register_app(const gchar *xmlns, JingleAppFuncs *funcs,
 
   AppHandlerEntry *h = g_new(AppHandlerEntry, 1);
 
+  GSList *el;
+
   h->xmlns       = g_strdup(xmlns);
   h->funcs       = funcs;
   h->transtype   = type;
+  h->ranked      = NULL;
+
+  for (el = jingle_transport_handlers; el; el = el->next)
+    jingle_rank_transport(h, (TransportHandlerEntry *) el->data);
 
   jingle_app_handlers = g_slist_append(jingle_app_handlers, h);
+
+  if (jingle_app_index == NULL)
+    jingle_app_index = g_hash_table_new(g_str_hash, g_str_equal);
+  g_hash_table_insert(jingle_app_index, h->xmlns, h);
 }
 
 /**
  * Register a new supported transport.
- * type is the type of transport.
+ * type is the type of transport. A transport needs a bit of the forbid
+ * mask, so that a failed one is not chosen again: past 32 of them, the
+ * next ones are refused.
  */
 void jingle_register_transport(const gchar *xmlns,
                                JingleTransportFuncs *funcs,
@@ -78,14 +132,34 @@ void jingle_register_transport(const gchar *xmlns,
 {
   if (!g_str_has_prefix(xmlns, NS_JINGLE_TRANSPORT_PREFIX)) return;
 
+  // Lowest bit not yet used
+  guint32 bit = ~jingle_transport_bits & (jingle_transport_bits + 1);
+  if (bit == 0) {
+    scr_LogPrint(LPRINT_NORMAL, "jingle: too many transports, %s is not"
+                 " registered", xmlns);
+    return;
+  }
+
   TransportHandlerEntry *h = g_new(TransportHandlerEntry, 1);
 
+  GSList *el;
+
   h->xmlns     = g_strdup(xmlns);
   h->funcs     = funcs;
   h->transtype = type;
   h->priority  = prio;
+  h->bit       = bit;
+  h->serial    = jingle_transport_serial++;
+  jingle_transport_bits |= h->bit;
 
   jingle_transport_handlers = g_slist_append(jingle_transport_handlers, h);
+
+  for (el = jingle_app_handlers; el; el = el->next)
+    jingle_rank_transport((AppHandlerEntry *) el->data, h);
+
+  if (jingle_transport_index == NULL)
+    jingle_transport_index = g_hash_table_new(g_str_hash, g_str_equal);
+  g_hash_table_insert(jingle_transport_index, h->xmlns, h);
 }
 
 JingleAppFuncs *jingle_get_appfuncs(const gchar *xmlns)
@@ -100,73 +174,53 @@ JingleTransportFuncs *jingle_get_transportfuncs(const gchar *xmlns)
   return (entry = jingle_find_transport(xmlns)) != NULL ? entry->funcs : NULL;
 }
 
-gint cmp_forbid(gconstpointer a, gconstpointer b)
-{
-  return g_strcmp0((const gchar *)a, (const gchar *)b);
-}
-
 /**
  * Determine which transport is better suited for a given app.
+ * If forbid is not NULL, transports whose bit is set in *forbid
+ * are skipped, and the bit of the chosen transport is added to it.
  */
 const gchar *jingle_transport_for_app(const gchar *appxmlns,
-                                      GSList **forbid)
+                                      guint32 *forbid)
 {
   AppHandlerEntry *app = jingle_find_app(appxmlns);
   GSList *entry;
-  TransportHandlerEntry *thistransport, *besttransport = NULL;
-  JingleTransportPriority bestprio = 0;
-  JingleTransportType requestedtype;
+  TransportHandlerEntry *thistransport;
 
   if (app == NULL)
     return NULL;
 
-  requestedtype = app->transtype;
-  for (entry = jingle_transport_handlers; entry; entry = entry->next) {
+  for (entry = app->ranked; entry; entry = entry->next) {
     thistransport = (TransportHandlerEntry *) entry->data;
     
     // Look if it's forbidden
-    if (forbid != NULL &&
-        g_slist_find_custom(*forbid, thistransport->xmlns, cmp_forbid))
+    if (forbid != NULL && (*forbid & thistransport->bit))
       continue;
-    
-    if (thistransport->transtype == requestedtype &&
-        thistransport->priority > bestprio) {
-      bestprio = thistransport->priority;
-      besttransport = thistransport;
-    }
+
+    if (forbid != NULL)
+      *forbid |= thistransport->bit;
+    return thistransport->xmlns;
   }
   
-  if (forbid != NULL)
-    *forbid = g_slist_append(*forbid, besttransport->xmlns);
-  
-  return besttransport != NULL ? besttransport->xmlns : NULL;
-}
-
-/**
- * This function should work with AppHandlerEntry and
- * TransportHandlerEntry as long as both start with xmlns.
- */
-static gint jingle_entry_cmp(gconstpointer a, gconstpointer b)
-{
-  return g_strcmp0(((AppHandlerEntry *) a)->xmlns, (const gchar*) b);
+  return NULL;
 }
 
 static AppHandlerEntry *jingle_find_app(const gchar *xmlns)
 {
-  GSList *entry = g_slist_find_custom(jingle_app_handlers, xmlns,
-                                      jingle_entry_cmp);
-  return entry != NULL ? (AppHandlerEntry *) entry->data : NULL;
+  if (jingle_app_index == NULL || xmlns == NULL)
+    return NULL;
+  return g_hash_table_lookup(jingle_app_index, xmlns);
 }
 
 static TransportHandlerEntry *jingle_find_transport(const gchar *xmlns)
 {
-  GSList *entry = g_slist_find_custom(jingle_transport_handlers, xmlns,
-                                      jingle_entry_cmp);
-  return entry != NULL ? (TransportHandlerEntry *) entry->data : NULL;
+  if (jingle_transport_index == NULL || xmlns == NULL)
+    return NULL;
+  return g_hash_table_lookup(jingle_transport_index, xmlns);
 }
 
 static void jingle_free_app(AppHandlerEntry *entry)
 {
+  g_slist_free(entry->ranked);
   g_free(entry->xmlns);
   g_free(entry);
 }
@@ -181,16 +235,24 @@ void jingle_unregister_app(const gchar *xmlns)
 {
   AppHandlerEntry *entry = jingle_find_app(xmlns);
   if (entry) {
-    jingle_free_app(entry);
+    g_hash_table_remove(jingle_app_index, entry->xmlns);
     jingle_app_handlers = g_slist_remove(jingle_app_handlers, entry);
+    jingle_free_app(entry);
   }
 }
 
 void jingle_unregister_transport(const gchar *xmlns)
 {
   TransportHandlerEntry *entry = jingle_find_transport(xmlns);
+  GSList *el;
   if (entry) {
-    jingle_free_transport(entry);
+    for (el = jingle_app_handlers; el; el = el->next) {
+      AppHandlerEntry *app = (AppHandlerEntry *) el->data;
+      app->ranked = g_slist_remove(app->ranked, entry);
+    }
+    jingle_transport_bits &= ~entry->bit;
+    g_hash_table_remove(jingle_transport_index, entry->xmlns);
     jingle_transport_handlers = g_slist_remove(jingle_transport_handlers, entry);
+    jingle_free_transport(entry);
   }
 }
@@ -65,15 +65,18 @@ typedef void (*JingleAppStart) (session_content *sc);
 typedef void (*JingleAppSend) (session_content *sc);
 typedef void (*JingleAppStop) (gconstpointer data);
 typedef gchar* (*JingleAppInfo) (gconstpointer data);
+typedef gboolean (*JingleAppReady) (gconstpointer data);
 
 typedef gconstpointer (*JingleTransportNewFromMsg) (JingleContent *cn, GError **err);
 typedef JingleHandleStatus (*JingleTransportHandle) (JingleAction action, gconstpointer data, LmMessageNode *node, GError **err);
 typedef void (*JingleTransportToMessage) (gconstpointer data, LmMessageNode *node);
 typedef gconstpointer (*JingleTransportNew) (void);
-typedef void (*JingleTransportSend) (session_content *sc, gconstpointer data, gchar *buf, gsize size);
+typedef void (*JingleTransportSend) (session_content *sc, gconstpointer data, const gchar *buf, gsize size);
 typedef void (*JingleTransportInit) (session_content *sc, gconstpointer data);
 typedef void (*JingleTransportEnd) (session_content *sc, gconstpointer data);
 typedef gchar* (*JingleTransportInfo) (gconstpointer data);
+typedef void (*JingleTransportStop) (gconstpointer data);
+typedef gsize (*JingleTransportWindow) (gconstpointer data);
 
 /**
  * @brief Struct containing functions provided by an app module.
@@ -121,6 +124,16 @@ typedef struct {
 
   JingleAppInfo info;
 
+  /**
+   * @brief Whether the session-accept can be sent for this content
+   * 
+   * An app may need time to fill it in, looking at the files it has on
+   * worker threads for example. The accept waits until every content
+   * is ready, the app calls session_app_ready once this one is.
+   * Optional, a content is always ready when it is missing.
+   */
+  JingleAppReady ready;
+
 } JingleAppFuncs;
 
 typedef struct {
@@ -142,6 +155,12 @@ typedef struct {
 
   JingleTransportNew new;
 
+  /**
+   * @brief Send size bytes of buf
+   * 
+   * buf is a read-only view of the app's data, it is only valid during
+   * the call: whatever the transport cannot send at once must be copied.
+   */
   JingleTransportSend send;
 
   JingleTransportInit init;
@@ -149,6 +168,25 @@ typedef struct {
   JingleTransportEnd end;
 
   JingleTransportInfo info;
+
+  /**
+   * @brief Release everything the transport holds for a content
+   * 
+   * Called when the content is removed from its session, whether the
+   * transfer is over or the session was torn down. Buffers and sockets
+   * must be freed, and no callback may use data afterwards.
+   * Optional.
+   */
+  JingleTransportStop stop;
+
+  /**
+   * @brief How many bytes the transport wants from the next send
+   * 
+   * Apps read exactly that much before calling send, so that the
+   * transport can use it as is (a whole IBB block for example).
+   * Optional, apps use their own size when it is missing or returns 0.
+   */
+  JingleTransportWindow window;
   
 } JingleTransportFuncs;
 
@@ -163,6 +201,6 @@ JingleAppFuncs *jingle_get_appfuncs(const gchar *xmlns);
 JingleTransportFuncs *jingle_get_transportfuncs(const gchar *xmlns);
 void jingle_unregister_app(const gchar *xmlns);
 void jingle_unregister_transport(const gchar *xmlns);
-const gchar *jingle_transport_for_app(const gchar *appxmlns, GSList **forbid);
+const gchar *jingle_transport_for_app(const gchar *appxmlns, guint32 *forbid);
 
 #endif
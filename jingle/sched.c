@@ -0,0 +1,425 @@
+/*
+ * sched.c
+ *
+ * Copyright (C) 2026 mcabber-jingle contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+#include <glib.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <mcabber/settings.h>
+#include <mcabber/utils.h>
+
+#include <jingle/sessions.h>
+#include <jingle/register.h>
+#include <jingle/sched.h>
+
+/*
+ * Every chunk an app gives to a transport goes through three token
+ * buckets: the global one (jingle_rate_limit), the one of the peer
+ * (jingle_rate_limit_peer) and the one of the content
+ * (jingle_rate_limit_content), all in KiB/s. A bucket may go below
+ * zero, a chunk larger than what it saves up is still sent, and the
+ * next one waits for the debt to be paid back.
+ *
+ * Chunks which cannot go at once are copied and wait in a queue. The
+ * apps only give the next chunk of a content once its transport asks
+ * for it, so a content has at most one chunk waiting. The queue is
+ * served in self-clocked fair queuing order: a chunk is stamped with
+ * the virtual time at which it would be done if each content had its
+ * weight's share of the bandwidth, and the smallest stamp goes first.
+ *
+ * The rates are looked at for every chunk: they are kept here, guards
+ * on the settings update them when they are set.
+ */
+
+typedef struct {
+  gdouble tokens;
+
+  /* When tokens was last refilled, 0 if never */
+  gint64 last;
+
+  /* Peer buckets only: their bare jid, and how many flows use them */
+  gchar *jid;
+  guint ref;
+} SchedBucket;
+
+typedef struct {
+  SessionContent *sc;
+  SchedBucket bucket;
+  SchedBucket *peer;
+  guint weight;
+
+  /* The chunk waiting for its turn, if any */
+  gchar *data;
+  gsize size;
+
+  /* The transport must be ended once data is sent */
+  gboolean end;
+
+  /* Virtual time when the last chunk of this flow is done */
+  gdouble finish;
+
+  /* Its chunk is being sent, and the content went away meanwhile */
+  gboolean busy;
+  gboolean gone;
+} SchedFlow;
+
+static SchedBucket global;
+
+/* Flows by SessionContent, peer buckets by bare jid */
+static GHashTable *flows = NULL;
+static GHashTable *peers = NULL;
+
+/* Flows holding a chunk */
+static GQueue waiting = G_QUEUE_INIT;
+
+/* Rates, in bytes per second, of jingle_rate_limit, _peer and _content */
+static gdouble rate_global = 0;
+static gdouble rate_peer = 0;
+static gdouble rate_content = 0;
+
+static gdouble vtime = 0;
+static gboolean running = FALSE;
+static guint tick_source = 0;
+
+static gboolean sched_tick(gpointer data);
+
+
+/**
+ * @return The rate, in bytes per second, of a setting in KiB/s,
+ *         0 if there is no limit
+ */
+static gdouble sched_rate(const gchar *value)
+{
+  if (value == NULL)
+    return 0;
+  return MAX(atoi(value), 0) * 1024.0;
+}
+
+/**
+ * Guard of the jingle_rate_limit* settings, before the new value is set.
+ */
+static gchar *sched_rate_guard(const gchar *key, const gchar *new_value)
+{
+  if (!g_ascii_strcasecmp(key, "jingle_rate_limit"))
+    rate_global = sched_rate(new_value);
+  else if (!g_ascii_strcasecmp(key, "jingle_rate_limit_peer"))
+    rate_peer = sched_rate(new_value);
+  else if (!g_ascii_strcasecmp(key, "jingle_rate_limit_content"))
+    rate_content = sched_rate(new_value);
+  return g_strdup(new_value);
+}
+
+static void bucket_refill(SchedBucket *b, gdouble rate, gint64 now)
+{
+  gdouble burst = rate * JINGLE_SCHED_BURST;
+
+  if (rate <= 0)
+    return;
+  if (b->last == 0)
+    b->tokens = burst;
+  else
+    b->tokens = MIN(b->tokens + rate * (now - b->last) / G_USEC_PER_SEC,
+                    burst);
+  b->last = now;
+}
+
+static gboolean bucket_ready(const SchedBucket *b, gdouble rate)
+{
+  return rate <= 0 || b->tokens > 0;
+}
+
+static void bucket_charge(SchedBucket *b, gdouble rate, gsize size)
+{
+  if (rate > 0)
+    b->tokens -= size;
+}
+
+/**
+ * @return The weight of the contents with a peer
+ */
+static guint sched_weight(const gchar *jid)
+{
+  gchar *option = g_strdup_printf("jingle_weight_%s", jid);
+  gint weight = JINGLE_SCHED_WEIGHT;
+
+  if (settings_opt_get(option) != NULL)
+    weight = settings_opt_get_int(option);
+  else if (settings_opt_get("jingle_weight") != NULL)
+    weight = settings_opt_get_int("jingle_weight");
+  g_free(option);
+  return MAX(weight, 1);
+}
+
+static SchedFlow *sched_flow(SessionContent *sc)
+{
+  SchedFlow *f;
+  gchar *barejid, *jid;
+
+  if (flows == NULL) {
+    flows = g_hash_table_new(g_direct_hash, g_direct_equal);
+    peers = g_hash_table_new(g_str_hash, g_str_equal);
+  }
+
+  f = g_hash_table_lookup(flows, sc);
+  if (f != NULL)
+    return f;
+
+  f = g_new0(SchedFlow, 1);
+  f->sc = sc;
+  f->finish = vtime;
+
+  barejid = jidtodisp(sc->session->recipient);
+  jid = g_ascii_strdown(barejid, -1);
+  g_free(barejid);
+  f->peer = g_hash_table_lookup(peers, jid);
+  if (f->peer == NULL) {
+    f->peer = g_new0(SchedBucket, 1);
+    f->peer->jid = jid;
+    g_hash_table_insert(peers, f->peer->jid, f->peer);
+  } else {
+    g_free(jid);
+  }
+  f->peer->ref++;
+  f->weight = sched_weight(f->peer->jid);
+
+  g_hash_table_insert(flows, sc, f);
+  return f;
+}
+
+static void sched_flow_free(SchedFlow *f)
+{
+  if (--f->peer->ref == 0) {
+    g_hash_table_remove(peers, f->peer->jid);
+    g_free(f->peer->jid);
+    g_free(f->peer);
+  }
+  g_free(f->data);
+  g_free(f);
+}
+
+/**
+ * @return Whether the buckets of a flow let a chunk go, after
+ *         refilling them
+ */
+static gboolean sched_ready(SchedFlow *f, gint64 now)
+{
+  bucket_refill(f->peer, rate_peer, now);
+  bucket_refill(&f->bucket, rate_content, now);
+  return bucket_ready(f->peer, rate_peer) &&
+         bucket_ready(&f->bucket, rate_content);
+}
+
+static void sched_charge(SchedFlow *f, gsize size)
+{
+  bucket_charge(&global, rate_global, size);
+  bucket_charge(f->peer, rate_peer, size);
+  bucket_charge(&f->bucket, rate_content, size);
+}
+
+static gboolean sched_global_ready(gint64 now)
+{
+  bucket_refill(&global, rate_global, now);
+  return bucket_ready(&global, rate_global);
+}
+
+/**
+ * @return The waiting flow to serve now, NULL if none may go yet
+ */
+static SchedFlow *sched_pick(void)
+{
+  gint64 now = g_get_monotonic_time();
+  SchedFlow *best = NULL;
+  GList *el;
+
+  if (!sched_global_ready(now))
+    return NULL;
+
+  // Flows held back by their own limits leave the way to the others
+  for (el = waiting.head; el; el = el->next) {
+    SchedFlow *f = el->data;
+    if ((best == NULL || f->finish < best->finish) && sched_ready(f, now))
+      best = f;
+  }
+  return best;
+}
+
+/**
+ * Send the waiting chunks whose turn has come. Sending may bring
+ * more chunks, from transports asking for more at once: they are
+ * queued and served by the same loop.
+ */
+static void sched_run(void)
+{
+  SchedFlow *f;
+  SessionContent *sc;
+  gchar *data;
+  gsize size;
+  gboolean end;
+
+  if (running)
+    return;
+  running = TRUE;
+
+  while ((f = sched_pick()) != NULL) {
+    g_queue_remove(&waiting, f);
+    sc = f->sc;
+    data = f->data;
+    size = f->size;
+    end = f->end;
+    f->data = NULL;
+    f->size = 0;
+    f->end = FALSE;
+    sched_charge(f, size);
+    vtime = f->finish;
+
+    f->busy = TRUE;
+    sc->transfuncs->send(&sc->handle, sc->transport, data, size);
+    if (end && !f->gone)
+      sc->transfuncs->end(&sc->handle, sc->transport);
+    f->busy = FALSE;
+    g_free(data);
+    if (f->gone)
+      sched_flow_free(f);
+  }
+
+  running = FALSE;
+  if (waiting.length > 0 && tick_source == 0)
+    tick_source = g_timeout_add(JINGLE_SCHED_TICK, sched_tick, NULL);
+}
+
+static gboolean sched_tick(gpointer data)
+{
+  sched_run();
+  if (waiting.length == 0) {
+    tick_source = 0;
+    return FALSE;
+  }
+  return TRUE;
+}
+
+void jingle_sched_send(SessionContent *sc, const gchar *data, gsize size)
+{
+  SchedFlow *f;
+
+  // Nothing to share out, nothing to keep track of
+  if (waiting.length == 0 && rate_global <= 0 && rate_peer <= 0
+      && rate_content <= 0) {
+    sc->transfuncs->send(&sc->handle, sc->transport, data, size);
+    return;
+  }
+
+  f = sched_flow(sc);
+  f->finish = MAX(vtime, f->finish) + (gdouble)size / f->weight;
+
+  // Its turn already, no need to copy the data
+  if (!running && waiting.length == 0 && f->data == NULL
+      && sched_global_ready(g_get_monotonic_time())
+      && sched_ready(f, g_get_monotonic_time())) {
+    sched_charge(f, size);
+    vtime = f->finish;
+    sc->transfuncs->send(&sc->handle, sc->transport, data, size);
+    return;
+  }
+
+  if (f->data == NULL)
+    g_queue_push_tail(&waiting, f);
+  f->data = g_realloc(f->data, f->size + size);
+  memcpy(f->data + f->size, data, size);
+  f->size += size;
+
+  sched_run();
+}
+
+/**
+ * @brief The app has nothing more to send, end the transport once the
+ *        chunk waiting, if any, is sent
+ */
+void jingle_sched_end(SessionContent *sc)
+{
+  SchedFlow *f = (flows != NULL) ? g_hash_table_lookup(flows, sc) : NULL;
+
+  if (f != NULL && f->data != NULL) {
+    f->end = TRUE;
+    return;
+  }
+  sc->transfuncs->end(&sc->handle, sc->transport);
+}
+
+/**
+ * @brief Drop what a content still had to send, it is going away
+ */
+void jingle_sched_forget(SessionContent *sc)
+{
+  SchedFlow *f = (flows != NULL) ? g_hash_table_lookup(flows, sc) : NULL;
+
+  if (f == NULL)
+    return;
+
+  g_hash_table_remove(flows, sc);
+  if (f->data != NULL)
+    g_queue_remove(&waiting, f);
+  if (f->busy)
+    f->gone = TRUE;
+  else
+    sched_flow_free(f);
+}
+
+/**
+ * @brief Take the rates as they are set, and follow their changes
+ */
+void jingle_sched_init(void)
+{
+  rate_global = sched_rate(settings_opt_get("jingle_rate_limit"));
+  rate_peer = sched_rate(settings_opt_get("jingle_rate_limit_peer"));
+  rate_content = sched_rate(settings_opt_get("jingle_rate_limit_content"));
+  settings_set_guard("jingle_rate_limit", sched_rate_guard);
+  settings_set_guard("jingle_rate_limit_peer", sched_rate_guard);
+  settings_set_guard("jingle_rate_limit_content", sched_rate_guard);
+}
+
+void jingle_sched_uninit(void)
+{
+  GHashTableIter iter;
+  SchedFlow *f;
+
+  if (tick_source != 0) {
+    g_source_remove(tick_source);
+    tick_source = 0;
+  }
+  g_queue_clear(&waiting);
+
+  if (flows != NULL) {
+    g_hash_table_iter_init(&iter, flows);
+    while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&f)) {
+      g_hash_table_iter_steal(&iter);
+      sched_flow_free(f);
+    }
+    g_hash_table_destroy(flows);
+    g_hash_table_destroy(peers);
+    flows = peers = NULL;
+  }
+  memset(&global, 0, sizeof(global));
+  vtime = 0;
+
+  settings_del_guard("jingle_rate_limit");
+  settings_del_guard("jingle_rate_limit_peer");
+  settings_del_guard("jingle_rate_limit_content");
+}
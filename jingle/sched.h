@@ -0,0 +1,38 @@
+/**
+ * @file sched.h
+ * @brief sched.c header file
+ */
+
+#ifndef __JINGLE_SCHED_H__
+#define __JINGLE_SCHED_H__ 1
+
+#include <glib.h>
+
+#include <jingle/sessions.h>
+
+/* Seconds of traffic a rate limited bucket may save up while idle */
+#define JINGLE_SCHED_BURST 1
+
+/* Milliseconds between two looks at the data waiting for its turn */
+#define JINGLE_SCHED_TICK 20
+
+/* Share of the bandwidth of a content, unless jingle_weight or
+ * jingle_weight_<bare jid> says otherwise */
+#define JINGLE_SCHED_WEIGHT 1
+
+/**
+ * @brief Give data of an app to the transport of its content
+ *
+ * Without any jingle_rate_limit* setting, the data goes through at
+ * once. Otherwise it is sent when the global, per peer and per content
+ * token buckets allow it, contents sharing the bandwidth according to
+ * their weight. The data is copied if it has to wait, the transport
+ * asks for more once it was sent.
+ */
+void jingle_sched_send(SessionContent *sc, const gchar *data, gsize size);
+void jingle_sched_end(SessionContent *sc);
+void jingle_sched_forget(SessionContent *sc);
+void jingle_sched_init(void);
+void jingle_sched_uninit(void);
+
+#endif
@@ -36,7 +36,7 @@ void jingle_send_session_terminate(JingleSession *js, const gchar *reason)
 {
   JingleAckHandle *ackhandle;
   LmMessageNode *node2;
-  LmMessage *r = lm_message_new_with_sub_type(js->to, LM_MESSAGE_TYPE_IQ,
+  LmMessage *r = lm_message_new_with_sub_type(js->recipient, LM_MESSAGE_TYPE_IQ,
                                               LM_MESSAGE_SUB_TYPE_SET);
   LmMessageNode *node = lm_message_get_node(r);
   node2 = lm_message_node_add_child(node, "jingle", NULL);
@@ -51,7 +51,7 @@ void jingle_send_session_terminate(JingleSession *js, const gchar *reason)
     lm_message_node_add_child(node, reason, NULL);
   }
 
-  ackhandle = g_new0(JingleAckHandle, 1);
+  ackhandle = jingle_ack_handle_new();
   ackhandle->callback = NULL;
   ackhandle->user_data = NULL;
 
@@ -60,12 +60,36 @@ void jingle_send_session_terminate(JingleSession *js, const gchar *reason)
   lm_message_unref(r);
 }
 
+/**
+ * The session may be freed before its ack comes, e.g. by the reaper or
+ * /jft cancel. The ack only keeps the sid and the JID of the session, and
+ * looks it up again when called.
+ */
+static gpointer jingle_session_ref(JingleSession *js)
+{
+  gchar **ref = g_new(gchar *, 3);
+
+  ref[0] = g_strdup(js->sid);
+  ref[1] = g_strdup(js->recipient);
+  ref[2] = NULL;
+  return ref;
+}
+
+static JingleSession *jingle_session_deref(gpointer data)
+{
+  gchar **ref = (gchar **)data;
+  return session_find_by_sid(ref[0], ref[1]);
+}
+
 static void jingle_handle_ack_iq_sa(JingleAckType acktype, LmMessage *mess,
                                     gpointer data)
 {
   LmMessageNode *node;
   const gchar *type, *cause;
-  JingleSession *sess = (JingleSession*)data;
+  JingleSession *sess = jingle_session_deref(data);
+
+  if (sess == NULL)
+    return;
 
   if (acktype == JINGLE_ACK_TIMEOUT) {
     // TODO: handle ack timeout...
@@ -100,9 +124,10 @@ void jingle_send_session_accept(JingleSession *js)
   mess = lm_message_from_jinglesession(js, JINGLE_SESSION_ACCEPT);
  
   if (mess) {
-    ackhandle = g_new0(JingleAckHandle, 1);
+    ackhandle = jingle_ack_handle_new();
     ackhandle->callback = jingle_handle_ack_iq_sa;
-    ackhandle->user_data = (gpointer)js;
+    ackhandle->user_data = jingle_session_ref(js);
+    ackhandle->destroy = (GDestroyNotify)g_strfreev;
     ackhandle->timeout = 60;
     lm_connection_send_with_reply(lconnection, mess,
                                   jingle_new_ack_handler(ackhandle), NULL);
@@ -115,7 +140,10 @@ static void jingle_handle_ack_iq_si(JingleAckType acktype, LmMessage *mess,
 {
   LmMessageNode *node;
   const gchar *type, *cause;
-  JingleSession *sess = (JingleSession*)data;
+  JingleSession *sess = jingle_session_deref(data);
+
+  if (sess == NULL)
+    return;
 
   if (acktype == JINGLE_ACK_TIMEOUT) {
     // TODO: handle ack timeout...
@@ -151,9 +179,10 @@ void jingle_send_session_initiate(JingleSession *js)
                                 "initiator", js->from);
  
   if (mess) {
-    ackhandle = g_new0(JingleAckHandle, 1);
+    ackhandle = jingle_ack_handle_new();
     ackhandle->callback = jingle_handle_ack_iq_si;
-    ackhandle->user_data = (gpointer)js;
+    ackhandle->user_data = jingle_session_ref(js);
+    ackhandle->destroy = (GDestroyNotify)g_strfreev;
     ackhandle->timeout = 60;
     status = lm_connection_send_with_reply(lconnection, mess,
                                        jingle_new_ack_handler(ackhandle), &err);
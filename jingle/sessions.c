@@ -23,32 +23,89 @@
 
 #include <mcabber/logprint.h>
 #include <mcabber/xmpp.h>
+#include <mcabber/settings.h>
+#include <mcabber/events.h>
 
 #include <jingle/jingle.h>
 #include <jingle/sessions.h>
 #include <jingle/register.h>
 #include <jingle/send.h>
+#include <jingle/sched.h>
 
-static GSList *sessions;
+/**
+ * Sessions are indexed by the pair (sid, jid of the peer).
+ * The key only points to strings owned by the JingleSession.
+ */
+typedef struct {
+  const gchar *sid;
+  const gchar *jid;
+} SessionKey;
+
+static GHashTable *sessions = NULL;
+
+/* Reverse indexes from the opaque app/transport pointers to their content */
+static GHashTable *app_index = NULL;
+static GHashTable *transport_index = NULL;
+
+/* The timer looking for abandoned sessions, and what it found so far */
+static guint reaper_source = 0;
+static guint reaped[JINGLE_REAP_MAX];
+
+static gboolean session_reaper(gpointer data);
 
 static void lm_insert_sessioncontent(gpointer data, gpointer userdata);
 
 extern struct JingleActionList jingle_action_list[];
 
 /**
- * Create a new session and insert it in the linked list.
+ * JIDs are compared case-insensitively, so must be the hash.
+ */
+static guint session_key_hash(gconstpointer key)
+{
+  const SessionKey *sk = (const SessionKey *) key;
+  const gchar *p;
+  guint h = g_str_hash(sk->sid);
+
+  for (p = sk->jid; *p; p++)
+    h = (h << 5) + h + g_ascii_tolower(*p);
+
+  return h;
+}
+
+static gboolean session_key_equal(gconstpointer a, gconstpointer b)
+{
+  const SessionKey *ka = (const SessionKey *) a, *kb = (const SessionKey *) b;
+  return !g_strcmp0(ka->sid, kb->sid) && !g_ascii_strcasecmp(ka->jid, kb->jid);
+}
+
+/**
+ * Create a new session and insert it in the hash table.
  */
 JingleSession *session_new(const gchar *sid, const gchar *from,
                            const gchar *to, SessionOrigin origin)
 {
-  JingleSession *js = g_new0(JingleSession, 1);
+  JingleArena *arena = jingle_arena_new(JINGLE_SESSION_ARENA_SIZE);
+  JingleSession *js = jingle_arena_new0(arena, JingleSession);
+  SessionKey *key = jingle_arena_new0(arena, SessionKey);
   
-  js->sid  = g_strdup(sid);
-  js->from = g_strdup(from);
-  js->to   = g_strdup(to);
+  js->arena = arena;
+  js->sid  = jingle_arena_strdup(arena, sid);
+  js->from = jingle_arena_strdup(arena, from);
+  js->to   = jingle_arena_strdup(arena, to);
   js->origin = origin;
+  js->recipient = (origin == JINGLE_SESSION_INCOMING) ? js->from : js->to;
+
+  if (sessions == NULL)
+    sessions = g_hash_table_new(session_key_hash, session_key_equal);
+
+  key->sid = js->sid;
+  key->jid = js->recipient;
+  g_hash_table_insert(sessions, key, js);
 
-  sessions = g_slist_append(sessions, js);
+  session_touch(js);
+  if (reaper_source == 0)
+    reaper_source = g_timeout_add_seconds(JINGLE_SESSION_REAPER_TICK,
+                                          session_reaper, NULL);
   return js;
 }
 
@@ -68,17 +125,14 @@ JingleSession *session_new_from_jinglenode(JingleNode *jn)
 
 JingleSession *session_find_by_sid(const gchar *sid, const gchar *from)
 {
-  GSList *el;
-  JingleSession *js;
-  gchar *recipient;
-  for (el = sessions; el; el = el->next) {
-    js = (JingleSession*) el->data;
-    recipient = (js->origin == JINGLE_SESSION_INCOMING) ? js->from : js->to;
-    if (!g_strcmp0(js->sid, sid) && !g_ascii_strcasecmp(recipient, from)) {
-      return js;
-    }
-  }
-  return NULL;
+  SessionKey key;
+
+  if (sessions == NULL || sid == NULL || from == NULL)
+    return NULL;
+
+  key.sid = sid;
+  key.jid = from;
+  return g_hash_table_lookup(sessions, &key);
 }
 
 JingleSession *session_find(const JingleNode *jn)
@@ -87,27 +141,65 @@ JingleSession *session_find(const JingleNode *jn)
   return session_find_by_sid(jn->sid, from);
 }
 
+/**
+ * Remove a content from the list of a session and free it. Whoever
+ * iterates over the list must take the next link before.
+ */
+static void session_free_content(JingleSession *sess, SessionContent *sc)
+{
+  sess->content = g_slist_remove(sess->content, sc);
+  g_free(sc->name);
+  g_slice_free(SessionContent, sc);
+}
+
+/**
+ * Contents are not taken from the arena of the session: a session
+ * adding and removing files for hours would make it grow forever.
+ */
 SessionContent* session_add_content(JingleSession *sess, const gchar *name,
                                     SessionState state)
 {
-  SessionContent *sc = g_new0(SessionContent, 1);
+  SessionContent *sc = g_slice_new0(SessionContent);
   
   sc->name = g_strdup(name);
   sc->state = state;
+  sc->session = sess;
+
+  sc->handle.sid  = sess->sid;
+  sc->handle.from = sess->recipient;
+  sc->handle.name = sc->name;
 
   sess->content = g_slist_append(sess->content, sc);
   
   return sc;
 }
 
+/**
+ * Drop the entries of a content from the app and transport indexes.
+ */
+static void sessioncontent_unindex(SessionContent *sc)
+{
+  if (app_index != NULL && sc->description != NULL &&
+      g_hash_table_lookup(app_index, sc->description) == sc)
+    g_hash_table_remove(app_index, sc->description);
+
+  if (transport_index != NULL && sc->transport != NULL &&
+      g_hash_table_lookup(transport_index, sc->transport) == sc)
+    g_hash_table_remove(transport_index, sc->transport);
+}
+
 void session_add_app(JingleSession *sess, const gchar *name,
                            const gchar *xmlns, gconstpointer data)
 {
   SessionContent *sc = session_find_sessioncontent(sess, name);
   
-  sc->xmlns_desc = g_strdup(xmlns);
+  sc->xmlns_desc = g_intern_string(xmlns);
   sc->appfuncs = jingle_get_appfuncs(xmlns);
   sc->description = data;
+
+  if (app_index == NULL)
+    app_index = g_hash_table_new(g_direct_hash, g_direct_equal);
+  g_hash_table_insert(app_index, (gpointer) data, sc);
 }
 
 void session_add_trans(JingleSession *sess, const gchar *name,
@@ -115,9 +207,13 @@ void session_add_trans(JingleSession *sess, const gchar *name,
 {
   SessionContent *sc = session_find_sessioncontent(sess, name);
   
-  sc->xmlns_trans = g_strdup(xmlns);
+  sc->xmlns_trans = g_intern_string(xmlns);
   sc->transfuncs = jingle_get_transportfuncs(xmlns);
   sc->transport = data;
+
+  if (transport_index == NULL)
+    transport_index = g_hash_table_new(g_direct_hash, g_direct_equal);
+  g_hash_table_insert(transport_index, (gpointer) data, sc);
 }
 
 SessionContent* session_add_content_from_jinglecontent(JingleSession *sess,
@@ -141,7 +237,7 @@ SessionContent* session_add_content_from_jinglecontent(JingleSession *sess,
     data = appfuncs->newfrommessage(cn, &error);
     if (data == NULL || error != NULL) {
       g_propagate_error(err, error);
-      sess->content = g_slist_remove(sess->content, sc);
+      session_free_content(sess, sc);
       return NULL;
     }
     session_add_app(sess, cn->name, xmlns, data);
@@ -154,8 +250,8 @@ SessionContent* session_add_content_from_jinglecontent(JingleSession *sess,
     data = transfuncs->newfrommessage(cn, &error);
     if (data == NULL || error != NULL) {
       g_propagate_error(err, error);
-      g_free(sc->xmlns_desc);
-      sess->content = g_slist_remove(sess->content, sc);
+      sessioncontent_unindex(sc);
+      session_free_content(sess, sc);
       return NULL;
     }
     session_add_trans(sess, cn->name, xmlns, data);
@@ -179,82 +275,35 @@ SessionContent *session_find_sessioncontent(JingleSession *sess,
 
 JingleSession *session_find_by_transport(gconstpointer data)
 {
-  GSList *el, *el1;
-  JingleSession *sess;
-  SessionContent *sc;
-  for (el1 = sessions; el1; el1 = el1->next) {
-    sess = (JingleSession*) el1->data;
-    for (el = sess->content; el; el = el->next) {
-      sc = (SessionContent*) el->data;
-      if (data == sc->transport)
-        return sess;
-    }
-  }
-  return NULL;
+  SessionContent *sc = sessioncontent_find_by_transport(data);
+  return sc != NULL ? sc->session : NULL;
 }
 
 JingleSession *session_find_by_app(gconstpointer data)
 {
-  GSList *el, *el1;
-  JingleSession *sess;
-  SessionContent *sc;
-  for (el1 = sessions; el1; el1 = el1->next) {
-    sess = (JingleSession*) el1->data;
-    for (el = sess->content; el; el = el->next) {
-      sc = (SessionContent*) el->data;
-      if (data == sc->description)
-        return sess;
-    }
-  }
-  return NULL;
+  SessionContent *sc = sessioncontent_find_by_app(data);
+  return sc != NULL ? sc->session : NULL;
 }
 
 SessionContent *sessioncontent_find_by_transport(gconstpointer data)
 {
-  GSList *el, *el1;
-  JingleSession *sess;
-  SessionContent *sc;
-  for (el1 = sessions; el1; el1 = el1->next) {
-    sess = (JingleSession*) el1->data;
-    for (el = sess->content; el; el = el->next) {
-      sc = (SessionContent*) el->data;
-      if (data == sc->transport)
-        return sc;
-    }
-  }
-  return NULL;
+  if (transport_index == NULL)
+    return NULL;
+
+  return g_hash_table_lookup(transport_index, data);
 }
 
 SessionContent *sessioncontent_find_by_app(gconstpointer data)
 {
-  GSList *el, *el1;
-  JingleSession *sess;
-  SessionContent *sc;
-  for (el1 = sessions; el1; el1 = el1->next) {
-    sess = (JingleSession*) el1->data;
-    for (el = sess->content; el; el = el->next) {
-      sc = (SessionContent*) el->data;
-      if (data == sc->description)
-        return sc;
-    }
-  }
-  return NULL;
+  if (app_index == NULL)
+    return NULL;
+
+  return g_hash_table_lookup(app_index, data);
 }
 
 JingleSession *session_find_by_sessioncontent(SessionContent *data)
 {
-  GSList *el, *el1;
-  JingleSession *sess;
-  SessionContent *sc;
-  for (el1 = sessions; el1; el1 = el1->next) {
-    sess = (JingleSession*) el1->data;
-    for (el = sess->content; el; el = el->next) {
-      sc = (SessionContent*) el->data;
-      if (data == sc)
-        return sess;
-    }
-  }
-  return NULL;
+  return data->session;
 }
 
 gint session_remove_sessioncontent(JingleSession *sess, const gchar *name)
@@ -263,11 +312,15 @@ gint session_remove_sessioncontent(JingleSession *sess, const gchar *name)
   sc = session_find_sessioncontent(sess, name);
   if(sc == NULL) return 0;
 
-  if (sc->state == JINGLE_SESSION_STATE_ACTIVE) {
-    // TODO: stop the transfer
-  }
+  jingle_sched_forget(sc);
+
+  // Let the transport release its buffers and sockets
+  if (sc->transport != NULL && sc->transfuncs != NULL
+      && sc->transfuncs->stop != NULL)
+    sc->transfuncs->stop(sc->transport);
   
-  sess->content = g_slist_remove(sess->content, sc);
+  sessioncontent_unindex(sc);
+  session_free_content(sess, sc);
   
   return g_slist_length(sess->content);
 }
@@ -282,7 +335,7 @@ void session_changestate_sessioncontent(JingleSession *sess, const gchar *name,
 }
 
 /**
- * Remove a session from the linked list and free it.
+ * Remove a session from the hash table and free it.
  */
 void session_delete(JingleSession *sess)
 {
@@ -291,11 +344,19 @@ void session_delete(JingleSession *sess)
 }
 
 /**
- * Remove a session from the linked list.
+ * Remove a session from the hash table.
  */
 void session_remove(JingleSession *sess)
 {
-  sessions = g_slist_remove(sessions, sess);
+  SessionKey key;
+
+  if (sessions == NULL)
+    return;
+
+  key.sid = sess->sid;
+  key.jid = sess->recipient;
+  if (g_hash_table_lookup(sessions, &key) == sess)
+    g_hash_table_remove(sessions, &key);
 }
 
 /**
@@ -303,20 +364,189 @@ void session_remove(JingleSession *sess)
  */
 void session_free(JingleSession *sess)
 {
-  GSList *el;
   SessionContent *sc;
   
-  g_free(sess->sid);
-  g_free(sess->from);
-  g_free(sess->to);
+  // The event would call us back with a dangling pointer
+  if (sess->evid != NULL) {
+    const gchar *evid = sess->evid;
+    sess->evid = NULL;
+    evs_del(evid);
+  }
+
+  while (sess->content) {
+    sc = (SessionContent*)sess->content->data;
+    session_remove_sessioncontent(sess, sc->name);
+  }
   
-  // Remove and free contents
+  jingle_arena_free(sess->arena);
+}
+
+/**
+ * Stop the apps of every content, tell the peer the session is over
+ * and delete it.
+ */
+void session_terminate(JingleSession *sess, const gchar *reason)
+{
+  GSList *el;
+  SessionContent *sc;
+
   for (el = sess->content; el; el = el->next) {
     sc = (SessionContent*)el->data;
-    session_remove_sessioncontent(sess, sc->name);
+    if (sc->description != NULL && sc->appfuncs != NULL
+        && sc->appfuncs->stop != NULL)
+      sc->appfuncs->stop(sc->description);
+  }
+  jingle_send_session_terminate(sess, reason);
+  session_delete(sess);
+}
+
+/**
+ * Send the session-accept if the user accepted the session and the app
+ * of every content is ready.
+ */
+static void session_accept_if_ready(JingleSession *sess)
+{
+  GSList *el;
+  SessionContent *sc;
+
+  if (!sess->accepting)
+    return;
+  for (el = sess->content; el; el = el->next) {
+    sc = (SessionContent*)el->data;
+    if (sc->description != NULL && sc->appfuncs != NULL
+        && sc->appfuncs->ready != NULL && !sc->appfuncs->ready(sc->description))
+      return;
+  }
+  sess->accepting = FALSE;
+  session_touch(sess);
+  jingle_send_session_accept(sess);
+}
+
+/**
+ * Accept a session we received, as soon as its apps are ready.
+ */
+void session_accept(JingleSession *sess)
+{
+  sess->accepting = TRUE;
+  session_accept_if_ready(sess);
+}
+
+/**
+ * Called by an app once the content of data is ready, see
+ * JingleAppFuncs.ready.
+ */
+void session_app_ready(gconstpointer data)
+{
+  SessionContent *sc = sessioncontent_find_by_app(data);
+  JingleSession *sess;
+
+  if (sc == NULL || (sess = session_find_by_sessioncontent(sc)) == NULL)
+    return;
+  session_accept_if_ready(sess);
+}
+
+/**
+ * Record some activity on a session, so that the reaper leaves it alone.
+ */
+void session_touch(JingleSession *sess)
+{
+  if (sess != NULL)
+    sess->last_activity = g_get_monotonic_time() / G_USEC_PER_SEC;
+}
+
+/**
+ * A session is pending as long as none of its contents was accepted.
+ */
+static gboolean session_is_pending(JingleSession *sess)
+{
+  GSList *el;
+
+  for (el = sess->content; el; el = el->next)
+    if (((SessionContent*)el->data)->state != JINGLE_SESSION_STATE_PENDING)
+      return FALSE;
+  return TRUE;
+}
+
+static gint session_timeout(const gchar *option, gint def)
+{
+  if (settings_opt_get(option) == NULL)
+    return def;
+  return settings_opt_get_int(option);
+}
+
+/**
+ * Terminate the sessions which were not accepted within
+ * jingle_pending_timeout seconds, or during which nothing happened
+ * for jingle_idle_timeout seconds.
+ * The timer goes away with the last session, session_new restarts it.
+ */
+static gboolean session_reaper(gpointer data)
+{
+  GHashTableIter iter;
+  JingleSession *sess;
+  SessionKey *key;
+  GSList *expired = NULL, *el;
+  JingleReapReason why;
+  gint64 now = g_get_monotonic_time() / G_USEC_PER_SEC;
+  gint pending = session_timeout("jingle_pending_timeout",
+                                 JINGLE_SESSION_PENDING_TIMEOUT);
+  gint idle = session_timeout("jingle_idle_timeout",
+                              JINGLE_SESSION_IDLE_TIMEOUT);
+
+  if (sessions == NULL || g_hash_table_size(sessions) == 0) {
+    reaper_source = 0;
+    return FALSE;
+  }
+
+  // Terminating a session changes the table, collect them first. Only
+  // their keys: terminating one may free another one of the list.
+  g_hash_table_iter_init(&iter, sessions);
+  while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&sess)) {
+    gint timeout = session_is_pending(sess) ? pending : idle;
+    if (timeout > 0 && now - sess->last_activity >= timeout) {
+      key = g_new(SessionKey, 1);
+      key->sid = g_strdup(sess->sid);
+      key->jid = g_strdup(sess->recipient);
+      expired = g_slist_prepend(expired, key);
+    }
+  }
+
+  for (el = expired; el; el = el->next) {
+    key = (SessionKey*)el->data;
+    sess = session_find_by_sid(key->sid, key->jid);
+    g_free((gchar*)key->sid);
+    g_free((gchar*)key->jid);
+    g_free(key);
+    if (sess == NULL)
+      continue;
+
+    why = session_is_pending(sess) ? JINGLE_REAP_PENDING : JINGLE_REAP_IDLE;
+    ++reaped[why];
+    scr_LogPrint(LPRINT_LOGNORM, "Jingle: session with %s %s, terminating it",
+                 sess->recipient, (why == JINGLE_REAP_PENDING) ?
+                 "was never accepted" : "is idle");
+    session_terminate(sess, (why == JINGLE_REAP_PENDING) ? "timeout"
+                                                          : "expired");
+  }
+  g_slist_free(expired);
+
+  return TRUE;
+}
+
+/**
+ * @return How many sessions the reaper terminated for the given reason
+ */
+guint session_reaped(JingleReapReason why)
+{
+  return (why < JINGLE_REAP_MAX) ? reaped[why] : 0;
+}
+
+void session_reaper_stop(void)
+{
+  if (reaper_source != 0) {
+    g_source_remove(reaper_source);
+    reaper_source = 0;
   }
-  
-  g_free(sess);
 }
 
 void jingle_handle_app(const gchar *name,
@@ -324,17 +554,9 @@ void jingle_handle_app(const gchar *name,
                        const gchar *to)
 {
   JingleSession *sess = session_find_by_app(app);
-  const gchar *xmlns = jingle_transport_for_app(xmlns_app, NULL);
-  JingleTransportFuncs *trans = jingle_get_transportfuncs(xmlns);
-  
-  if (trans == NULL) {
-    scr_LogPrint(LPRINT_LOGNORM, "Unable to find a transport for %s", xmlns_app);
-    return;
-  }
-  
-  session_add_trans(sess, name, xmlns, trans->new());
 
-  jingle_send_session_initiate(sess);
+  if (sess != NULL)
+    session_initiate(sess);
 }
 
 LmMessage *lm_message_from_jinglesession(const JingleSession *js,
@@ -378,29 +600,34 @@ static void lm_insert_sessioncontent(gpointer data, gpointer userdata)
   content->appfuncs->tomessage(content->description, node);
 }
 
-void handle_app_data(const gchar *sid, const gchar *from, const gchar *name, gchar *data, gsize size)
+void handle_app_data(const gchar *sid, const gchar *from, const gchar *name, const gchar *data, gsize size)
 {
   // TODO: check that the module is always loaded
   JingleSession *sess = session_find_by_sid(sid, from);
-  session_content *sc2 = g_new0(session_content, 1);
+  SessionContent *sc;
+
   if (sess == NULL) {
     scr_LogPrint(LPRINT_LOGNORM, "Session not found (%s)", name);
     return;
   }
-  SessionContent *sc = session_find_sessioncontent(sess, name);
-  sc2->sid = sess->sid;
-  sc2->from = (sess->origin == JINGLE_SESSION_INCOMING) ? sess->from : sess->to;
-  sc2->name = sc->name;
+  session_touch(sess);
+  sc = session_find_sessioncontent(sess, name);
+  if (sc == NULL) {
+    scr_LogPrint(LPRINT_LOGNORM, "Content not found (%s)", name);
+    return;
+  }
+  // The scheduler shares the bandwidth between the contents
   if (size != 0)
-    sc->transfuncs->send(sc2, sc->transport, data, size);
+    jingle_sched_send(sc, data, size);
   else
-    sc->transfuncs->end(sc2, sc->transport);
+    jingle_sched_end(sc);
 }
 
-void new_session_with_apps(const gchar *recipientjid, const gchar **names,
-                           gconstpointer *datas, const gchar **ns)
+JingleSession *new_session_with_apps(const gchar *recipientjid,
+                                     const gchar **names,
+                                     gconstpointer *datas, const gchar **ns)
 {
-  const gchar *myjid = g_strdup(lm_connection_get_jid(lconnection));
+  const gchar *myjid = lm_connection_get_jid(lconnection);
   gchar *sid = jingle_generate_sid();
   JingleSession *sess = session_new(sid, myjid, recipientjid, JINGLE_SESSION_OUTGOING);
   const gchar **el1 = ns;
@@ -414,4 +641,42 @@ void new_session_with_apps(const gchar *recipientjid, const gchar **names,
       break;
   }
   g_free(sid);
+  return sess;
+}
+
+/**
+ * Pick a transport for each content of a session we created, then
+ * offer them all in a single session-initiate.
+ * The contents no transport can carry are dropped, and so is the
+ * session if none is left.
+ */
+void session_initiate(JingleSession *sess)
+{
+  GSList *el, *next;
+  SessionContent *sc;
+  const gchar *xmlns;
+  JingleTransportFuncs *trans;
+
+  for (el = sess->content; el; el = next) {
+    next = el->next; // the link is freed if the content is removed
+    sc = (SessionContent*)el->data;
+    if (sc->transport != NULL)
+      continue;
+
+    xmlns = jingle_transport_for_app(sc->xmlns_desc, NULL);
+    trans = jingle_get_transportfuncs(xmlns);
+    if (trans == NULL) {
+      scr_LogPrint(LPRINT_LOGNORM, "Unable to find a transport for %s",
+                   sc->xmlns_desc);
+      session_remove_sessioncontent(sess, sc->name);
+      continue;
+    }
+    session_add_trans(sess, sc->name, xmlns, trans->new());
+  }
+
+  if (sess->content == NULL) {
+    session_delete(sess);
+    return;
+  }
+  jingle_send_session_initiate(sess);
 }
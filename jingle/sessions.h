@@ -4,6 +4,18 @@
 #include <glib.h>
 
 #include <jingle/register.h>
+#include <jingle/arena.h>
+
+/* Size of the arena blocks holding a session and its strings */
+#define JINGLE_SESSION_ARENA_SIZE 512
+
+/* Default values, in seconds, of the jingle_pending_timeout and
+ * jingle_idle_timeout settings. 0 disables the check. */
+#define JINGLE_SESSION_PENDING_TIMEOUT 300
+#define JINGLE_SESSION_IDLE_TIMEOUT    600
+
+/* Interval, in seconds, between two runs of the session reaper */
+#define JINGLE_SESSION_REAPER_TICK     5
 
 
 typedef enum {
@@ -21,6 +33,11 @@ typedef enum {
 } SessionOrigin;
 
 typedef struct {
+  /* The session and its strings are allocated from this arena and
+   * released with the session. Contents are not: they come and go
+   * during the session, each one is freed once removed. */
+  JingleArena *arena;
+
   /* Random session identifier generated by the initator. */
   gchar *sid;
 
@@ -39,8 +56,20 @@ typedef struct {
    * origin. Should not be freed when destroying a JingleSession. */
   gchar *recipient;
 
-  /* A singly-linked list of content. */
+  /* A singly-linked list of content. Only sessions.c may add or
+   * remove some: a removed content and its link are freed at once. */
   GSList *content;
+
+  /* Id of the /event asking the user to accept the session, if any */
+  gchar *evid;
+
+  /* The user accepted the session, the session-accept is sent once the
+   * apps of every content are ready. */
+  gboolean accepting;
+
+  /* Monotonic time, in seconds, of the last IQ or data exchanged
+   * in this session. */
+  gint64 last_activity;
 } JingleSession;
 
 typedef struct {
@@ -48,11 +77,14 @@ typedef struct {
    *  according to the creator" */
   gchar *name;
 
+  /* The session this content belongs to. */
+  JingleSession *session;
+
   /* */
   SessionState state;
 
-  /* The namespace of the app */
-  gchar *xmlns_desc;
+  /* The namespace of the app (interned string) */
+  const gchar *xmlns_desc;
 
   /* The internal struct of the app module */
   gconstpointer description;
@@ -60,26 +92,44 @@ typedef struct {
   /* Struct of functions provided by the app module */
   JingleAppFuncs *appfuncs;
 
-  /* The namespace of the transport */
-  gchar *xmlns_trans;
+  /* The namespace of the transport (interned string) */
+  const gchar *xmlns_trans;
 
   /* The internal struct of the transport module */
   gconstpointer transport;
 
   /* Struct of functions provided by the transport module */
   JingleTransportFuncs *transfuncs;
+
+  /* Handle given to the app and transport modules to designate this
+   * content. It lives as long as the content, so it is never freed
+   * by the modules. */
+  session_content handle;
 } SessionContent;
 
+/* Why the reaper tore down a session */
+typedef enum {
+  /* Not accepted within jingle_pending_timeout seconds */
+  JINGLE_REAP_PENDING,
+  /* Nothing exchanged for jingle_idle_timeout seconds */
+  JINGLE_REAP_IDLE,
+  JINGLE_REAP_MAX
+} JingleReapReason;
+
 
 // Manage sessions:
 //    Inititiator:
-void new_session_with_apps(const gchar *recipientjid, const gchar **name,
-                           gconstpointer *datas, const gchar **ns);
+JingleSession *new_session_with_apps(const gchar *recipientjid,
+                                     const gchar **name,
+                                     gconstpointer *datas, const gchar **ns);
+void session_initiate(JingleSession *sess);
 
 //    Responder:
 JingleSession *session_new_from_jinglenode(JingleNode *jn);
 SessionContent *session_add_content_from_jinglecontent(JingleSession *sess,
                            JingleContent *cn, SessionState state, GError **err);
+void session_accept(JingleSession *sess);
+void session_app_ready(gconstpointer data);
 
 //    Both:
 JingleSession *session_new(const gchar *sid, const gchar *from,
@@ -87,6 +137,10 @@ JingleSession *session_new(const gchar *sid, const gchar *from,
 void session_delete(JingleSession *sess);
 void session_remove(JingleSession *sess);
 void session_free(JingleSession *sess);
+void session_terminate(JingleSession *sess, const gchar *reason);
+void session_touch(JingleSession *sess);
+guint session_reaped(JingleReapReason why);
+void session_reaper_stop(void);
 SessionContent *session_add_content(JingleSession *sess, const gchar *name,
                                     SessionState state);
 
@@ -120,5 +174,5 @@ void jingle_handle_app(const gchar *name,
                        const gchar *to);
 LmMessage *lm_message_from_jinglesession(const JingleSession *js,
                                          JingleAction action);
-void handle_app_data(const gchar *sid, const gchar* from, const gchar *name, gchar *data, gsize size);
+void handle_app_data(const gchar *sid, const gchar* from, const gchar *name, const gchar *data, gsize size);
 #endif
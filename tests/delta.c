@@ -0,0 +1,271 @@
+/*
+ * delta.c
+ *
+ * Copyright (C) 2026 mcabber-jingle contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+/*
+ * Encodes a file against the signature of an older version, decodes it
+ * again and compares: with blocks in common, with the data cut in the
+ * middle of the instructions, with holes, and with a copy of blocks the
+ * receiver does not have.
+ */
+
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include <mcabber/settings.h>
+
+#include <jingle-ft/delta.h>
+
+#define OLD_SIZE 1000000
+
+/* delta.c only reads jingle_ft_delta */
+const gchar *settings_get(guint type, const gchar *key)
+{
+  return NULL;
+}
+
+int settings_get_int(guint type, const gchar *key)
+{
+  return 0;
+}
+
+static gint failed = 0;
+
+static void check(gboolean ok, const gchar *what)
+{
+  if (!ok) {
+    fprintf(stderr, "FAIL: %s\n", what);
+    failed++;
+  }
+}
+
+/* What the decoder rebuilt */
+static gboolean rebuilt_write(gpointer user_data, const gchar *data,
+                              gsize len, GError **err)
+{
+  GByteArray *rebuilt = (GByteArray *)user_data;
+  guint at = rebuilt->len;
+
+  g_byte_array_set_size(rebuilt, at + len);
+  if (data != NULL)
+    memcpy(rebuilt->data + at, data, len);
+  else
+    memset(rebuilt->data + at, 0, len);
+  return TRUE;
+}
+
+/**
+ * Give the decoder the data cut in pieces of cut bytes
+ */
+static gboolean decode_by(JingleFTDelta *dec, GByteArray *wire, gsize cut,
+                          GByteArray *rebuilt, GError **err)
+{
+  gsize i, n;
+
+  for (i = 0; i < wire->len; i += n) {
+    n = MIN(cut, wire->len - i);
+    if (!jingle_ft_delta_decode(dec, (const gchar *)wire->data + i, n,
+                                rebuilt_write, rebuilt, err))
+      return FALSE;
+  }
+  return TRUE;
+}
+
+static void signed_cb(gpointer user_data)
+{
+  *(gboolean *)user_data = TRUE;
+}
+
+/**
+ * A decoder of the old version, once its signature is computed
+ */
+static JingleFTDelta *decoder_new(const gchar *path)
+{
+  gboolean done = FALSE;
+  JingleFTDelta *dec = jingle_ft_delta_new_decoder(path, signed_cb, &done);
+
+  while (dec != NULL && !done)
+    g_main_context_iteration(NULL, TRUE);
+  return dec;
+}
+
+/**
+ * The old version with a few bytes inserted, a part dropped and a part
+ * changed, sent cut in pieces of each size
+ */
+static void test_roundtrip(const gchar *path, const guchar *old)
+{
+  static const gsize cuts[] = { 1, 5, 9, 333, 65536 };
+  GByteArray *new = g_byte_array_new();
+  GByteArray *wire = g_byte_array_new();
+  JingleFTDelta *enc, *dec;
+  const gchar *signature;
+  guint block, c;
+  guint64 pos = 0;
+  gsize sent;
+
+  g_byte_array_append(new, old, 300000);
+  g_byte_array_append(new, (const guint8 *)"inserted", 8);
+  g_byte_array_append(new, old + 300000, 200000);
+  g_byte_array_append(new, old + 600000, OLD_SIZE - 600000);
+  new->data[new->len - 10] ^= 0xff;
+
+  dec = decoder_new(path);
+  check(dec != NULL, "decoder of the old version");
+  if (dec == NULL)
+    return;
+  signature = jingle_ft_delta_get_signature(dec, &block);
+  check(signature != NULL, "signature computed");
+  enc = jingle_ft_delta_new_encoder(block, signature);
+  check(enc != NULL, "encoder from the signature");
+
+  // In pieces of various sizes, as the transport asks for them
+  while (enc != NULL && pos < new->len) {
+    sent = jingle_ft_delta_encode(enc, (const gchar *)new->data, new->len,
+                                  pos, (pos / block) % 2 ? 3000 : 70000,
+                                  wire);
+    check(sent > 0, "encoder moves on");
+    if (sent == 0)
+      break;
+    pos += sent;
+  }
+  check(wire->len < new->len / 10, "blocks in common are not sent");
+
+  for (c = 0; c < G_N_ELEMENTS(cuts); c++) {
+    GByteArray *rebuilt = g_byte_array_new();
+    JingleFTDelta *cutdec = c == 0 ? dec : decoder_new(path);
+    GError *err = NULL;
+    gchar *what = g_strdup_printf("rebuilt from pieces of %"
+                                  G_GSIZE_FORMAT " bytes", cuts[c]);
+
+    check(decode_by(cutdec, wire, cuts[c], rebuilt, &err), what);
+    check(rebuilt->len == new->len &&
+          !memcmp(rebuilt->data, new->data, new->len), what);
+    if (err != NULL)
+      g_error_free(err);
+    g_free(what);
+    if (cutdec != dec)
+      jingle_ft_delta_free(cutdec);
+    g_byte_array_free(rebuilt, TRUE);
+  }
+
+  jingle_ft_delta_free(enc);
+  jingle_ft_delta_free(dec);
+  g_byte_array_free(wire, TRUE);
+  g_byte_array_free(new, TRUE);
+}
+
+/**
+ * Data, a hole, data, rebuilt without older version
+ */
+static void test_holes(const guchar *old)
+{
+  GByteArray *wire = g_byte_array_new();
+  GByteArray *rebuilt = g_byte_array_new();
+  JingleFTDelta *dec = jingle_ft_delta_new_sparse();
+  GError *err = NULL;
+  gsize i;
+  gboolean zeros = TRUE;
+
+  jingle_ft_delta_literal(wire, (const gchar *)old, 1000);
+  jingle_ft_delta_hole(wire, 199000);
+  jingle_ft_delta_literal(wire, (const gchar *)old + 200000, 100000);
+  check(wire->len < 110000, "holes are not sent");
+
+  check(decode_by(dec, wire, 7, rebuilt, &err), "sparse file rebuilt");
+  check(rebuilt->len == 300000, "sparse file size");
+  for (i = 1000; i < 200000 && rebuilt->len == 300000; i++)
+    zeros = zeros && rebuilt->data[i] == 0;
+  check(zeros, "hole read as zeros");
+  check(rebuilt->len == 300000 && !memcmp(rebuilt->data, old, 1000) &&
+        !memcmp(rebuilt->data + 200000, old + 200000, 100000),
+        "data around the hole");
+
+  if (err != NULL)
+    g_error_free(err);
+  jingle_ft_delta_free(dec);
+  g_byte_array_free(rebuilt, TRUE);
+  g_byte_array_free(wire, TRUE);
+}
+
+/**
+ * A copy of blocks past the end of the old version is refused
+ */
+static void test_invalid_range(const gchar *path)
+{
+  static const guchar past[] = { 'B', 0, 0, 0, 240, 0, 0, 0, 20 };
+  static const guchar wrap[] = { 'B', 0, 0, 0, 1, 255, 255, 255, 255 };
+  static const guchar none[] = { 'B', 0, 0, 0, 0, 0, 0, 0, 0 };
+  static const guchar *bad[] = { past, wrap, none };
+  guint i;
+
+  for (i = 0; i < G_N_ELEMENTS(bad); i++) {
+    GByteArray *rebuilt = g_byte_array_new();
+    JingleFTDelta *dec = decoder_new(path);
+    GError *err = NULL;
+
+    check(!jingle_ft_delta_decode(dec, (const gchar *)bad[i], sizeof(past),
+                                  rebuilt_write, rebuilt, &err),
+          "invalid block range refused");
+    check(err != NULL, "invalid block range reported");
+    check(rebuilt->len == 0, "nothing written for an invalid range");
+    if (err != NULL)
+      g_error_free(err);
+    jingle_ft_delta_free(dec);
+    g_byte_array_free(rebuilt, TRUE);
+  }
+}
+
+int main(int argc, char **argv)
+{
+  guchar *old = g_malloc(OLD_SIZE);
+  GRand *rand = g_rand_new_with_seed(1);
+  gchar *path = NULL;
+  gsize i;
+  gint fd;
+
+#if !GLIB_CHECK_VERSION(2, 32, 0)
+  g_thread_init(NULL);
+#endif
+
+  for (i = 0; i < OLD_SIZE; i++)
+    old[i] = g_rand_int(rand);
+  g_rand_free(rand);
+
+  fd = g_file_open_tmp("jft-delta-XXXXXX", &path, NULL);
+  if (fd < 0 || write(fd, old, OLD_SIZE) != OLD_SIZE) {
+    fprintf(stderr, "cannot write the old version\n");
+    return 1;
+  }
+  close(fd);
+
+  test_roundtrip(path, old);
+  test_holes(old);
+  test_invalid_range(path);
+
+  jingle_ft_delta_uninit();
+  g_unlink(path);
+  g_free(path);
+  g_free(old);
+  return failed == 0 ? 0 : 1;
+}